@@ -4,21 +4,404 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-#include "queue.h"
 #include "sem.h"
-#include "thread.h"
+
+#define SEM_SPIN_MIN_NS		500	// time a thread always spins before parking, when spinning is on
+#define SEM_SPIN_MAX_NS		20000	// upper bound of the learned spin budget; longer waits are not worth spinning for
+#define SEM_SPIN_INIT_NS	2000	// spin budget of a new semaphore
+#define SEM_SPIN_PAUSE_MAX	64	// bound of the exponential pause backoff, in pause instructions; the CPU is yielded beyond
+
+#define SEM_WAITERS	0x80000000u	// bit of the count word set while threads may be sleeping on it
+#define SEM_BATCH	0x40000000u	// bit of the count word set while some of these threads may need several resources
+
+// a thread waiting on a SEM_HANDOFF semaphore; it lives on the stack of the thread
+typedef struct sem_waiter {
+	struct sem_waiter* next; // next waiter in the queue, which came later
+	struct sem_waiter* prev; // previous waiter in the queue, so that a waiter giving up leaves it in constant time
+	unsigned int need; // number of resources the thread waits for
+	_Atomic unsigned int granted; // set once sem_up() handed a resource over; also the futex word the thread sleeps on
+} sem_waiter;
 
 struct semaphore {
-	queue_t blocked_queue;
-	size_t count;
+	_Atomic unsigned int count; // available resources, up to SEM_COUNT_MAX, along with the SEM_WAITERS and SEM_BATCH bits; also the futex word blocked threads sleep on
+	_Atomic unsigned int waiters; // number of threads that found no resource, and may be sleeping; a thread leaves it last, once done with the semaphore
+	_Atomic unsigned int batch_waiters; // number of these threads that need more than one resource
+	_Atomic unsigned int spinners; // number of threads spinning before they join the waiters; a thread leaves it last, once done with the semaphore or counted in the waiters
+	_Atomic unsigned int spin_ns; // learned time to spin before parking, in nanoseconds
+	_Atomic uint64_t spin_hits; // waits that ended while spinning
+	_Atomic uint64_t parks; // waits that went on to the futex
+	int flags; // SEM_* flags given to sem_create_ex()
+	pthread_mutex_t lock; // with SEM_HANDOFF, protects the queue of waiters, and the count while it is 0
+	sem_waiter* head; // with SEM_HANDOFF, oldest waiter, which gets the next resource
+	sem_waiter* tail; // with SEM_HANDOFF, latest waiter
+	unsigned int banked; // with SEM_HANDOFF, resources set aside for the oldest waiter, which needs more of them
 };
 
-// create a semaphore with a given @count
+static _Atomic int sem_spin = 1; // global setting of the spinning in sem_down(): 0 for off, 1 for on, SEM_SPIN_FORCE for on even with a single CPU
+static _Atomic long sem_cpus = 0; // number of online CPUs, read on the first sem_create(); spinning needs another CPU to run sem_up()
+
+// HELPER FUNCTION: read the monotonic clock, in nanoseconds
+static uint64_t now_ns_helper(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// HELPER FUNCTION: tell the CPU that we are spinning
+static inline void cpu_relax_helper(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// HELPER FUNCTION: convert the CLOCK_MONOTONIC time @ts to nanoseconds
+// a time too far away to count in nanoseconds saturates, so that it still lies in the future
+static uint64_t timespec_ns_helper(const struct timespec* ts)
+{
+	if (ts->tv_sec < 0) {
+		return 0;
+	}
+	if ((uint64_t)ts->tv_sec >= UINT64_MAX / 1000000000) {
+		return UINT64_MAX;
+	}
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// HELPER FUNCTION: sleep on the futex word @word as long as it holds @expected, or until woken up, or until the CLOCK_MONOTONIC time @deadline if not NULL
+// spurious wake-ups are possible, so the caller checks again
+// return false if @deadline passed
+// return true otherwise
+static bool futex_wait_helper(_Atomic unsigned int* word, unsigned int expected, const struct timespec* deadline)
+{
+	// unlike FUTEX_WAIT, FUTEX_WAIT_BITSET takes an absolute time, so a wait resumed after a spurious wake-up does not need it recomputed
+	if ((syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY) == -1) && (errno == ETIMEDOUT)) {
+		return false;
+	}
+	return true;
+}
+
+// HELPER FUNCTION: wake up at most @n threads sleeping on the futex word @word
+static void futex_wake_helper(_Atomic unsigned int* word, int n)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// HELPER FUNCTION: take @n resources from @sem at once if they are available, with a single CAS and no lock
+// either all of them are taken or none, so threads taking several resources never hold part of them while waiting
+// return false if the count of @sem is less than @n
+// return true if the resources were taken
+static bool take_helper(struct semaphore* sem, unsigned int n)
+{
+	unsigned int word = atomic_load_explicit(&(sem->count), memory_order_relaxed);
+	while ((word & SEM_COUNT_MAX) >= n) {
+		if (atomic_compare_exchange_weak_explicit(&(sem->count), &word, word - n,
+				memory_order_acquire, memory_order_relaxed)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// HELPER FUNCTION: learn from a wait of @waited nanoseconds on @sem, which ended with a resource
+// the spin budget moves towards twice the wait, so that a spin covers the usual waits, and shrinks after waits too long to spin for
+static void learn_helper(struct semaphore* sem, uint64_t waited)
+{
+	int64_t budget = atomic_load_explicit(&(sem->spin_ns), memory_order_relaxed);
+	if (waited > SEM_SPIN_MAX_NS) {
+		budget -= budget / 8;
+	}
+	else {
+		budget += ((int64_t)(2 * waited) - budget) / 8;
+	}
+
+	if (budget < SEM_SPIN_MIN_NS) {
+		budget = SEM_SPIN_MIN_NS;
+	}
+	else if (budget > SEM_SPIN_MAX_NS) {
+		budget = SEM_SPIN_MAX_NS;
+	}
+	atomic_store_explicit(&(sem->spin_ns), (unsigned int)budget, memory_order_relaxed);
+}
+
+// HELPER FUNCTION: spin on @sem, waiting for @n resources since @start, for the spin budget learned on @sem, and at most until @until nanoseconds
+// the CPU is paused with an exponential backoff between two checks, then yielded, which lets sem_up() run on a busy machine
+// return false if the resources did not become available within the budget
+// return true if the resources were taken
+static bool spin_helper(struct semaphore* sem, unsigned int n, uint64_t start, uint64_t until)
+{
+	uint64_t budget = atomic_load_explicit(&(sem->spin_ns), memory_order_relaxed);
+	if (until < start + budget) {
+		budget = (until > start) ? until - start : 0;
+	}
+	unsigned int pauses = 1;
+
+	for (;;) {
+		if (pauses <= SEM_SPIN_PAUSE_MAX) {
+			for (unsigned int i = 0; i < pauses; ++i) {
+				cpu_relax_helper();
+			}
+			pauses *= 2;
+		}
+		else {
+			sched_yield();
+		}
+
+		uint64_t waited = now_ns_helper() - start;
+		if (take_helper(sem, n)) {
+			learn_helper(sem, waited);
+			atomic_fetch_add_explicit(&(sem->spin_hits), 1, memory_order_relaxed);
+			return true;
+		}
+		if (waited >= budget) {
+			return false;
+		}
+	}
+}
+
+// HELPER FUNCTION: hand the resources banked on the SEM_HANDOFF semaphore @sem over to the oldest waiters, as long as they cover what the oldest one needs
+// the caller holds the lock of @sem; resources left once nobody waits go back to the count
+// a woken thread may return before its wake-up is sent, so the futex word on its stack may be gone by then; the wake-up is then spurious for whoever uses the address, which every futex user tolerates
+// the thread may even destroy @sem, but sem_destroy() waits for the lock, so @sem itself stays valid here
+static void grant_helper(struct semaphore* sem)
+{
+	sem_waiter* waiter;
+	while ((waiter = sem->head) && (waiter->need <= sem->banked)) {
+		sem->banked -= waiter->need;
+		sem->head = waiter->next;
+		if (sem->head) {
+			sem->head->prev = NULL;
+		}
+		else {
+			sem->tail = NULL;
+		}
+		atomic_fetch_sub_explicit(&(sem->waiters), 1, memory_order_relaxed);
+		atomic_store_explicit(&(waiter->granted), 1, memory_order_release);
+		futex_wake_helper(&(waiter->granted), 1);
+	}
+
+	if ((!sem->head) && (sem->banked > 0)) {
+		atomic_fetch_add_explicit(&(sem->count), sem->banked, memory_order_release);
+		sem->banked = 0;
+	}
+}
+
+// HELPER FUNCTION: wait on the SEM_HANDOFF semaphore @sem, whose count was less than @n, until @n resources are handed over, or until @deadline if not NULL
+// the thread joins the queue of waiters, and returns as soon as it is granted its resources, without checking the count again
+// return false if @deadline passed first; the thread then left the queue
+// return true if the resources were taken
+static bool handoff_wait_helper(struct semaphore* sem, unsigned int n, const struct timespec* deadline)
+{
+	pthread_mutex_lock(&(sem->lock));
+	// the count only becomes positive under the lock, when no thread is waiting
+	if (take_helper(sem, n)) {
+		pthread_mutex_unlock(&(sem->lock));
+		return true;
+	}
+
+	sem_waiter self = { .next = NULL, .prev = sem->tail, .need = n };
+	atomic_init(&(self.granted), 0);
+	if (sem->tail) {
+		sem->tail->next = &self;
+	}
+	else {
+		sem->head = &self;
+	}
+	sem->tail = &self;
+	atomic_fetch_add_explicit(&(sem->waiters), 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&(sem->parks), 1, memory_order_relaxed);
+	// the resources left are set aside for the queue, so that later threads cannot take them first
+	sem->banked += atomic_exchange_explicit(&(sem->count), 0, memory_order_acquire);
+	grant_helper(sem);
+	pthread_mutex_unlock(&(sem->lock));
+
+	while (!atomic_load_explicit(&(self.granted), memory_order_acquire)) {
+		if (!futex_wait_helper(&(self.granted), 0, deadline)) {
+			break;
+		}
+	}
+	if (atomic_load_explicit(&(self.granted), memory_order_acquire)) {
+		return true;
+	}
+
+	// resources are only granted under the lock: either sem_up() handed them over meanwhile, and they are kept, or nobody can anymore
+	pthread_mutex_lock(&(sem->lock));
+	if (atomic_load_explicit(&(self.granted), memory_order_acquire)) {
+		pthread_mutex_unlock(&(sem->lock));
+		return true;
+	}
+	if (self.prev) {
+		self.prev->next = self.next;
+	}
+	else {
+		sem->head = self.next;
+	}
+	if (self.next) {
+		self.next->prev = self.prev;
+	}
+	else {
+		sem->tail = self.prev;
+	}
+	atomic_fetch_sub_explicit(&(sem->waiters), 1, memory_order_relaxed);
+	// the resources banked for this thread may be enough for the ones behind it, or go back to the count
+	grant_helper(sem);
+	pthread_mutex_unlock(&(sem->lock));
+	return false;
+}
+
+// HELPER FUNCTION: release @n resources of the SEM_HANDOFF semaphore @sem, handing them over to the oldest waiters if any
+static void handoff_release_helper(struct semaphore* sem, unsigned int n)
+{
+	pthread_mutex_lock(&(sem->lock));
+	if (!sem->head) {
+		atomic_fetch_add_explicit(&(sem->count), n, memory_order_release);
+	}
+	else {
+		sem->banked += n;
+		grant_helper(sem);
+	}
+	pthread_mutex_unlock(&(sem->lock));
+}
+
+// HELPER FUNCTION: wake up the threads blocked on @sem, to which @n resources were released, given the count word @word seen by the release
+// a thread waiting for several resources may be waiting for any number of them, so everybody is woken up to check
+// only the address of @sem is used, so that a thread which took a released resource may already have destroyed it
+static void wake_helper(struct semaphore* sem, unsigned int word, unsigned int n)
+{
+	futex_wake_helper(&(sem->count), (word & SEM_BATCH) ? INT_MAX : (int)n);
+}
+
+// HELPER FUNCTION: clear the bits of the count word of @sem that the thread leaving wait_helper() after waiting for @n resources was the last one to need
+// a thread may announce itself meanwhile, and sleep on the word with the bits set, so they are set again if one did, and everybody is woken up to check
+static void leave_helper(struct semaphore* sem, unsigned int n)
+{
+	unsigned int bits = 0;
+	if (atomic_load(&(sem->waiters)) == 1) {
+		bits = SEM_WAITERS | SEM_BATCH;
+	}
+	else if ((n > 1) && (atomic_load(&(sem->batch_waiters)) == 1)) {
+		bits = SEM_BATCH;
+	}
+	if (bits == 0) {
+		return;
+	}
+
+	atomic_fetch_and(&(sem->count), ~bits);
+	// pairs with wait_helper(): a thread counts itself before setting the bits, so either the bits are set after ours were cleared, or we see it
+	if (((bits & SEM_WAITERS) && (atomic_load(&(sem->waiters)) > 1))
+			|| (atomic_load(&(sem->batch_waiters)) > ((n > 1) ? 1 : 0))) {
+		atomic_fetch_or(&(sem->count), bits);
+		futex_wake_helper(&(sem->count), INT_MAX);
+	}
+}
+
+// HELPER FUNCTION: take @n resources from @sem, whose count was less than @n, blocking until they are available, or until the CLOCK_MONOTONIC time @deadline if not NULL
+// return false if @deadline passed first
+// return true if the resources were taken
+static bool wait_helper(struct semaphore* sem, unsigned int n, const struct timespec* deadline)
+{
+	// a caller shedding load often passes a deadline already gone; the futex would only fail after arming a timer
+	if (deadline && (now_ns_helper() >= timespec_ns_helper(deadline))) {
+		return take_helper(sem, n);
+	}
+
+	if (sem->flags & SEM_HANDOFF) {
+		return handoff_wait_helper(sem, n, deadline);
+	}
+
+	int mode = atomic_load_explicit(&sem_spin, memory_order_relaxed);
+	bool spin = (mode == SEM_SPIN_FORCE) || (mode && (atomic_load_explicit(&sem_cpus, memory_order_relaxed) > 1));
+	uint64_t start = spin ? now_ns_helper() : 0;
+	if (spin) {
+		// sem_destroy() checks the spinners, so a spinning thread keeps @sem alive like a sleeping one
+		atomic_fetch_add(&(sem->spinners), 1);
+		if (spin_helper(sem, n, start, deadline ? timespec_ns_helper(deadline) : UINT64_MAX)) {
+			atomic_fetch_sub(&(sem->spinners), 1);
+			return true;
+		}
+	}
+	atomic_fetch_add_explicit(&(sem->parks), 1, memory_order_relaxed);
+
+	// announce the wait in the count word before sleeping on it, so that sem_up() either sees the bits in the word it adds to, or the word we sleep on changes
+	unsigned int bits = SEM_WAITERS;
+	if (n > 1) {
+		atomic_fetch_add(&(sem->batch_waiters), 1);
+		bits |= SEM_BATCH;
+	}
+	atomic_fetch_add(&(sem->waiters), 1);
+	if (spin) {
+		// counted in the waiters first, so that sem_destroy() never sees the thread in neither
+		atomic_fetch_sub(&(sem->spinners), 1);
+	}
+	bool taken;
+	while (!(taken = take_helper(sem, n))) {
+		unsigned int word = atomic_fetch_or(&(sem->count), bits) | bits;
+		if (((word & SEM_COUNT_MAX) < n) && (!futex_wait_helper(&(sem->count), word, deadline))) {
+			// released resources stay in the count, so a timed-out thread loses none; it still takes them if they just came
+			taken = take_helper(sem, n);
+			break;
+		}
+	}
+	if (spin && taken) {
+		learn_helper(sem, now_ns_helper() - start);
+	}
+	leave_helper(sem, n);
+
+	// sem_up() only wakes a thread up when the count leaves 0, so pass the wake-up on while resources are left
+	// a thread timing out may have been the one woken up, so it passes the wake-up on as well
+	unsigned int word = atomic_load(&(sem->count));
+	if ((word & SEM_WAITERS) && ((word & SEM_COUNT_MAX) > 0)) {
+		wake_helper(sem, word, 1);
+	}
+
+	// sem_destroy() checks the waiters, so this is the last access to @sem
+	if (n > 1) {
+		atomic_fetch_sub(&(sem->batch_waiters), 1);
+	}
+	atomic_fetch_sub(&(sem->waiters), 1);
+	return taken;
+}
+
+// HELPER FUNCTION: release @n resources to @sem, and wake up the threads blocked on it if needed
+static void release_helper(struct semaphore* sem, unsigned int n)
+{
+	if (sem->flags & SEM_HANDOFF) {
+		handoff_release_helper(sem, n);
+		return;
+	}
+
+	// once the resources are in the count, a thread may take them and destroy @sem: whether to wake threads up is decided from the word the resources were added to
+	unsigned int word = atomic_fetch_add(&(sem->count), n);
+	if ((word & SEM_WAITERS) && (((word & SEM_COUNT_MAX) == 0) || (word & SEM_BATCH))) {
+		wake_helper(sem, word, n);
+	}
+}
+
+// create a semaphore with a given @count, and the SEM_* @flags
 // return the pointer to the semaphore
-// return NULL if failed to create
-sem_t sem_create(size_t count)
+// return NULL if failed to create, if @count is larger than SEM_COUNT_MAX, or if @flags holds an unknown flag
+sem_t sem_create_ex(size_t count, int flags)
 {
+	if ((count > SEM_COUNT_MAX) || (flags & ~SEM_HANDOFF)) {
+		return NULL;
+	}
+
+	if (atomic_load_explicit(&sem_cpus, memory_order_relaxed) == 0) {
+		atomic_store_explicit(&sem_cpus, sysconf(_SC_NPROCESSORS_ONLN), memory_order_relaxed);
+	}
+
 	struct semaphore *sem = (struct semaphore*)
 			malloc(sizeof(struct semaphore));
 
@@ -26,22 +409,52 @@ sem_t sem_create(size_t count)
 		return NULL;
 	}
 
-	sem->blocked_queue = queue_create();
-	sem->count = count;
+	atomic_init(&(sem->count), (unsigned int)count);
+	atomic_init(&(sem->waiters), 0);
+	atomic_init(&(sem->batch_waiters), 0);
+	atomic_init(&(sem->spinners), 0);
+	atomic_init(&(sem->spin_ns), SEM_SPIN_INIT_NS);
+	atomic_init(&(sem->spin_hits), 0);
+	atomic_init(&(sem->parks), 0);
+	sem->flags = flags;
+	sem->head = NULL;
+	sem->tail = NULL;
+	sem->banked = 0;
+	if ((flags & SEM_HANDOFF) && (pthread_mutex_init(&(sem->lock), NULL) != 0)) {
+		free(sem);
+		return NULL;
+	}
 
 	return sem;
 }
 
+// create a semaphore with a given @count, which lets any thread take a released resource
+// return the pointer to the semaphore
+// return NULL if failed to create, or if @count is larger than SEM_COUNT_MAX
+sem_t sem_create(size_t count)
+{
+	return sem_create_ex(count, 0);
+}
+
 // destroy the specified @sem
-// return -1 if @sem is NULL or nonempty
+// with SEM_HANDOFF, a thread granted a resource may return from sem_down() while sem_up() still holds the lock, so the lock is taken once more: sem_up() is then done with @sem
+// return -1 if @sem is NULL or if threads are still blocked on it, sleeping or spinning; @sem is then left untouched
 // return 0 if succeeded
 int sem_destroy(sem_t sem)
 {
 	if (!sem) {
 		return -1;
 	}
-	else if (queue_destroy(sem->blocked_queue) == -1) {
-		free(sem);
+	if (sem->flags & SEM_HANDOFF) {
+		pthread_mutex_lock(&(sem->lock));
+		bool blocked = (atomic_load(&(sem->waiters)) > 0);
+		pthread_mutex_unlock(&(sem->lock));
+		if (blocked) {
+			return -1;
+		}
+		pthread_mutex_destroy(&(sem->lock));
+	}
+	else if ((atomic_load(&(sem->waiters)) > 0) || (atomic_load(&(sem->spinners)) > 0)) {
 		return -1;
 	}
 	free(sem);
@@ -50,6 +463,9 @@ int sem_destroy(sem_t sem)
 
 // take a resource from semaphore @sem
 // taking an unavailable semaphore will cause the caller thread to be blocked, until the semaphore becomes available
+// an available resource is taken with a single CAS; only a thread that has to wait goes to sleep, on the futex of @sem
+// unless spinning is turned off, or there is a single CPU, the thread first spins for a while, since the resource often comes back soon
+// with SEM_HANDOFF, the thread instead waits in line right away, and gets a resource from sem_up() directly
 // return -1 if @sem is NULL
 // return 0 if the action is successful
 int sem_down(sem_t sem)
@@ -58,22 +474,63 @@ int sem_down(sem_t sem)
 		return -1;
 	}
 
-	enter_critical_section();
+	if (!take_helper(sem, 1)) {
+		wait_helper(sem, 1, NULL);
+	}
+	return 0;
+}
+
+// take a resource from semaphore @sem if one is available, without blocking
+// a single CAS if a resource is available, and a single load otherwise: no lock and no system call, even with SEM_HANDOFF
+// with SEM_HANDOFF, the count is only positive when nobody waits, so the thread cannot overtake the queue
+// return -1 if @sem is NULL, or if no resource is available
+// return 0 if the action is successful
+int sem_trydown(sem_t sem)
+{
+	if ((!sem) || (!take_helper(sem, 1))) {
+		return -1;
+	}
+	return 0;
+}
+
+// take a resource from semaphore @sem, blocking at most until @abs_deadline, a CLOCK_MONOTONIC time
+// the thread waits as in sem_down(), but its futex wait ends at @abs_deadline; it spins no longer than that either
+// with SEM_HANDOFF, a thread timing out leaves the queue in constant time, under the lock: a resource sem_up() handed over before is kept, and no resource is lost
+// return -1 if @sem or @abs_deadline is NULL, if @abs_deadline is not a valid time, or if @abs_deadline passed before a resource was available
+// return 0 if the action is successful
+int sem_timeddown(sem_t sem, const struct timespec *abs_deadline)
+{
+	if ((!sem) || (!abs_deadline) || (abs_deadline->tv_nsec < 0) || (abs_deadline->tv_nsec >= 1000000000)) {
+		return -1;
+	}
 
-	pthread_t tid = pthread_self();
-	if (sem->count == 0) {
-		queue_enqueue(sem->blocked_queue, (void*)tid);
-		thread_block();
+	if ((!take_helper(sem, 1)) && (!wait_helper(sem, 1, abs_deadline))) {
+		return -1;
 	}
-	--(sem->count);
+	return 0;
+}
 
-	exit_critical_section();
+// take @n resources from semaphore @sem at once
+// the caller thread is blocked until @n resources are available, and takes them all together, so that threads taking several resources cannot deadlock by each holding part of them
+// with SEM_HANDOFF, the thread waits in line, and the threads behind it wait until it got all its resources
+// return -1 if @sem is NULL, or if @n is larger than SEM_COUNT_MAX
+// return 0 if the action is successful
+int sem_down_n(sem_t sem, size_t n)
+{
+	if ((!sem) || (n > SEM_COUNT_MAX)) {
+		return -1;
+	}
 
+	if ((n > 0) && (!take_helper(sem, (unsigned int)n))) {
+		wait_helper(sem, (unsigned int)n, NULL);
+	}
 	return 0;
 }
 
 // release a resource from semaphore @sem
-// if the waiting list associated to @sem is not empty, releasing a resource also causes the first (oldest) thread in the waiting list to be unblocked
+// if threads are blocked on @sem, releasing a resource also wakes one of them up, which then takes the resource unless another thread took it first
+// a thread is only woken up when the count leaves 0: until it runs, the next resources are left for it, and it wakes the next thread up
+// with SEM_HANDOFF, the resource is instead handed over to the oldest blocked thread, and no other thread can take it
 // return -1 if @sem is NULL
 // return 0 if the action is successful
 int sem_up(sem_t sem)
@@ -82,38 +539,67 @@ int sem_up(sem_t sem)
 		return -1;
 	}
 
-	enter_critical_section();
-
-	++(sem->count);
+	release_helper(sem, 1);
+	return 0;
+}
 
-	void* ptr = NULL;
-	int dequeue_ret = queue_dequeue(sem->blocked_queue, (void**)&ptr);
-	if (dequeue_ret == 0) {
-		pthread_t tid = (pthread_t)ptr;
-		thread_unblock(tid);
+// release @n resources to semaphore @sem at once
+// up to @n blocked threads are woken up (or handed a resource over, with SEM_HANDOFF) in a single pass
+// return -1 if @sem is NULL, or if @n is larger than SEM_COUNT_MAX
+// return 0 if the action is successful
+int sem_up_n(sem_t sem, size_t n)
+{
+	if ((!sem) || (n > SEM_COUNT_MAX)) {
+		return -1;
 	}
 
-	exit_critical_section();
+	if (n > 0) {
+		release_helper(sem, (unsigned int)n);
+	}
 	return 0;
 }
 
 // inspect internal state of @sem, and propagate the result to @sval
 // if @sem's count > 0, propagate the internal count to @sval
-// if @sem's count == 0, propagate the negative of the number of blocked threads to @sval
+// if @sem's count == 0, propagate the negative of the number of blocked threads, sleeping or spinning, to @sval
 // return -1 if @sem or @sval is NULL
 // return 0 if succeeded
 int sem_getvalue(sem_t sem, int *sval)
 {
-	if ((!sem) && (!sval)) {
+	if ((!sem) || (!sval)) {
 		return -1;
 	}
 
-	int size_blk = queue_length(sem->blocked_queue);
-	if (sem->count > 0) {
-		*sval = sem->count;
-	} else if (sem->count == 0) {
-		*sval = -size_blk;
+	unsigned int count = atomic_load(&(sem->count)) & SEM_COUNT_MAX;
+	if (count > 0) {
+		*sval = (int)count;
+	} else {
+		*sval = -(int)(atomic_load(&(sem->waiters)) + atomic_load(&(sem->spinners)));
+	}
+
+	return 0;
+}
+
+// propagate the spinning counters of @sem to @stats
+// return -1 if @sem or @stats is NULL
+// return 0 if succeeded
+int sem_getstats(sem_t sem, struct sem_stats *stats)
+{
+	if ((!sem) || (!stats)) {
+		return -1;
 	}
 
+	stats->spin_hits = atomic_load_explicit(&(sem->spin_hits), memory_order_relaxed);
+	stats->parks = atomic_load_explicit(&(sem->parks), memory_order_relaxed);
+	stats->spin_ns = atomic_load_explicit(&(sem->spin_ns), memory_order_relaxed);
+
 	return 0;
 }
+
+// turn the spinning of sem_down() on if @enable is not 0, or off otherwise, for every semaphore
+// spinning stays off on a single CPU, unless @enable is SEM_SPIN_FORCE
+// return the previous setting: SEM_SPIN_FORCE if spinning was forced, 1 if it was on, 0 otherwise
+int sem_set_spin(int enable)
+{
+	return atomic_exchange(&sem_spin, (enable == SEM_SPIN_FORCE) ? SEM_SPIN_FORCE : (enable != 0));
+}
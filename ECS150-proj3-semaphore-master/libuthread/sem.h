@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 /*
  * sem_t - Semaphore type
@@ -12,9 +13,48 @@
  * shared a certain number of times. When a thread successfully takes the
  * resource, the count is decreased. When the resource is not available,
  * following threads are blocked until the resource becomes available again.
+ *
+ * The count is an atomic word: taking or releasing an available resource is a
+ * single atomic operation, which takes no lock. Only threads that find no
+ * resource go to sleep, on a futex of the semaphore.
+ *
+ * Before going to sleep, a thread spins for a while, since the resource often
+ * comes back within a few microseconds: it first pauses with an exponential
+ * backoff, then yields the CPU. Each semaphore learns how long to spin from
+ * the duration of its recent waits. Spinning can be turned off with
+ * sem_set_spin(), and is skipped when a single CPU is online, since the thread
+ * releasing the resource could not run meanwhile.
  */
 typedef struct semaphore *sem_t;
 
+/*
+ * Flags of sem_create_ex()
+ *
+ * By default, a resource released while threads are blocked goes back to the
+ * semaphore, and one of the threads is woken up to take it. Until it runs, any
+ * thread calling sem_down() may take it first (barging): the semaphore keeps
+ * being used without waiting for the woken thread, which gives the best
+ * throughput, but a thread may be overtaken many times.
+ *
+ * With SEM_HANDOFF, sem_up() instead hands the resource over to the oldest
+ * blocked thread, which returns from sem_down() without checking the count
+ * again. Threads get resources in the order they blocked, which bounds how
+ * long each of them waits, but every release to a blocked thread then waits
+ * for it to be scheduled. sem_up() also takes an internal lock of the
+ * semaphore, and blocked threads do not spin.
+ */
+#define SEM_HANDOFF	0x1
+
+/*
+ * SEM_COUNT_MAX - Largest count of a semaphore
+ *
+ * The count shares its futex word with two bits telling sem_up() whether
+ * threads may be blocked, so that sem_up() decides whether to wake them up
+ * from the single atomic operation that releases the resources. Releasing
+ * resources beyond SEM_COUNT_MAX is undefined.
+ */
+#define SEM_COUNT_MAX	0x3fffffff
+
 /*
  * sem_create - Create semaphore
  * @count: Semaphore count
@@ -22,10 +62,24 @@ typedef struct semaphore *sem_t;
  * Allocate and initialize a semaphore of internal count @count.
  *
  * Return: Pointer to initialized semaphore. NULL in case of failure when
- * allocating the new semaphore.
+ * allocating the new semaphore, or if @count is larger than SEM_COUNT_MAX.
  */
 sem_t sem_create(size_t count);
 
+/*
+ * sem_create_ex - Create semaphore with flags
+ * @count: Semaphore count
+ * @flags: Bitwise OR of SEM_* flags
+ *
+ * Allocate and initialize a semaphore of internal count @count, which behaves
+ * as specified by @flags. sem_create() is sem_create_ex() with no flags.
+ *
+ * Return: Pointer to initialized semaphore. NULL in case of failure when
+ * allocating the new semaphore, if @count is larger than SEM_COUNT_MAX, or if
+ * @flags holds an unknown flag.
+ */
+sem_t sem_create_ex(size_t count, int flags);
+
 /*
  * sem_destroy - Deallocate a semaphore
  * @sem: Semaphore to deallocate
@@ -33,7 +87,8 @@ sem_t sem_create(size_t count);
  * Deallocate semaphore @sem.
  *
  * Return: -1 if @sem is NULL or if other threads are still being blocked on
- * @sem. 0 is @sem was successfully destroyed.
+ * @sem, sleeping or spinning, in which case @sem is not deallocated. 0 is @sem
+ * was successfully destroyed.
  */
 int sem_destroy(sem_t sem);
 
@@ -56,14 +111,81 @@ int sem_down(sem_t sem);
  *
  * Release a resource to semaphore @sem.
  *
- * If the waiting list associated to @sem is not empty, releasing a resource
- * also causes the first thread (i.e. the oldest) in the waiting list to be
- * unblocked.
+ * If threads are blocked on @sem, releasing a resource also causes one of them
+ * to be unblocked. The resource is not reserved for it: a thread calling
+ * sem_down() in the meantime may take it first, in which case the unblocked
+ * thread waits again. If @sem was created with SEM_HANDOFF, the resource is
+ * instead handed over to the oldest blocked thread.
  *
  * Return: -1 if @sem is NULL. 0 if semaphore was successfully released.
  */
 int sem_up(sem_t sem);
 
+/*
+ * sem_trydown - Take a semaphore without blocking
+ * @sem: Semaphore to take
+ *
+ * Take a resource from semaphore @sem if one is available. The caller thread
+ * is never blocked, and no lock is taken: when no resource is available, the
+ * call only reads the count of @sem. If @sem was created with SEM_HANDOFF,
+ * resources are only available when no thread is blocked, so the caller cannot
+ * take one before them.
+ *
+ * Return: -1 if @sem is NULL or if no resource is available. 0 if semaphore was
+ * successfully taken.
+ */
+int sem_trydown(sem_t sem);
+
+/*
+ * sem_timeddown - Take a semaphore, blocking until a deadline at most
+ * @sem: Semaphore to take
+ * @abs_deadline: Time to give up at, on the CLOCK_MONOTONIC clock
+ *
+ * Take a resource from semaphore @sem, as sem_down() does, but give up if
+ * @abs_deadline passes before a resource is available. A thread that gives up
+ * holds no resource, and no resource released meanwhile is lost: it either
+ * goes to another thread or stays in @sem. If @sem was created with
+ * SEM_HANDOFF, a thread that gives up leaves the line of blocked threads in
+ * constant time, unless a resource was handed over to it first, in which case
+ * it keeps it and the call succeeds.
+ *
+ * Return: -1 if @sem or @abs_deadline is NULL, if @abs_deadline is not a valid
+ * time, or if @abs_deadline passed before a resource was available. 0 if
+ * semaphore was successfully taken.
+ */
+int sem_timeddown(sem_t sem, const struct timespec *abs_deadline);
+
+/*
+ * sem_down_n - Take several resources of a semaphore at once
+ * @sem: Semaphore to take
+ * @n: Number of resources to take
+ *
+ * Take @n resources from semaphore @sem, all together: the caller thread is
+ * blocked until @n resources are available, and never holds part of them
+ * while waiting, so that threads taking several resources cannot deadlock
+ * each other. Taking 0 resources does nothing.
+ *
+ * With SEM_HANDOFF, the thread waits in line for its @n resources, and the
+ * threads that blocked after it wait until it got them.
+ *
+ * Return: -1 if @sem is NULL or if @n is larger than SEM_COUNT_MAX. 0 if the
+ * resources were successfully taken.
+ */
+int sem_down_n(sem_t sem, size_t n);
+
+/*
+ * sem_up_n - Release several resources of a semaphore at once
+ * @sem: Semaphore to release
+ * @n: Number of resources to release
+ *
+ * Release @n resources to semaphore @sem, as @n calls to sem_up() would, but
+ * in a single pass: up to @n blocked threads are unblocked at once.
+ *
+ * Return: -1 if @sem is NULL or if @n is larger than SEM_COUNT_MAX. 0 if the
+ * resources were successfully released.
+ */
+int sem_up_n(sem_t sem, size_t n);
+
 /*
  * sem_getvalue - Inspect semaphore's internal state
  * @sem: Semaphore to inspect
@@ -74,11 +196,54 @@ int sem_up(sem_t sem);
  *
  * If semaphore @sems's internal count is equal to 0, assign a negative number
  * whose absolute value is the count of the number of threads currently blocked
- * in sem_down().
+ * in sem_down(), sleeping or spinning.
  *
  * Return: -1 if @sem or @sval are NULL. 0 if semaphore was successfully
  * inspected.
  */
 int sem_getvalue(sem_t sem, int *sval);
 
+/*
+ * struct sem_stats - Spinning counters of a semaphore
+ * @spin_hits: Number of sem_down() calls that got a resource while spinning
+ * @parks: Number of sem_down() calls that went on to sleep
+ * @spin_ns: Current spin budget, in nanoseconds
+ *
+ * Calls that find a resource right away are not counted.
+ */
+struct sem_stats {
+	uint64_t spin_hits;
+	uint64_t parks;
+	unsigned int spin_ns;
+};
+
+/*
+ * sem_getstats - Inspect semaphore's spinning counters
+ * @sem: Semaphore to inspect
+ * @stats: Address of the counters to fill in
+ *
+ * Return: -1 if @sem or @stats are NULL. 0 if the counters were successfully
+ * retrieved.
+ */
+int sem_getstats(sem_t sem, struct sem_stats *stats);
+
+/*
+ * SEM_SPIN_FORCE - Setting of sem_set_spin() that spins even on a single CPU
+ *
+ * The thread releasing the resource then only runs when the spinning thread
+ * yields the CPU, so this is only meant for tests and measurements.
+ */
+#define SEM_SPIN_FORCE	2
+
+/*
+ * sem_set_spin - Turn spinning on or off
+ * @enable: Whether sem_down() spins before going to sleep
+ *
+ * The setting applies to every semaphore. Spinning is on by default, but never
+ * happens when a single CPU is online, unless @enable is SEM_SPIN_FORCE.
+ *
+ * Return: SEM_SPIN_FORCE if spinning was forced, 1 if it was on, 0 otherwise.
+ */
+int sem_set_spin(int enable);
+
 #endif /* _SEMAPHORE_H */
@@ -1,527 +1,2941 @@
+#define _GNU_SOURCE // mremap()
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "queue.h"
-#include "thread.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <linux/userfaultfd.h>
+
 #include "tps.h"
 
 /* data structures */
 
+struct TPS;
+
+// contiguous mapping holding the pages of a TPS of several pages, or of a persistent TPS; it is unmapped once none of its pages is in use
+typedef struct TPS_region {
+	void* base;
+	size_t length;
+	size_t live_pages; // number of its pages still in use
+	int fd; // file mapped under the pages of a persistent TPS, locked with flock() until the region is unmapped; -1 otherwise
+	struct TPS* owner; // persistent TPS whose writes go to the file; NULL otherwise
+} TPS_region;
+
 typedef struct TPS_page {
 	void* mapped_area;
-	unsigned int ref_counter; // the number of TPSes sharing this page; shall be >= 1
+	_Atomic unsigned int ref_counter; // the number of TPSes sharing this page; shall be >= 1
+	int prot; // current protection of mapped_area
+	unsigned int map_count; // the number of TPSes currently mapping this page with tps_map()
+	unsigned int write_map_count; // the number of them mapping it for writing
+	struct TPS* pending_writer; // TPS whose next write to this page breaks copy-on-write in the fault handler, if any
+	struct TPS_page* next_free; // next free page in the page pool
+	bool dirty; // whether the mapped area may hold non-zero data, and must be cleared before being reused
+	TPS_region* region; // region holding mapped_area, or NULL if it comes from the page pool
 } TPS_page;
 
 typedef struct TPS {
-	TPS_page* page;
+	TPS_page** pages; // each page has its own ref_counter, so that copy-on-write only copies the pages that are written to
+	size_t page_count;
+	size_t size; // size requested at creation, in bytes, and then grown by tps_alloc()
+	size_t alloc_base; // start of the objects allocated with tps_alloc(): the size requested at creation, aligned
+	_Atomic size_t alloc_top; // end of the objects allocated with tps_alloc() since the last tps_reset(); only the owner updates it
+	TPS_page* single_page; // storage of pages for a TPS of a single page
 	pthread_t tid;
+	unsigned int map_depth; // nesting depth of tps_map() calls; the pages are mapped when > 0
+	int map_prot; // protection requested by tps_map(), only valid when mapped
+	_Atomic(struct TPS*) index_next; // next TPS in the same bucket of tps_index
+	pthread_mutex_t lock; // held by the owner while accessing private pages without the global lock, and by a thread cloning this TPS
 } TPS;
 
+// chained hash table mapping thread IDs to TPSes
+// readers do not take any lock: they only perform atomic loads, and a TPS is never given back to the system (see TPS_slab)
+// a removed TPS may be recycled right away for another thread though, so readers check seq to tell if their walk raced with a removal
+// a table that is replaced when growing is kept, since readers may still walk it
+typedef struct TPS_index_table {
+	size_t capacity; // number of buckets; always a power of 2
+	_Atomic(TPS*) buckets[];
+} TPS_index_table;
+
+typedef struct TPS_index {
+	_Atomic(TPS_index_table*) table;
+	size_t count; // number of TPSes
+	_Atomic size_t seq; // odd while a TPS leaves its chain or the table is resized, and bumped again after; only written under the global lock
+} TPS_index;
+
+// radix tree mapping page addresses to TPS pages, walked like a page table
+// readers only perform atomic loads, so the tree can be queried from a signal handler
+#define TPS_PAGE_SHIFT 12 // log2(TPS_SIZE)
+#define PAGE_MAP_BITS 9
+#define PAGE_MAP_LEVELS 4 // 4 levels of 9 bits cover the 48-bit user address space
+#define PAGE_MAP_FANOUT (1 << PAGE_MAP_BITS)
+_Static_assert((1 << TPS_PAGE_SHIFT) == TPS_SIZE, "TPS_PAGE_SHIFT must match TPS_SIZE");
+
+typedef struct TPS_page_map_node {
+	_Atomic(void*) entries[PAGE_MAP_FANOUT]; // child nodes, or TPS pages at the last level
+} TPS_page_map_node;
+
+// pool of free TPS pages, carved from large mappings and recycled instead of being unmapped
+#define TPS_POOL_DEFAULT_HIGH 256
+
+typedef struct TPS_page_pool {
+	TPS_page* free_list; // free pages, with their mapped areas
+	size_t free_count; // number of pages in free_list
+	size_t low; // refill when fewer free pages are left after an allocation
+	size_t high; // maximum number of free pages kept; refills go up to this number
+	bool prefault; // populate the mapped areas when refilling
+} TPS_page_pool;
+
+// in arena mode, every TPS page is carved from a single reservation, one slot after the other, instead of a mapping per refill
+// a slot is one page, followed by a guard page with TPS_GUARD_ONLY (the reservation then starts with a guard page too)
+#ifdef TPS_GUARD_ONLY
+#define TPS_SLOT_STRIDE (2 * TPS_SIZE)
+#define TPS_SLOT_OFFSET TPS_SIZE
+#else
+#define TPS_SLOT_STRIDE TPS_SIZE
+#define TPS_SLOT_OFFSET 0
+#endif
+
+typedef struct TPS_arena {
+	char* base; // start of the reservation; NULL when arena mode is off
+	size_t slots; // number of slots in the reservation
+	size_t next_slot; // index of the first slot that was never carved
+} TPS_arena;
+
+// slab allocator for the small fixed-size structs; objects are recycled and never given back to the system
+#define TPS_SLAB_CHUNK_SIZE (64 * 1024)
+
+// alignment of the objects allocated with tps_alloc(), like malloc()
+#define TPS_ALLOC_ALIGN 16
+
+typedef struct TPS_slab {
+	size_t object_size;
+	void* free_list; // free objects, each starting with a pointer to the next one
+} TPS_slab;
+
+// resources prepared ahead of a copy-on-write fault, so that the page fault handler never allocates
+// a thread expects at most one such fault at a time; the other shared pages it writes to are copied right away
+typedef struct TPS_cow_fault {
+	TPS* tps; // TPS expecting a copy-on-write fault; NULL when no fault is expected
+	size_t page_index; // index of the page of tps expecting the fault
+	TPS_page* spare_page; // spare page whose mapped area receives the shared content for the other TPSes, and which takes over the faulting mapped area
+} TPS_cow_fault;
+
+// read-modify-write operations on a word of a TPS
+typedef enum TPS_atomic_op {
+	TPS_ATOMIC_FETCH_ADD,
+	TPS_ATOMIC_EXCHANGE,
+	TPS_ATOMIC_CAS,
+} TPS_atomic_op;
+
+// point-in-time version of a TPS, given to the user as a tps_snapshot_t
+// the version is a TPS of its own, in no index, which shares the pages of the snapshotted TPS until they are written to
+struct tps_snapshot {
+	TPS* version;
+	size_t restores; // number of tps_restore() calls from this snapshot so far
+};
+
+// entry of the table of page contents built by a deduplication pass
+typedef struct TPS_dedup_entry {
+	uint64_t hash; // hash of the content of page
+	TPS_page* page; // page kept for this content, or NULL if the entry is free
+} TPS_dedup_entry;
+
+// slot of every TPS named by a tps_key_t
+typedef struct TPS_key {
+	size_t offset;
+	size_t size;
+} TPS_key;
+
+// pages of a TPS touched by the segments of a tps_read(), tps_write() or of their vectored versions
+typedef struct TPS_access {
+	const struct tps_iovec* iov;
+	int iovcnt;
+	size_t first; // first page touched by a segment
+	size_t last; // last page touched by a segment; first > last if no segment touches any page
+} TPS_access;
+
 /* internal "global" variables */
 
-static queue_t tps_queue = NULL; // nodes are TPS structs
+static TPS_index tps_index; // maps each thread ID to its TPS
+static pthread_mutex_t tps_lock = PTHREAD_MUTEX_INITIALIZER; // global lock; see lock_tps()
+static __thread unsigned int tps_lock_depth; // number of nested lock_tps() calls by the current thread
+static TPS_page_map_node page_map_root; // maps each mapped area to its TPS page
 static int tps_initialized = false;
+static struct tps_config tps_config; // options given at initialization
+static TPS_page_pool page_pool = { NULL, 0, 0, TPS_POOL_DEFAULT_HIGH, false };
+static TPS_arena arena;
+static TPS_slab tps_slab = { sizeof(TPS), NULL };
+static TPS_slab page_slab = { sizeof(TPS_page), NULL };
+static TPS_slab snapshot_slab = { sizeof(struct tps_snapshot), NULL };
+static __thread TPS_cow_fault pending_cow_fault; // copy-on-write fault expected by the current thread, if any
+static struct tps_dedup_stats dedup_stats; // totals of all the deduplication passes
+static TPS_key tps_keys[TPS_KEYS_MAX]; // layout of the slots named by keys
+static _Atomic int tps_key_count; // number of keys created; a created slot never changes, so accesses read it without locking
+static size_t tps_key_end; // end of the padding of the last slot; protected by the global lock
+static __thread TPS* current_tps; // TPS of the current thread, cached by tps_create_sized() and tps_clone() so that its accesses skip tps_index
 
 /* internal functions */
 
-static void* init_mapped_area_helper(void)
+// HELPER FUNCTION: allocate a zeroed object from @slab, carving a new chunk when it is empty
+// return the pointer to the object, or NULL if failed to allocate a chunk
+static void* slab_alloc(TPS_slab* slab)
 {
-	// allocate memory, and then check if allocation is successful
-	void* mapped_area = mmap(/* addr = */NULL, /* length = */TPS_SIZE,
-		/* protection = */PROT_NONE,
-		/* flag = */MAP_PRIVATE | MAP_ANONYMOUS,
-		/* fd = */-1, // ignored when using MAP_ANONYMOUS as flag; but some inplementations requires fd to be -1 (see manpage mmap(2))
-		/* offset = */0);
-	if (mapped_area == MAP_FAILED) {
-		return MAP_FAILED;
+	if (!(slab->free_list)) {
+		char* chunk = (char*)malloc(TPS_SLAB_CHUNK_SIZE);
+		if (!chunk) {
+			return NULL;
+		}
+		for (size_t i = 0; i + slab->object_size <= TPS_SLAB_CHUNK_SIZE; i += slab->object_size) {
+			*(void**)(chunk + i) = slab->free_list;
+			slab->free_list = chunk + i;
+		}
 	}
-	return mapped_area;
+
+	void* object = slab->free_list;
+	slab->free_list = *(void**)object;
+	memset(object, 0, slab->object_size);
+	return object;
 }
 
-// HELPER FUNCTION: initialize new TPS with a specified @tid, a @tps_page_to_use, and a @mapped_area
-// if @tps_page_to_use is NULL, allocate a new page (used when creating a TPS or performing copy-on-write)
-// if @tps_page_to_use is not NULL, use it for the new TPS (used when cloning a TPS); in this case @mapped_area is NOT used
-// return the pointer to TPS
-// return NULL if failed to create TPS or TPS page
-static TPS* init_new_tps_helper(pthread_t tid, TPS_page* tps_page_to_use, void* mapped_area)
+// HELPER FUNCTION: give @object back to @slab
+static void slab_free(TPS_slab* slab, void* object)
 {
-	TPS* new_tps = (TPS*)malloc(sizeof(TPS));
-	if (!new_tps) {
-		return NULL;
-	}
-
-	new_tps->tid = tid;
-
-	// initialize the page of the new TPS
-	// allocate a new page when creating a new TPS / performing copy-on-write
-	if (!tps_page_to_use) {
-		new_tps->page = (TPS_page*)malloc(sizeof(TPS_page));
-		if (!(new_tps->page)) {
-			free(new_tps);
-			return NULL;
-		}
+	*(void**)object = slab->free_list;
+	slab->free_list = object;
+}
 
-		new_tps->page->mapped_area = mapped_area;
-		new_tps->page->ref_counter = 1;
+/* statistics */
+
+#ifdef TPS_STATS
+
+// counters of struct tps_stats, in the same order
+#define TPS_STATS_FIELDS(X) \
+	X(creates) X(destroys) X(clones) \
+	X(cow_copies) X(bytes_copied) X(bytes_read) X(bytes_written) \
+	X(mprotect_calls) X(mmap_calls) X(munmap_calls) X(madvise_calls) \
+	X(lookups) X(lookup_steps) X(faults) \
+	X(uffd_copies) X(uffd_fills)
+
+enum TPS_stat {
+#define TPS_STAT_ENUM(name) TPS_STAT_##name,
+	TPS_STATS_FIELDS(TPS_STAT_ENUM)
+	TPS_STAT_COUNT
+};
+
+// counters of a thread; only the thread updates them, so they need no atomic read-modify-write, and tps_stats() reads them with atomic loads
+typedef struct TPS_thread_stats {
+	_Atomic uint64_t counters[TPS_STAT_COUNT];
+	bool registered; // whether it is in stats_threads
+	struct TPS_thread_stats* prev;
+	struct TPS_thread_stats* next;
+} TPS_thread_stats;
+
+static __thread TPS_thread_stats thread_stats;
+static TPS_thread_stats* stats_threads; // counters of the threads still running
+static uint64_t stats_exited[TPS_STAT_COUNT]; // sum of the counters of the threads that exited
+static _Atomic uint64_t stats_unregistered_faults; // faults of threads that never used the TPS API
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // protects stats_threads and stats_exited
+static pthread_key_t stats_key; // its destructor folds the counters of an exiting thread into stats_exited
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+// HELPER FUNCTION: fold the counters @arg of an exiting thread into stats_exited
+static void stats_exit_helper(void* arg)
+{
+	TPS_thread_stats* stats = (TPS_thread_stats*)arg;
+	pthread_mutex_lock(&stats_lock);
+	for (int k = 0; k < TPS_STAT_COUNT; ++k) {
+		stats_exited[k] += atomic_load_explicit(&(stats->counters[k]), memory_order_relaxed);
+	}
+	if (stats->prev) {
+		stats->prev->next = stats->next;
 	}
-	// use a given page when cloning a TPS
 	else {
-		new_tps->page = tps_page_to_use;
-		++(new_tps->page->ref_counter);
-		assert(new_tps->page->ref_counter > 0);
+		stats_threads = stats->next;
+	}
+	if (stats->next) {
+		stats->next->prev = stats->prev;
 	}
+	stats->prev = stats->next = NULL;
+	stats->registered = false;
+	for (int k = 0; k < TPS_STAT_COUNT; ++k) {
+		atomic_store_explicit(&(stats->counters[k]), 0, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
 
-	return new_tps;
+// HELPER FUNCTION: create stats_key, once
+static void stats_key_helper(void)
+{
+	pthread_key_create(&stats_key, stats_exit_helper);
 }
 
-// HELPER FUNCTION: create the @queue if it was NULL; otherwise do nothing
-// return the pointer to the queue created
-static queue_t check_create_queue(queue_t* queue) {
-	if (!(*queue)) {
-		*queue = queue_create();
+// HELPER FUNCTION: register the counters of the current thread in stats_threads, on its first counted event
+// kept out of line, so that counting an event is only a few instructions
+static __attribute__((noinline, cold)) void stats_register_helper(void)
+{
+	TPS_thread_stats* stats = &thread_stats;
+	pthread_once(&stats_once, stats_key_helper);
+	pthread_mutex_lock(&stats_lock);
+	stats->next = stats_threads;
+	if (stats_threads) {
+		stats_threads->prev = stats;
 	}
-	return *queue;
+	stats_threads = stats;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, stats);
+	stats->registered = true;
 }
 
-// HELPER FUNCTION: destroy the @queue if it was empty; otherwise do nothing
-// return -1 if @queue is NULL or non-empty
-// return 0 if successfully destroyed
-static int check_destroy_queue(queue_t* queue) {
-	if ((!queue) || (queue_length(*queue) > 0)) {
-		return -1;
+// HELPER FUNCTION: add @value to the counter @stat of the current thread, registering the counters of the thread on first use
+// inlined on the hot paths: a relaxed load and store of a counter only the current thread writes, with no read-modify-write
+static inline void stats_add_helper(enum TPS_stat stat, uint64_t value)
+{
+	TPS_thread_stats* stats = &thread_stats;
+	if (__builtin_expect(!(stats->registered), 0)) {
+		stats_register_helper();
 	}
-	queue_destroy(*queue);
-	*queue = NULL;
-	return 0;
+	uint64_t count = atomic_load_explicit(&(stats->counters[stat]), memory_order_relaxed);
+	atomic_store_explicit(&(stats->counters[stat]), count + value, memory_order_relaxed);
 }
 
-// the callback function for checking tid, used for the function queue_iterate() in the second argument
-// to learn about the function queue_iterate(), see "queue.h"
-// return -1 if @tps_node is NULL
-// return 0 if @tid_to_check does not match
-// return 1 if @tid_to_check matches
-static int check_tid_callback(void* tps_node, void* tid_to_check)
+// HELPER FUNCTION: count a fault of the current thread; called from the page fault handler, which must not register the counters of the thread
+static void stats_fault_helper(void)
 {
-	if (!tps_node) {
-		return -1;
+	if (thread_stats.registered) {
+		stats_add_helper(TPS_STAT_faults, 1);
 	}
-
-	pthread_t tps_node_tid = ((TPS*)tps_node)->tid;
-	if (tps_node_tid == (pthread_t)tid_to_check) {
-		return 1;
+	else {
+		atomic_fetch_add_explicit(&stats_unregistered_faults, 1, memory_order_relaxed);
 	}
-	return 0;
 }
 
-// HELPER FUNCTION: find @tid in @queue, and propagate the pointer of the corresponding TPS into @result_tps
-// return -1 if @queue or @result_tps is NULL
-// return 0 if not found
-// return 1 if found
-static int iterate_find_tid(queue_t queue, pthread_t tid, TPS** result_tps)
-{
-	if ((!queue) || (!result_tps)) {
-		return -1;
-	}
+#define TPS_STAT_ADD(name, value) stats_add_helper(TPS_STAT_##name, (value))
+#define TPS_STAT_FAULT() stats_fault_helper()
+#define TPS_STAT_REGISTER() do { if (!(thread_stats.registered)) stats_register_helper(); } while (0)
 
-	*result_tps = NULL;
-	queue_iterate(queue, check_tid_callback, (void*)tid, (void**)result_tps);
-	// if the @tid is found in the @queue, @result_tps will be set to the corresponding tps that contains the given @tid
-	if (*result_tps) {
-		return 1;
-	}
-	return 0;
+#else
+
+#define TPS_STAT_ADD(name, value) ((void)0)
+#define TPS_STAT_FAULT() ((void)0)
+#define TPS_STAT_REGISTER() ((void)0)
+
+#endif /* TPS_STATS */
+
+// HELPER FUNCTION: mprotect(), counted in the statistics
+static int counted_mprotect(void* addr, size_t length, int prot)
+{
+	TPS_STAT_ADD(mprotect_calls, 1);
+	return mprotect(addr, length, prot);
 }
 
-// the callback function for checking tid, used for the function queue_iterate() in the second argument
-// to learn about the function queue_iterate(), see "queue.h"
-// return -1 if @tps_node is NULL, or its page pointer is NULL
-// return 0 if @tid_to_check does not match
-// return 1 if @tid_to_check matches
-static int check_mapped_area_callback(void* tps_node, void* mapped_area_arg)
+// HELPER FUNCTION: mmap() of anonymous memory, counted in the statistics
+static void* counted_mmap(size_t length, int prot, int flags)
 {
-	if ((!tps_node) || (!(((TPS*)tps_node)->page))) {
-		return -1;
-	}
+	TPS_STAT_ADD(mmap_calls, 1);
+	return mmap(NULL, length, prot, flags, -1, 0);
+}
 
-	void* tps_node_mapped_area = ((TPS*)tps_node)->page->mapped_area;
-	if (tps_node_mapped_area == mapped_area_arg) {
-		return 1;
-	};
-	return 0;
+// HELPER FUNCTION: mmap() of the first @length bytes of file @fd over @addr, shared and inaccessible, counted in the statistics
+static void* counted_mmap_file(void* addr, size_t length, int fd)
+{
+	TPS_STAT_ADD(mmap_calls, 1);
+	return mmap(addr, length, PROT_NONE, MAP_SHARED | MAP_FIXED, fd, 0);
 }
 
-// HELPER FUNCTION: iterate through all the TPS areas in @queue, and find if the specified in @mapped_area_arg matches one of them
-// return -1 if @queue or @result_tps is NULL
-// return 0 if not found
-// return 1 if found
-static int iterate_find_mapped_area(queue_t queue, void* mapped_area_arg, TPS** result_tps)
+// HELPER FUNCTION: munmap(), counted in the statistics
+static int counted_munmap(void* addr, size_t length)
 {
-	if ((!queue) || (!result_tps)) {
-		return -1;
-	}
+	TPS_STAT_ADD(munmap_calls, 1);
+	return munmap(addr, length);
+}
 
-	*result_tps = NULL;
-	queue_iterate(queue, check_mapped_area_callback, mapped_area_arg, (void**)result_tps);
-	// if the @mapped_area_arg is found in the @queue, @result_tps will be set to the corresponding tps that contains the given @mapped_area_arg
-	if (*result_tps) {
-		return 1;
-	}
-	return 0;
+// HELPER FUNCTION: madvise(), counted in the statistics
+static int counted_madvise(void* addr, size_t length, int advice)
+{
+	TPS_STAT_ADD(madvise_calls, 1);
+	return madvise(addr, length, advice);
 }
 
-// signal handler function
-// snippet provided by professor Porquet
-static void segv_handler(int sig, siginfo_t *si, void *context)
+/* userfaultfd backend */
+
+static int uffd = -1; // userfaultfd filling the missing pages of the TPS memory; -1 when the backend is off or unavailable
+
+// HELPER FUNCTION: fault-service thread of the userfaultfd backend: fill the missing TPS pages the threads touch
+// a read maps the shared zero page, and a write gets a private zeroed page at once, so that it does not fault again
+// the thread takes no lock, since the faulting thread may hold any of them
+static void* uffd_service_thread(void* arg)
 {
-	// get the address corresponding to the beginning of the page where the fault occurred
-	void *p_fault = (void*)((uintptr_t)si->si_addr & ~(TPS_SIZE - 1));
+	static char zero_area[TPS_SIZE] __attribute__((aligned(TPS_SIZE)));
+	struct uffd_msg msg;
+	(void)arg;
+
+	for (;;) {
+		ssize_t n = read(uffd, &msg, sizeof(msg));
+		if (n != sizeof(msg)) {
+			if ((n == -1) && (errno == EINTR)) {
+				continue;
+			}
+			return NULL;
+		}
+		if (msg.event != UFFD_EVENT_PAGEFAULT) {
+			continue;
+		}
 
-	// iterate through all the TPS areas and find if p_fault matches one of them
-	TPS* faulty_tps = NULL;
-	iterate_find_mapped_area(tps_queue, p_fault, &faulty_tps);
-	// if there is a match
-	if (faulty_tps) {
-		fprintf(stderr, "TPS protection error!\n");
+		uintptr_t area = msg.arg.pagefault.address & ~((uintptr_t)TPS_SIZE - 1);
+		int ret;
+		if (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE) {
+			struct uffdio_copy copy = { .dst = area, .src = (uintptr_t)zero_area, .len = TPS_SIZE, .mode = 0 };
+			ret = ioctl(uffd, UFFDIO_COPY, &copy);
+		}
+		else {
+			struct uffdio_zeropage zeropage = { .range = { .start = area, .len = TPS_SIZE }, .mode = 0 };
+			ret = ioctl(uffd, UFFDIO_ZEROPAGE, &zeropage);
+		}
+		// the page may have been filled by uffd_copy_helper() in the meantime; the faulting thread still has to be woken up
+		if ((ret == -1) && (errno == EEXIST)) {
+			struct uffdio_range range = { .start = area, .len = TPS_SIZE };
+			ioctl(uffd, UFFDIO_WAKE, &range);
+		}
+		TPS_STAT_ADD(uffd_fills, 1);
 	}
-
-	// in any case, restore the default signal handlers
-	signal(SIGSEGV, SIG_DFL);
-	signal(SIGBUS, SIG_DFL);
-	// and transmit the signal again in order to cause the program to crash
-	raise(sig);
 }
 
-// HELPER FUNCTION: check TPS access error, with specified @offset, @length, and @buffer
-// return -1 if buffer is NULL, or reading out of bounds
-// return 0 if no error
-static int check_tps_access_error(size_t offset, size_t length, char *buffer)
+// HELPER FUNCTION: open the userfaultfd and start its fault-service thread
+// return -1 if userfaultfd is not available (e.g. not allowed for unprivileged users), or on failure; the TPS memory is then left to the kernel
+// return 0 if successful
+static int uffd_start_helper(void)
 {
-	if (!buffer) {
+	int fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC);
+	if (fd == -1) {
 		return -1;
 	}
-	// check if reading / writing out of bound
-	else if ((offset >= TPS_SIZE) || (offset + length > TPS_SIZE)) {
+	struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+	if ((ioctl(fd, UFFDIO_API, &api) == -1) || !(api.ioctls & (1ULL << _UFFDIO_REGISTER))) {
+		close(fd);
+		return -1;
+	}
+
+	uffd = fd;
+	pthread_t service_tid;
+	if (pthread_create(&service_tid, NULL, uffd_service_thread, NULL) != 0) {
+		uffd = -1;
+		close(fd);
 		return -1;
 	}
+	pthread_detach(service_tid);
 	return 0;
 }
 
-// HELPER FUNCTION: get the TPS with given tid
-// return the pointer to the TPS, or return NULL if not found
-static TPS* get_tps_with_tid(queue_t queue, pthread_t tid)
+// HELPER FUNCTION: register the TPS memory of @length bytes at @base with the userfaultfd backend, if it is on
+// memory that cannot be registered is filled by the kernel as usual, and uffd_copy_helper() then fails on it
+static void uffd_register_helper(void* base, size_t length)
 {
-	TPS* tps_with_current_tid = NULL;
-	iterate_find_tid(tps_queue, tid, &tps_with_current_tid);
-	if (!tps_with_current_tid) {
-		return NULL;
+	if (uffd == -1) {
+		return;
 	}
-	return tps_with_current_tid;
+	struct uffdio_register reg = { .range = { .start = (uintptr_t)base, .len = length }, .mode = UFFDIO_REGISTER_MODE_MISSING };
+	ioctl(uffd, UFFDIO_REGISTER, &reg);
 }
 
-/* API functions */
-
-// initialize TPS
-// @segv: activate segfault handler if @segv != 0; the handler will recognize TPS protection errors and display "TPS protection error" on stderr
-// return -1 if TPS API already initialized, or on failure in initialization
-// return 0 if successfully initialized
-int tps_init(int segv)
+// HELPER FUNCTION: fill the missing page at @dst with a copy of the page at @src, which must be readable
+// the copy is installed at once, whatever the protection of @dst, so that it neither has to be opened nor to be filled with zeros first
+// this is async-signal-safe
+// return -1 if the backend is off, if @dst is not registered, or if it is not missing (e.g. its old content was kept)
+// return 0 if successful
+static int uffd_copy_helper(void* dst, void* src)
 {
-	if (tps_initialized) {
+	if (uffd == -1) {
 		return -1;
 	}
-
-	tps_initialized = true;
-
-	// provided snippet from professor Porquet
-	if (segv) {
-		struct sigaction sa;
-
-		sigemptyset(&sa.sa_mask);
-		sa.sa_flags = SA_SIGINFO;
-		sa.sa_sigaction = segv_handler;
-		sigaction(SIGBUS, &sa, NULL);
-		sigaction(SIGSEGV, &sa, NULL);
+	struct uffdio_copy copy = { .dst = (uintptr_t)dst, .src = (uintptr_t)src, .len = TPS_SIZE, .mode = 0 };
+	if (ioctl(uffd, UFFDIO_COPY, &copy) == -1) {
+		return -1;
 	}
-	// end of provided snippet
-
+	TPS_STAT_ADD(uffd_copies, 1);
 	return 0;
 }
 
-// create a TPS, and associate it to the current thread; the TPS is initialized to all zeros
-// return -1 if current thread already has a TPS, or on failure in creation
-// return 0 if successful
-int tps_create(void)
-{
-	enter_critical_section();
-
-	pthread_t current_tid = pthread_self();
+/* locking */
 
-	// first check if current thread already has a TPS
-	TPS* current_thread_tps = get_tps_with_tid(tps_queue, current_tid);
-	if (current_thread_tps) {
-		exit_critical_section();
-		return -1;
+// HELPER FUNCTION: take the global TPS lock, which protects tps_index updates, the allocators, and the pages shared by several TPSes
+// a thread only accessing its private pages does not take it (see access_lock_helper())
+// the lock can be taken again by the thread holding it, e.g. from the page fault handler breaking copy-on-write during tps_write()
+static void lock_tps(void)
+{
+	if (tps_lock_depth == 0) {
+		pthread_mutex_lock(&tps_lock);
 	}
+	++tps_lock_depth;
+}
 
-	// allocate memory, and then check if allocation is successful
-	void* mapped_area = init_mapped_area_helper();
-	if (mapped_area == MAP_FAILED) {
-		exit_critical_section();
-		return -1;
+// HELPER FUNCTION: release the global TPS lock taken with lock_tps()
+static void unlock_tps(void)
+{
+	--tps_lock_depth;
+	if (tps_lock_depth == 0) {
+		pthread_mutex_unlock(&tps_lock);
 	}
+}
 
-	// create the new TPS, and initialize its tid and page
-	TPS* new_tps = init_new_tps_helper(current_tid,
-		/* TPS page to use = */NULL, mapped_area);
-	if (!new_tps) {
-		exit_critical_section();
-		return -1;
-	}
+/* page map: radix tree keyed by page address */
 
-	// enque new_tps into tps_queue
-	check_create_queue(&tps_queue); // if the tps_queue was NULL, create it first
-	queue_enqueue(tps_queue, new_tps);
+// HELPER FUNCTION: find the TPS page whose mapped area starts at @mapped_area
+// only atomic loads are performed, so this is async-signal-safe and never races with page_map_set()
+// return the pointer to the TPS page, or return NULL if @mapped_area is not a TPS page
+static TPS_page* page_map_lookup(void* mapped_area)
+{
+	uintptr_t page_number = (uintptr_t)mapped_area >> TPS_PAGE_SHIFT;
+	if (page_number >> (PAGE_MAP_BITS * PAGE_MAP_LEVELS)) {
+		return NULL;
+	}
 
-	exit_critical_section();
-	return 0;
+	TPS_page_map_node* node = &page_map_root;
+	for (int level = PAGE_MAP_LEVELS - 1; level > 0; --level) {
+		size_t i = (page_number >> (level * PAGE_MAP_BITS)) & (PAGE_MAP_FANOUT - 1);
+		node = atomic_load_explicit(&(node->entries[i]), memory_order_acquire);
+		if (!node) {
+			return NULL;
+		}
+	}
+	return atomic_load_explicit(&(node->entries[page_number & (PAGE_MAP_FANOUT - 1)]), memory_order_acquire);
 }
 
-// destroy the TPS associated to current thread
-// return -1 if no TPS of current thread
+// HELPER FUNCTION: map @mapped_area to @page in the page map, or unmap it if @page is NULL
+// the caller must hold the global lock; missing nodes are fully initialized before being published, and are never freed
+// return -1 if @mapped_area is out of range, or if failed to allocate a node
 // return 0 if successful
-int tps_destroy(void)
+static int page_map_set(void* mapped_area, TPS_page* page)
 {
-	enter_critical_section();
-
-	pthread_t current_tid = pthread_self();
-
-	// find the TPS to be destroyed
-	// if not found, return -1
-	TPS* tps_to_destroy = get_tps_with_tid(tps_queue, current_tid);
-	if (!tps_to_destroy) {
-		exit_critical_section();
+	uintptr_t page_number = (uintptr_t)mapped_area >> TPS_PAGE_SHIFT;
+	if (page_number >> (PAGE_MAP_BITS * PAGE_MAP_LEVELS)) {
 		return -1;
 	}
 
-	unsigned int* ref_counter = &(tps_to_destroy->page->ref_counter);
-	// if the TPS to be destroyed has only one reference count (only one thread referring to the mapped_area of this TPS), then it is to be deleted from tps_queue and freed
-	assert(*ref_counter > 0);
-	if (*ref_counter == 1) {
-		queue_delete(tps_queue, tps_to_destroy);
-		check_destroy_queue(&tps_queue); // if the tps_queue is already empty after deletion, destroy it and set it to NULL
-
-		// unset protection, unmap the mapped area, and free the memory
-		if (tps_to_destroy->page) {
-			void* mapped_area = tps_to_destroy->page->mapped_area;
-			mprotect(mapped_area, TPS_SIZE, PROT_READ|PROT_WRITE);
-			munmap(mapped_area, TPS_SIZE);
-			free(tps_to_destroy->page);
+	TPS_page_map_node* node = &page_map_root;
+	for (int level = PAGE_MAP_LEVELS - 1; level > 0; --level) {
+		size_t i = (page_number >> (level * PAGE_MAP_BITS)) & (PAGE_MAP_FANOUT - 1);
+		TPS_page_map_node* child = atomic_load_explicit(&(node->entries[i]), memory_order_acquire);
+		if (!child) {
+			// nothing to unmap below a missing node
+			if (!page) {
+				return 0;
+			}
+			child = (TPS_page_map_node*)calloc(1, sizeof(TPS_page_map_node));
+			if (!child) {
+				return -1;
+			}
+			atomic_store_explicit(&(node->entries[i]), child, memory_order_release);
 		}
-		free(tps_to_destroy);
-	}
-	// otherwise, if there are multiple threads referring to the mapped_area of this TPS, then decrement the reference counter, but do nothing in the tps_queue
-	else {
-		--(*ref_counter);
+		node = child;
 	}
-
-	exit_critical_section();
+	atomic_store_explicit(&(node->entries[page_number & (PAGE_MAP_FANOUT - 1)]), page, memory_order_release);
 	return 0;
 }
 
-// read from current thread's TPS, from an @offset by a given @length, and receive the data from @buffer
-// return -1 if no TPS of current thread, if reading out of bound, if @buffer is NULL, or on failure
-// return 0 if successful
-int tps_read(size_t offset, size_t length, char *buffer)
+// HELPER FUNCTION: compute the protection @page should have outside of tps_read() / tps_write(), when @refs TPSes use it
+// by default a page is only accessible while it is mapped with tps_map(); with TPS_GUARD_ONLY it stays accessible, and only guard pages protect it
+// a shared page is never writable, so that writing to it goes through copy-on-write
+static int page_refs_rest_prot(TPS_page* page, unsigned int refs)
 {
-	if (check_tps_access_error(offset, length, buffer) == -1) {
-		return -1;
+	if (page->pending_writer) {
+		return PROT_READ; // the next write must fault to break copy-on-write
 	}
-
-	enter_critical_section();
-
-	// find the TPS with the current tid to read from
-	// return -1 if not found, or if its page is NULL
-	pthread_t current_tid = pthread_self();
-	TPS* tps_to_read = get_tps_with_tid(tps_queue, current_tid);
-	if ((!tps_to_read) || (!(tps_to_read->page))) {
-		exit_critical_section();
-		return -1;
+	if (page->write_map_count > 0) {
+		return PROT_READ | PROT_WRITE;
 	}
+#ifdef TPS_GUARD_ONLY
+	return (refs > 1) ? PROT_READ : (PROT_READ | PROT_WRITE);
+#else
+	(void)refs;
+	return (page->map_count > 0) ? PROT_READ : PROT_NONE;
+#endif
+}
 
-	void* tps_mapped_area = tps_to_read->page->mapped_area;
-	void* mapped_area_to_read = (void*)(tps_mapped_area + offset);
+// HELPER FUNCTION: compute the protection @page should have outside of tps_read() / tps_write()
+static int page_rest_prot(TPS_page* page)
+{
+	return page_refs_rest_prot(page, page->ref_counter);
+}
 
-	// temporarily disable reading protection
-	if (mprotect(tps_mapped_area, TPS_SIZE, PROT_READ) == -1) {
-		exit_critical_section();
-		fprintf(stderr, "Try to set PROT_READ error!\n");
+// HELPER FUNCTION: change the protection of the mapped area of @page to @prot; nothing is done if it already has this protection
+// return -1 if counted_mprotect() failed
+// return 0 if successful
+static int page_protect(TPS_page* page, int prot)
+{
+	if (page->prot == prot) {
+		return 0;
+	}
+	if (counted_mprotect(page->mapped_area, TPS_SIZE, prot) == -1) {
+		fprintf(stderr, "Try to set page protection error!\n");
 		return -1;
 	}
+	page->prot = prot;
+	return 0;
+}
 
-	// read from mapped area to buffer
-	memcpy(buffer, mapped_area_to_read, length);
+/* page pool */
 
-	// reenable protection
-	if (mprotect(tps_mapped_area, TPS_SIZE, PROT_NONE) == -1) {
-		exit_critical_section();
-		fprintf(stderr, "Try to set PROT_NONE error!\n");
+// HELPER FUNCTION: reserve the arena, with room for @slots TPS pages
+// the reservation is not accessible and not accounted for until slots are carved and used
+// return -1 if failed to reserve the arena
+// return 0 if successful
+static int arena_reserve(size_t slots, bool huge)
+{
+	size_t length = slots * TPS_SLOT_STRIDE + TPS_SLOT_OFFSET;
+	void* base = counted_mmap(length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS);
+	if (base == MAP_FAILED) {
 		return -1;
 	}
+	uffd_register_helper(base, length);
+	// only a hint: huge pages are split as soon as slots next to each other get different protections
+	if (huge) {
+		counted_madvise(base, length, MADV_HUGEPAGE);
+	}
 
-	exit_critical_section();
+	arena.base = (char*)base;
+	arena.slots = slots;
+	arena.next_slot = 0;
 	return 0;
 }
 
-// write to current thread's TPS, at an @offset by a given @length from @buffer
-// if current thread's TPS shares a memory page with another thread's TPS, trigger a copy-and-write operation before actually writing
-// return -1 if no TPS of current thread, if writing out of bound, or if @buffer is NULL, or on failure
-// return 0 if successfully written to
-int tps_write(size_t offset, size_t length, char *buffer)
+// HELPER FUNCTION: carve the next @count slots out of the arena
+// return the address of the first slot
+// return NULL if the arena is full, or if failed to prefault the slots
+static char* arena_carve(size_t* count)
 {
-	if (check_tps_access_error(offset, length, buffer) == -1) {
-		return -1;
+	if (arena.next_slot >= arena.slots) {
+		return NULL;
 	}
-
-	enter_critical_section();
-
-	// find the TPS with the current tid to write to
-	// return -1 if not found, or if its page is NULL, or if mapped area is NULL
-	pthread_t current_tid = pthread_self();
-	TPS* tps_to_write = get_tps_with_tid(tps_queue, current_tid);
-	if ((!tps_to_write) || (!(tps_to_write->page))
-		|| (!(tps_to_write->page->mapped_area))) {
-		exit_critical_section();
-		return -1;
+	if (*count > arena.slots - arena.next_slot) {
+		*count = arena.slots - arena.next_slot;
 	}
+	char* region = arena.base + arena.next_slot * TPS_SLOT_STRIDE;
+	size_t length = *count * TPS_SLOT_STRIDE;
 
-	unsigned int* ref_counter = &(tps_to_write->page->ref_counter);
-	assert(*ref_counter > 0);
-	// write directly if the current thread's TPS refers to its dedicated TPS page
-	if (*ref_counter == 1) {
-		void* tps_mapped_area = tps_to_write->page->mapped_area;
-		void* mapped_area_to_write = (void*)(tps_mapped_area + offset);
-
-		// temporarily disable writing protection
-		if (mprotect(tps_mapped_area, TPS_SIZE, PROT_WRITE) == -1) {
-			fprintf(stderr, "Try to set PROT_WRITE error!\n");
-			exit_critical_section();
-			return -1;
+	// slots are populated while writable, then closed all at once; they stay resident
+	if (page_pool.prefault) {
+		if (counted_mprotect(region, length, PROT_READ | PROT_WRITE) == -1) {
+			return NULL;
 		}
+		for (size_t i = 0; i < *count; ++i) {
+			*(volatile char*)(region + TPS_SLOT_OFFSET + i * TPS_SLOT_STRIDE) = 0;
+		}
+		counted_mprotect(region, length, PROT_NONE);
+	}
+
+	arena.next_slot += *count;
+	return region;
+}
 
-		// write from buffer to mapped area
-		memcpy(mapped_area_to_write, buffer, length);
+// HELPER FUNCTION: give back the slots @used to @count of the @region carved or mapped by page_pool_refill(), which got no page
+// in arena mode, they were the last slots carved, so they go back to the arena; otherwise they are unmapped, with the whole region if no slot was used
+static void page_pool_unrefill_helper(char* region, size_t used, size_t count)
+{
+	if (arena.base) {
+		arena.next_slot -= count - used;
+	}
+	else if (used == 0) {
+		counted_munmap(region, count * TPS_SLOT_STRIDE + TPS_SLOT_OFFSET);
+	}
+	else {
+		// the guard page after the last used slot stays with it
+		counted_munmap(region + TPS_SLOT_OFFSET + used * TPS_SLOT_STRIDE, (count - used) * TPS_SLOT_STRIDE);
+	}
+}
 
-		// reenable protection
-		if (mprotect(tps_mapped_area, TPS_SIZE, PROT_NONE) == -1) {
-			exit_critical_section();
-			fprintf(stderr, "Try to set PROT_NONE error!\n");
+// HELPER FUNCTION: add @count free pages to the page pool, carved from a single new mapping, or from the arena in arena mode
+// free pages stay registered in the page map, so that accessing one of them is also reported as a TPS protection error
+// return -1 if failed to map the pages, or if the arena is full
+// return 0 if successful
+static int page_pool_refill(size_t count)
+{
+	char* region;
+	if (arena.base) {
+		region = arena_carve(&count);
+		if (!region) {
 			return -1;
 		}
 	}
-	// otherwise, if current thread's TPS temporarily "borrows" the TPS page of some other threads, perform copy-and-write
-	// a new TPS page is created, then the current threads gives up the borrowed page, and use the new page instead
 	else {
-		// update the states of the old (borrowed) TPS
-		TPS* old_tps = tps_to_write;
-		TPS_page* old_tps_page = old_tps->page;
-		if (!old_tps_page) {
-			exit_critical_section();
+		// pages are populated while writable, then closed all at once; they stay resident
+		size_t length = count * TPS_SLOT_STRIDE + TPS_SLOT_OFFSET;
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		int prot = PROT_NONE;
+		if (page_pool.prefault) {
+			flags |= MAP_POPULATE;
+			prot = PROT_READ | PROT_WRITE;
+		}
+		region = (char*)counted_mmap(length, prot, flags);
+		if (region == MAP_FAILED) {
+			return -1;
+		}
+		if ((prot != PROT_NONE) && (counted_mprotect(region, length, PROT_NONE) == -1)) {
+			counted_munmap(region, length);
 			return -1;
 		}
-		--(old_tps_page->ref_counter);
+		uffd_register_helper(region, length);
+	}
 
-		// update tps_to_write with current thread's tid
-		pthread_t current_tid = pthread_self();
-		tps_to_write->tid = current_tid;
+	for (size_t i = 0; i < count; ++i) {
+		TPS_page* page = (TPS_page*)slab_alloc(&page_slab);
+		if (!page) {
+			// keep the pages carved so far, and give the rest of the region back
+			page_pool_unrefill_helper(region, i, count);
+			return (i > 0) ? 0 : -1;
+		}
+		page->mapped_area = (void*)(region + TPS_SLOT_OFFSET + i * TPS_SLOT_STRIDE);
+		page->prot = PROT_NONE;
+		if (page_map_set(page->mapped_area, page) == -1) {
+			slab_free(&page_slab, page);
+			page_pool_unrefill_helper(region, i, count);
+			return (i > 0) ? 0 : -1;
+		}
+		page->next_free = page_pool.free_list;
+		page_pool.free_list = page;
+		++(page_pool.free_count);
+	}
+	return 0;
+}
 
-		// let current thread's TPS use the new page
-		// create a new TPS page and allocate memory
-		TPS_page* new_tps_page = (TPS_page*)malloc(sizeof(TPS_page*));
-		if (!new_tps_page) {
-			exit_critical_section();
-			return -1;
+// HELPER FUNCTION: take a new TPS page from the page pool, with a ref_counter of 1
+// if @zero is true, the mapped area is cleared (it may be left writable for that)
+// the pool is refilled up to its high water mark when it runs below its low water mark
+// return the pointer to the TPS page
+// return NULL if failed to get or register the page
+static TPS_page* init_new_page_helper(bool zero)
+{
+	if ((page_pool.free_count == 0) || (page_pool.free_count <= page_pool.low)) {
+		size_t count = (page_pool.high > page_pool.free_count) ? (page_pool.high - page_pool.free_count) : 1;
+		if ((page_pool_refill(count) == -1) && (page_pool.free_count == 0)) {
+			return NULL;
 		}
-		tps_to_write->page = new_tps_page;
+	}
 
-		// create the new_mapped_area for the new page, and set the new page's ref_counter to be 1
-		void* new_mapped_area = init_mapped_area_helper();
-		if (new_mapped_area == MAP_FAILED) {
-			exit_critical_section();
-			return -1;
+	TPS_page* page = page_pool.free_list;
+	page_pool.free_list = page->next_free;
+	--(page_pool.free_count);
+	page->next_free = NULL;
+	page->ref_counter = 1;
+
+	if (zero && page->dirty) {
+		// without prefaulting, dropping the page is a single system call, and it comes back zeroed on the next access
+		// otherwise it is cleared in place, to stay resident
+		int ret;
+		if (!(page_pool.prefault)) {
+			ret = counted_madvise(page->mapped_area, TPS_SIZE, MADV_DONTNEED);
+		}
+		else {
+			ret = page_protect(page, PROT_READ | PROT_WRITE);
+			if (ret == 0) {
+				memset(page->mapped_area, 0, TPS_SIZE);
+			}
+		}
+		if (ret == -1) {
+			page->next_free = page_pool.free_list;
+			page_pool.free_list = page;
+			++(page_pool.free_count);
+			return NULL;
 		}
-		new_tps_page->mapped_area = new_mapped_area;
-		new_tps_page->ref_counter = 1;
+		page->dirty = false;
+	}
+	return page;
+}
 
-		// temporarily disable writing protection
-		void* old_mapped_area = old_tps_page->mapped_area;
-		if ((mprotect(old_mapped_area, TPS_SIZE, PROT_WRITE) == -1)
-			|| (mprotect(new_mapped_area, TPS_SIZE, PROT_WRITE) == -1))  {
-			exit_critical_section();
-			fprintf(stderr, "Try to set PROT_WRITE error!\n");
-			return -1;
+// HELPER FUNCTION: give @page back to the page pool
+// above the high water mark, its mapped area is unregistered from the page map and unmapped instead, unless it is an arena slot
+// a page of a region is only released, and the region is unmapped with its last page
+static void free_page_helper(TPS_page* page)
+{
+	TPS_region* region = page->region;
+	if (region) {
+		page_map_set(page->mapped_area, NULL);
+		page_protect(page, PROT_NONE);
+		counted_madvise(page->mapped_area, TPS_SIZE, MADV_DONTNEED);
+		slab_free(&page_slab, page);
+		--(region->live_pages);
+		if (region->live_pages == 0) {
+			counted_munmap(region->base, region->length);
+			if (region->fd != -1) {
+				close(region->fd);
+			}
+			free(region);
 		}
+		return;
+	}
+
+	bool trim = (page_pool.free_count >= page_pool.high);
+	if (trim && !(arena.base)) {
+		page_map_set(page->mapped_area, NULL);
+		counted_munmap(page->mapped_area, TPS_SIZE);
+		slab_free(&page_slab, page);
+		return;
+	}
 
-		// copy memory from the old TPS page's mapped area to the new TPS page's mapped area, and write the new mapped area using the buffer
-		void* mapped_area_to_write = (void*)(new_mapped_area + offset);
-		memcpy(new_mapped_area, old_mapped_area, TPS_SIZE);
-		memcpy(mapped_area_to_write, buffer, length);
+	// the content is only cleared when the page is reused for a new TPS, since copies overwrite it anyway
+	// but it is closed right away, so that the free page cannot be accessed by mistake
+	// arena slots are never unmapped; above the high water mark, their memory is released instead
+	page_protect(page, PROT_NONE);
+	void* mapped_area = page->mapped_area;
+	int prot = page->prot;
+	memset(page, 0, sizeof(TPS_page));
+	page->mapped_area = mapped_area;
+	page->prot = prot;
+	// with the userfaultfd backend, the memory is always released, so that a copy can later fill the page without opening it
+	page->dirty = !((trim || (uffd != -1)) && (counted_madvise(mapped_area, TPS_SIZE, MADV_DONTNEED) == 0));
+	page_map_set(mapped_area, page); // it may have been registered for a shared page by arm_cow_fault_helper()
+	page->next_free = page_pool.free_list;
+	page_pool.free_list = page;
+	++(page_pool.free_count);
+}
 
-		// reenable protection
-		if ((mprotect(old_mapped_area, TPS_SIZE, PROT_NONE) == -1)
-			|| (mprotect(new_mapped_area, TPS_SIZE, PROT_NONE) == -1))  {
-			exit_critical_section();
-			fprintf(stderr, "Try to set PROT_NONE error!\n");
+// HELPER FUNCTION: create @count new TPS pages, with a ref_counter of 1, whose mapped areas follow each other in a new region
+// the pages are zeroed and stored in @pages; with TPS_GUARD_ONLY, the region starts and ends with a guard page
+// return -1 if failed to map the region, or to create or register the pages
+// return 0 if successful
+static int init_new_region_helper(TPS_page** pages, size_t count)
+{
+	TPS_region* region = (TPS_region*)malloc(sizeof(TPS_region));
+	if (!region) {
+		return -1;
+	}
+	region->length = count * TPS_SIZE + 2 * TPS_SLOT_OFFSET;
+	region->live_pages = 0;
+	region->fd = -1;
+	region->owner = NULL;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	int prot = PROT_NONE;
+	if (page_pool.prefault) {
+		flags |= MAP_POPULATE;
+		prot = PROT_READ | PROT_WRITE;
+	}
+	region->base = counted_mmap(region->length, prot, flags);
+	if (region->base == MAP_FAILED) {
+		free(region);
+		return -1;
+	}
+	if ((prot != PROT_NONE) && (counted_mprotect(region->base, region->length, PROT_NONE) == -1)) {
+		counted_munmap(region->base, region->length);
+		free(region);
+		return -1;
+	}
+	uffd_register_helper(region->base, region->length);
+
+	for (size_t i = 0; i < count; ++i) {
+		TPS_page* page = (TPS_page*)slab_alloc(&page_slab);
+		if (page) {
+			page->mapped_area = (void*)((char*)region->base + TPS_SLOT_OFFSET + i * TPS_SIZE);
+			page->prot = PROT_NONE;
+			page->ref_counter = 1;
+			page->region = region;
+			if (page_map_set(page->mapped_area, page) == -1) {
+				slab_free(&page_slab, page);
+				page = NULL;
+			}
+		}
+		if (!page) {
+			// the region is unmapped along with the last page created so far
+			for (size_t j = 0; j < i; ++j) {
+				free_page_helper(pages[j]);
+				pages[j] = NULL;
+			}
+			if (i == 0) {
+				counted_munmap(region->base, region->length);
+				free(region);
+			}
 			return -1;
 		}
+		++(region->live_pages);
+		pages[i] = page;
 	}
-
-	exit_critical_section();
 	return 0;
 }
 
-// clone the TPS of @tid
-// first phase: copy the TPS's content directly
-// last phase: do NOT copy content, but refer to the same memory page
-// return -1 if @tid does not have TPS, if current thread has TPS, or on failure
-// return 0 if successfully cloned
-int tps_clone(pthread_t tid)
+// HELPER FUNCTION: copy the content of @src_page into @page, which is not shared
+// return -1 if failed to open @page for writing, or @src_page for reading
+// return 0 if successful
+static int copy_page_helper(TPS_page* page, TPS_page* src_page)
 {
-	enter_critical_section();
+	// temporarily allow reading the source page if it is not readable yet
+	int src_prot = src_page->prot;
+	if (page_protect(src_page, src_prot | PROT_READ) == -1) {
+		return -1;
+	}
 
-	pthread_t current_tid = pthread_self();
+	// with the userfaultfd backend, a page whose memory was released is filled without opening it
+	if ((page->dirty) || (uffd_copy_helper(page->mapped_area, src_page->mapped_area) == -1)) {
+		if (page_protect(page, PROT_READ | PROT_WRITE) == -1) {
+			page_protect(src_page, src_prot);
+			return -1;
+		}
+		memcpy(page->mapped_area, src_page->mapped_area, TPS_SIZE);
+	}
+	TPS_STAT_ADD(bytes_copied, TPS_SIZE);
+	page->dirty = true;
+	page_protect(src_page, src_prot);
+	page_protect(page, page_rest_prot(page));
+	return 0;
+}
 
-	// check if the passed tid does not have a TPS, or if the current thread already has a TPS
-	// if it is either case, return -1
-	TPS* tps_with_passed_tid = get_tps_with_tid(tps_queue, tid);
-	TPS* tps_with_current_tid = get_tps_with_tid(tps_queue, current_tid);
-	if ((!tps_with_passed_tid) || tps_with_current_tid) {
-		exit_critical_section();
-		return -1;
+// HELPER FUNCTION: create a new TPS page holding a copy of the content of @src_page
+// return the pointer to the new TPS page
+// return NULL if failed to create the page, or to read @src_page
+static TPS_page* init_page_copy_helper(TPS_page* src_page)
+{
+	TPS_page* page = init_new_page_helper(/* zero = */false);
+	if (!page) {
+		return NULL;
+	}
+	if (copy_page_helper(page, src_page) == -1) {
+		free_page_helper(page);
+		return NULL;
 	}
+	return page;
+}
 
-	// create the new TPS for the current thread
-	// borrow the the passed TID's TPS page to let the new TPS use it, until the new TPS wants to write (copy-on-writing)
-	TPS* tps_to_clone = tps_with_passed_tid;
-	TPS* new_tps = init_new_tps_helper(current_tid,
-		/* TPS page to use = */tps_to_clone->page,
-		/* mapped_area (not used for cloning) = */NULL);
+// HELPER FUNCTION: initialize new TPS with a specified @tid, and room for the pages of @size bytes
+// the pages are left NULL, for the caller to fill
+// return the pointer to TPS
+// return NULL if failed to create TPS
+static TPS* init_new_tps_helper(pthread_t tid, size_t size)
+{
+	TPS* new_tps = (TPS*)slab_alloc(&tps_slab);
 	if (!new_tps) {
-		exit_critical_section();
-		return -1;
+		return NULL;
 	}
 
-	// enque new_tps into tps_queue
-	check_create_queue(&tps_queue); // if the tps_queue was NULL, create it first
-	queue_enqueue(tps_queue, new_tps);
+	new_tps->tid = tid;
+	pthread_mutex_init(&(new_tps->lock), NULL);
+	new_tps->size = size;
+	new_tps->alloc_base = (size + TPS_ALLOC_ALIGN - 1) & ~((size_t)TPS_ALLOC_ALIGN - 1);
+	new_tps->alloc_top = new_tps->alloc_base;
+	new_tps->page_count = (size + TPS_SIZE - 1) / TPS_SIZE;
+	if (new_tps->page_count == 1) {
+		new_tps->pages = &(new_tps->single_page);
+	}
+	else {
+		new_tps->pages = (TPS_page**)calloc(new_tps->page_count, sizeof(TPS_page*));
+		if (!(new_tps->pages)) {
+			slab_free(&tps_slab, new_tps);
+			return NULL;
+		}
+	}
+
+	return new_tps;
+}
+
+// HELPER FUNCTION: let @refs more TPSes share @page with the TPSes already referring to it (used when cloning a TPS)
+// the caller holds the lock of the TPS being cloned, so that its owner is not accessing the page without the global lock
+static void share_page_helper(TPS_page* page, unsigned int refs)
+{
+	page->ref_counter += refs;
+	assert(page->ref_counter >= refs);
+	page_protect(page, page_rest_prot(page));
+}
+
+// HELPER FUNCTION: drop one reference to @page, which other TPSes still use
+// once its ref_counter drops to 1, the last TPS using the page may access it without the global lock, so the page is updated before
+static void unshare_page_helper(TPS_page* page)
+{
+	page_protect(page, page_refs_rest_prot(page, page->ref_counter - 1));
+	atomic_fetch_sub_explicit(&(page->ref_counter), 1, memory_order_release);
+}
+
+// HELPER FUNCTION: let @new_tps share all the pages of @tps, which has the same size (used when cloning or snapshotting a TPS), along with its tps_alloc() objects
+// pages mapped for writing with tps_map() are copied right away, since their owner may modify them at any time
+// the caller holds the global lock, and the lock of @tps unless it belongs to the current thread
+// return -1 if failed to copy a page; the pages already shared are released along with @new_tps
+// return 0 if successful
+static int share_pages_helper(TPS* new_tps, TPS* tps)
+{
+	new_tps->alloc_base = tps->alloc_base;
+	new_tps->alloc_top = tps->alloc_top;
+	for (size_t i = 0; i < new_tps->page_count; ++i) {
+		TPS_page* page = tps->pages[i];
+		if (page->write_map_count > 0) {
+			new_tps->pages[i] = init_page_copy_helper(page);
+			if (!(new_tps->pages[i])) {
+				return -1;
+			}
+		}
+		else {
+			share_page_helper(page, 1);
+			new_tps->pages[i] = page;
+		}
+	}
+	return 0;
+}
+
+// HELPER FUNCTION: stop expecting a copy-on-write fault in the current thread, and give back the spare page that was prepared for it
+static void disarm_cow_fault_helper(void)
+{
+	TPS_cow_fault* cow = &pending_cow_fault;
+	if (cow->tps) {
+		TPS_page* page = cow->tps->pages[cow->page_index];
+		if (page->pending_writer == cow->tps) {
+			page->pending_writer = NULL;
+		}
+		cow->tps = NULL;
+	}
+	if (cow->spare_page) {
+		free_page_helper(cow->spare_page);
+		cow->spare_page = NULL;
+	}
+}
+
+// HELPER FUNCTION: get a spare page to break copy-on-write on @page, opened for writing
+// the mapped area of the spare page is registered for @page in advance, so that breaking copy-on-write does not allocate page map nodes either
+// return the pointer to the spare page
+// return NULL if failed to get the spare page
+static TPS_page* init_spare_page_helper(TPS_page* page)
+{
+	TPS_page* spare_page = init_new_page_helper(/* zero = */false);
+	if (!spare_page) {
+		return NULL;
+	}
+	if (page_protect(spare_page, PROT_READ | PROT_WRITE) == -1) {
+		free_page_helper(spare_page);
+		return NULL;
+	}
+	page_map_set(spare_page->mapped_area, page);
+	return spare_page;
+}
+
+// HELPER FUNCTION: prepare the current thread's @tps to break copy-on-write on its shared page @i in the page fault handler
+// everything the handler needs is prepared here, under the global lock: the spare page, its page map node, and the counters of the thread, so that the handler neither allocates nor registers anything
+// return -1 if failed to get the spare page
+// return 0 if successful
+static int arm_cow_fault_helper(TPS* tps, size_t i)
+{
+	TPS_cow_fault* cow = &pending_cow_fault;
+	TPS_STAT_REGISTER();
+	cow->spare_page = init_spare_page_helper(tps->pages[i]);
+	if (!(cow->spare_page)) {
+		return -1;
+	}
+
+	cow->tps = tps;
+	cow->page_index = i;
+	tps->pages[i]->pending_writer = tps;
+	return 0;
+}
+
+/* TPS index: chained hash table keyed by thread ID */
+
+#define TPS_INDEX_MIN_CAPACITY 16
+
+// HELPER FUNCTION: hash a @tid into a bucket number
+// pthread_t values are usually aligned addresses, so the low bits are mixed with the high bits first
+static size_t hash_tid_helper(pthread_t tid)
+{
+	uint64_t x = (uint64_t)tid;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (size_t)x;
+}
+
+// HELPER FUNCTION: start (or end) a change of @index that takes TPSes out of their chain; the caller must hold the global lock
+// a TPS taken out may be recycled for another thread as soon as the change ends, so a reader whose walk overlaps the change gives up (see index_find())
+static void index_seq_bump(TPS_index* index)
+{
+	// the release store orders the change made before it (end), and the fence the change made after it (start)
+	atomic_store_explicit(&(index->seq), atomic_load_explicit(&(index->seq), memory_order_relaxed) + 1, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+// HELPER FUNCTION: find the TPS of @tid in @index
+// without the global lock, the search may race with updates: it then misses the TPS, and the caller retries under the lock
+// a TPS removed during the walk may already be recycled for another thread, with its index_next leading to another chain; the walk is therefore checked against index->seq like a seqlock, so that it never returns a wrong TPS
+// the walk is also bounded, since a bucket being moved by index_resize() may lead a reader to another bucket
+// return the pointer to the TPS, or return NULL if not found
+static TPS* index_find(TPS_index* index, pthread_t tid)
+{
+	size_t seq = atomic_load_explicit(&(index->seq), memory_order_acquire);
+	if (seq & 1) {
+		return NULL;
+	}
+	TPS_index_table* table = atomic_load_explicit(&(index->table), memory_order_acquire);
+	if (!table) {
+		return NULL;
+	}
+
+	TPS* tps = atomic_load_explicit(&(table->buckets[hash_tid_helper(tid) & (table->capacity - 1)]), memory_order_acquire);
+	size_t steps = 0;
+	for (; tps && (steps <= table->capacity); ++steps) {
+		if (tps->tid == tid) {
+			break;
+		}
+		tps = atomic_load_explicit(&(tps->index_next), memory_order_acquire);
+	}
+	TPS_STAT_ADD(lookups, 1);
+	TPS_STAT_ADD(lookup_steps, steps + 1);
+
+	// pairs with the fence of index_seq_bump(): if the walk saw any effect of a removal, it sees seq changed
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&(index->seq), memory_order_relaxed) != seq) {
+		return NULL;
+	}
+	return (steps <= table->capacity) ? tps : NULL;
+}
+
+// HELPER FUNCTION: move all the TPSes of @index to a new table of @new_capacity buckets, and publish it
+// the old table is kept, since readers may still walk it
+// return -1 if failed to allocate the new table
+// return 0 if successful
+static int index_resize(TPS_index* index, size_t new_capacity)
+{
+	TPS_index_table* new_table = (TPS_index_table*)calloc(1, sizeof(TPS_index_table) + new_capacity * sizeof(_Atomic(TPS*)));
+	if (!new_table) {
+		return -1;
+	}
+	new_table->capacity = new_capacity;
+
+	TPS_index_table* table = atomic_load_explicit(&(index->table), memory_order_relaxed);
+	index_seq_bump(index);
+	for (size_t j = 0; table && (j < table->capacity); ++j) {
+		TPS* tps = atomic_load_explicit(&(table->buckets[j]), memory_order_relaxed);
+		while (tps) {
+			TPS* next = atomic_load_explicit(&(tps->index_next), memory_order_relaxed);
+			_Atomic(TPS*)* bucket = &(new_table->buckets[hash_tid_helper(tps->tid) & (new_capacity - 1)]);
+			atomic_store_explicit(&(tps->index_next), atomic_load_explicit(bucket, memory_order_relaxed), memory_order_release);
+			atomic_store_explicit(bucket, tps, memory_order_relaxed);
+			tps = next;
+		}
+	}
+
+	atomic_store_explicit(&(index->table), new_table, memory_order_release);
+	index_seq_bump(index);
+	return 0;
+}
+
+// HELPER FUNCTION: grow @index once, so that @count more TPSes can be inserted without growing it again; the caller must hold the global lock
+// return -1 if failed to grow the table
+// return 0 if successful
+static int index_reserve(TPS_index* index, size_t count)
+{
+	TPS_index_table* table = atomic_load_explicit(&(index->table), memory_order_relaxed);
+	size_t capacity = table ? table->capacity : TPS_INDEX_MIN_CAPACITY;
+	while (capacity < index->count + count) {
+		capacity *= 2;
+	}
+	if (table && (capacity == table->capacity)) {
+		return 0;
+	}
+	return index_resize(index, capacity);
+}
+
+// HELPER FUNCTION: insert @tps into @index; the caller must hold the global lock, and make sure its tid is not already in @index
+// the table doubles once it holds as many TPSes as buckets
+// return -1 if failed to grow the table
+// return 0 if successful
+static int index_insert(TPS_index* index, TPS* tps)
+{
+	TPS_index_table* table = atomic_load_explicit(&(index->table), memory_order_relaxed);
+	if ((!table) || (index->count + 1 > table->capacity)) {
+		if (index_resize(index, table ? (2 * table->capacity) : TPS_INDEX_MIN_CAPACITY) == -1) {
+			return -1;
+		}
+		table = atomic_load_explicit(&(index->table), memory_order_relaxed);
+	}
+
+	// the TPS is fully initialized before being published
+	_Atomic(TPS*)* bucket = &(table->buckets[hash_tid_helper(tps->tid) & (table->capacity - 1)]);
+	atomic_store_explicit(&(tps->index_next), atomic_load_explicit(bucket, memory_order_relaxed), memory_order_relaxed);
+	atomic_store_explicit(bucket, tps, memory_order_release);
+	++(index->count);
+	return 0;
+}
+
+// HELPER FUNCTION: remove @tps from @index; the caller must hold the global lock
+static void index_remove(TPS_index* index, TPS* tps)
+{
+	TPS_index_table* table = atomic_load_explicit(&(index->table), memory_order_relaxed);
+	_Atomic(TPS*)* link = &(table->buckets[hash_tid_helper(tps->tid) & (table->capacity - 1)]);
+	while (atomic_load_explicit(link, memory_order_relaxed) != tps) {
+		link = &(atomic_load_explicit(link, memory_order_relaxed)->index_next);
+	}
+	index_seq_bump(index);
+	atomic_store_explicit(link, atomic_load_explicit(&(tps->index_next), memory_order_relaxed), memory_order_release);
+	index_seq_bump(index);
+	--(index->count);
+}
+
+/* copy-on-write */
+
+// HELPER FUNCTION: break copy-on-write on the shared page @i of @tps, using @spare_page from init_spare_page_helper()
+// the writer keeps the mapped area, which becomes private, and the other TPSes sharing the page are moved to a copy of it
+// nothing is allocated here, so that this can run in the page fault handler
+// return -1 on failure
+// return 0 if copy-on-write was successfully broken
+static int cow_swap_helper(TPS* tps, size_t i, TPS_page* private_page)
+{
+	TPS_page* page = tps->pages[i];
+	void* mapped_area = page->mapped_area;
+	void* copy_area = private_page->mapped_area;
+	int copy_prot = private_page->prot;
+	TPS_region* copy_region = private_page->region;
+
+	// copy the shared content; the copy area is already writable
+	if (page_protect(page, page->prot | PROT_READ) == -1) {
+		return -1;
+	}
+	if ((private_page->dirty) || (uffd_copy_helper(copy_area, mapped_area) == -1)) {
+		memcpy(copy_area, mapped_area, TPS_SIZE);
+	}
+	TPS_STAT_ADD(bytes_copied, TPS_SIZE);
+
+	// the writer takes over the mapped area with the spare page, along with its tps_map() session if any
+	private_page->mapped_area = mapped_area;
+	private_page->prot = page->prot;
+	private_page->region = page->region;
+	private_page->dirty = true;
+	if (tps->map_depth > 0) {
+		--(page->map_count);
+		private_page->map_count = 1;
+		if (tps->map_prot & PROT_WRITE) {
+			--(page->write_map_count);
+			private_page->write_map_count = 1;
+		}
+	}
+	page_map_set(mapped_area, private_page); // the page map node already exists, so nothing is allocated
+	tps->pages[i] = private_page;
+
+	// the other TPSes keep sharing the page, whose content now lives in the copy (already registered in the page map)
+	page->mapped_area = copy_area;
+	page->prot = copy_prot;
+	page->region = copy_region;
+	unshare_page_helper(page);
+	TPS_STAT_ADD(cow_copies, 1);
+
+	// let the write go through
+	return page_protect(private_page, PROT_READ | PROT_WRITE);
+}
+
+// HELPER FUNCTION: break copy-on-write on @page for the current thread, which was prepared by arm_cow_fault_helper()
+// this is called from the page fault handler on the first write with TPS_COW_FAULT
+// return -1 if the current thread was not expecting to break copy-on-write on @page, or on failure
+// return 0 if copy-on-write was successfully broken
+static int cow_fault_helper(TPS_page* page)
+{
+	TPS_cow_fault* cow = &pending_cow_fault;
+	TPS* tps = cow->tps;
+	if ((!tps) || (tps->pages[cow->page_index] != page) || (page->pending_writer != tps)) {
+		return -1;
+	}
+	page->pending_writer = NULL;
+	cow->tps = NULL;
+
+	// if all the other TPSes stopped sharing the page in the meantime, it is already private
+	// the spare page is left for disarm_cow_fault_helper() to free
+	if (page->ref_counter == 1) {
+		return page_protect(page, PROT_READ | PROT_WRITE);
+	}
+
+	TPS_page* private_page = cow->spare_page;
+	cow->spare_page = NULL;
+	return cow_swap_helper(tps, cow->page_index, private_page);
+}
+
+// signal handler function
+// snippet provided by professor Porquet
+static void segv_handler(int sig, siginfo_t *si, void *context)
+{
+	// get the address corresponding to the beginning of the page where the fault occurred
+	void *p_fault = (void*)((uintptr_t)si->si_addr & ~(TPS_SIZE - 1));
+	TPS_STAT_FAULT();
+
+	// if the current thread expects to break copy-on-write, check if this is the fault it was expecting
+	// pthread_mutex_lock() is not async-signal-safe in general, but this fault is synchronous, and is armed by arm_cow_fault_helper() and disarmed before the thread leaves the library, except during a tps_map() session; the faulting write therefore comes either:
+	// - from the library (tps_write(), tps_fetch_add(), ...), which never writes to a page expecting the fault without the global lock (see access_lock_helper()), so tps_lock_depth > 0 and lock_tps() does not touch the mutex
+	// - or from the application, or the mapped path of tps_set(), during a tps_map() session, which holds no lock of the library, so waiting for the mutex is as safe as in any thread
+	// nothing below allocates memory or takes another lock (see arm_cow_fault_helper())
+	if (pending_cow_fault.tps) {
+		assert((tps_lock_depth > 0) || (pending_cow_fault.tps->map_depth > 0));
+		lock_tps();
+		TPS_page* cow_page = page_map_lookup(p_fault);
+		int cow_ret = cow_page ? cow_fault_helper(cow_page) : -1;
+		unlock_tps();
+		if (cow_ret == 0) {
+			return;
+		}
+	}
+
+	// look p_fault up in the page map to find if it matches one of the TPS areas
+	TPS_page* faulty_page = page_map_lookup(p_fault);
+#ifdef TPS_GUARD_ONLY
+	// TPS areas stay accessible, so an overflow faults on the guard page right after (or before) a TPS page
+	if (!faulty_page) {
+		faulty_page = page_map_lookup((char*)p_fault - TPS_SIZE);
+	}
+	if (!faulty_page) {
+		faulty_page = page_map_lookup((char*)p_fault + TPS_SIZE);
+	}
+#endif
+	// if there is a match
+	if (faulty_page && tps_config.segv) {
+		fprintf(stderr, "TPS protection error!\n");
+	}
+
+	// in any case, restore the default signal handlers
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGBUS, SIG_DFL);
+	// and transmit the signal again in order to cause the program to crash
+	raise(sig);
+}
+
+// HELPER FUNCTION: let the current thread's @tps use a private copy of its shared page @i, and give up the shared page
+static int cow_copy_helper(TPS* tps, size_t i)
+{
+	TPS_page* old_page = tps->pages[i];
+	TPS_page* new_page = init_page_copy_helper(old_page);
+	if (!new_page) {
+		return -1;
+	}
+
+	tps->pages[i] = new_page;
+	unshare_page_helper(old_page);
+	TPS_STAT_ADD(cow_copies, 1);
+	return 0;
+}
+
+// HELPER FUNCTION: give the current thread's @tps a private page @i before writing to its shared page
+// if the current thread relies on the address of its page (it is mapped with tps_map()), the address is kept and the other TPSes sharing the page are moved to a copy
+// if @keep_address is true, the address is also kept when possible, so that the pages of a larger TPS stay contiguous
+// with TPS_COW_FAULT, breaking copy-on-write is deferred to the first write, which faults, unless the thread already expects a fault for another page
+// the owner of a persistent TPS always keeps the address of its page, and the other TPSes always move to a copy
+// return -1 on failure, or if both the current thread and another thread rely on the address of the shared page
+// return 0 if successful
+static int make_private_helper(TPS* tps, size_t i, bool keep_address)
+{
+	TPS_page* page = tps->pages[i];
+	bool mapped = (tps->map_depth > 0);
+	keep_address = keep_address || mapped;
+	bool other_users = (page->map_count > (mapped ? 1 : 0))
+		|| (page->pending_writer && (page->pending_writer != tps));
+
+	// the file of a persistent TPS only receives the writes of its owner, which therefore always keeps the addresses of its pages
+	TPS_region* owner_region = (page->region && page->region->owner) ? page->region : NULL;
+	if (owner_region && (owner_region->owner != tps)) {
+		return mapped ? -1 : cow_copy_helper(tps, i);
+	}
+
+	// if another thread relies on the address of the shared page, the writer has to move to a copy
+	if (other_users) {
+		if (mapped || owner_region) {
+			return -1;
+		}
+		return cow_copy_helper(tps, i);
+	}
+
+	if ((tps_config.cow_mode == TPS_COW_FAULT) && !(pending_cow_fault.tps)) {
+		return arm_cow_fault_helper(tps, i);
+	}
+	if (keep_address || owner_region) {
+		// same as breaking copy-on-write in the fault handler, but right away
+		TPS_page* spare_page = init_spare_page_helper(page);
+		if (!spare_page) {
+			return -1;
+		}
+		if (cow_swap_helper(tps, i, spare_page) == -1) {
+			free_page_helper(spare_page);
+			return -1;
+		}
+		return 0;
+	}
+	return cow_copy_helper(tps, i);
+}
+
+// HELPER FUNCTION: check TPS access error, with specified @offset, @length, and @buffer, in @tps
+// return -1 if buffer is NULL, or reading out of bounds
+// return 0 if no error
+static int check_tps_access_error(TPS* tps, size_t offset, size_t length, char *buffer)
+{
+	if (!buffer) {
+		return -1;
+	}
+	// check if reading / writing out of bound
+	else if ((offset >= tps->size) || (length > tps->size - offset)) {
+		return -1;
+	}
+	return 0;
+}
+
+// HELPER FUNCTION: get the TPS with given tid from @index; the caller must hold the global lock
+// return the pointer to the TPS, or return NULL if not found
+static TPS* get_tps_with_tid(TPS_index* index, pthread_t tid)
+{
+	return index_find(index, tid);
+}
+
+// HELPER FUNCTION: get the TPS of the current thread, from current_tps or else from @index, without the global lock if possible
+// the cached pointer stays valid until tps_destroy(), since only the current thread can remove its TPS, and copy-on-write and clones only change the pages of a TPS
+// the lookup in @index is only repeated under the global lock if it missed, since it may have raced with an update
+// return the pointer to the TPS, or return NULL if not found
+static TPS* get_current_tps(TPS_index* index)
+{
+	if (current_tps) {
+		return current_tps;
+	}
+
+	pthread_t current_tid = pthread_self();
+	TPS* tps = index_find(index, current_tid);
+	if (!tps) {
+		lock_tps();
+		tps = get_tps_with_tid(index, current_tid);
+		unlock_tps();
+	}
+	current_tps = tps;
+	return tps;
+}
+
+// HELPER FUNCTION: check the @iovcnt segments of @iov against @tps, and find the pages they touch into @access
+// return -1 if a segment has a NULL buffer, or is out of bounds
+// return 0 if no error
+static int access_init_helper(TPS_access* access, TPS* tps, const struct tps_iovec* iov, int iovcnt)
+{
+	access->iov = iov;
+	access->iovcnt = iovcnt;
+	access->first = tps->page_count;
+	access->last = 0;
+	for (int j = 0; j < iovcnt; ++j) {
+		if (check_tps_access_error(tps, iov[j].offset, iov[j].length, iov[j].buffer) == -1) {
+			return -1;
+		}
+		if (iov[j].length == 0) {
+			continue;
+		}
+		size_t first = iov[j].offset / TPS_SIZE;
+		size_t last = (iov[j].offset + iov[j].length - 1) / TPS_SIZE;
+		if (first < access->first) {
+			access->first = first;
+		}
+		if (last > access->last) {
+			access->last = last;
+		}
+	}
+	return 0;
+}
+
+// HELPER FUNCTION: check if one of the segments of @access touches the page @i
+static bool access_touches_helper(const TPS_access* access, size_t i)
+{
+	// a single segment touches every page from first to last
+	if (access->iovcnt == 1) {
+		return true;
+	}
+	for (int j = 0; j < access->iovcnt; ++j) {
+		const struct tps_iovec* segment = &(access->iov[j]);
+		if ((segment->length > 0) && (segment->offset / TPS_SIZE <= i)
+			&& ((segment->offset + segment->length - 1) / TPS_SIZE >= i)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// HELPER FUNCTION: lock the current thread's @tps for an @access to its pages
+// if these pages are private and no copy-on-write fault is pending, only the lock of the TPS is taken: their ref_counter can then only grow in tps_clone(), which takes this lock too
+// otherwise the global lock is taken instead, which also keeps tps_clone() away
+// return true if the global lock was taken
+static bool access_lock_helper(TPS* tps, const TPS_access* access)
+{
+	pthread_mutex_lock(&(tps->lock));
+	bool private = !(pending_cow_fault.tps) && !(pending_cow_fault.spare_page);
+	for (size_t i = access->first; private && (i <= access->last); ++i) {
+		TPS_page* page = tps->pages[i];
+		private = (atomic_load_explicit(&(page->ref_counter), memory_order_acquire) == 1) && !(page->pending_writer);
+	}
+	if (private) {
+		return false;
+	}
+
+	pthread_mutex_unlock(&(tps->lock));
+	lock_tps();
+	return true;
+}
+
+// HELPER FUNCTION: release the lock taken by access_lock_helper() for the current thread's @tps
+static void access_unlock_helper(TPS* tps, bool global)
+{
+	if (global) {
+		unlock_tps();
+	}
+	else {
+		pthread_mutex_unlock(&(tps->lock));
+	}
+}
+
+// HELPER FUNCTION: close the pages of the current thread's @tps after an @access started by access_begin()
+static void access_end(TPS* tps, const TPS_access* access)
+{
+	// unless the TPS is mapped for writing, the copy-on-write fault prepared for this access is not expected anymore
+	if (!((tps->map_depth > 0) && (tps->map_prot & PROT_WRITE))) {
+		disarm_cow_fault_helper();
+	}
+	for (size_t i = access->first; i <= access->last; ++i) {
+		if (access_touches_helper(access, i)) {
+			page_protect(tps->pages[i], page_rest_prot(tps->pages[i]));
+		}
+	}
+}
+
+// HELPER FUNCTION: open the pages of the current thread's @tps touched by an @access for reading (@prot is PROT_READ) or writing (@prot is PROT_READ | PROT_WRITE)
+// before writing to a shared page, copy-on-write is performed, or prepared if it is left to the fault handler; each page is opened once, so it is copied at most once
+// return -1 on failure
+// return 0 if successful
+static int access_begin(TPS* tps, const TPS_access* access, int prot)
+{
+	for (size_t i = access->first; i <= access->last; ++i) {
+		if (!access_touches_helper(access, i)) {
+			continue;
+		}
+		if ((prot & PROT_WRITE) && (tps->pages[i]->ref_counter > 1) && (tps->pages[i]->pending_writer != tps)) {
+			if (make_private_helper(tps, i, /* keep_address = */false) == -1) {
+				access_end(tps, access);
+				return -1;
+			}
+		}
+
+		// a page expecting a copy-on-write fault stays read-only, so that the write faults
+		TPS_page* page = tps->pages[i];
+		int access_prot = page_rest_prot(page);
+		if (!(page->pending_writer)) {
+			access_prot |= prot;
+		}
+		if (page_protect(page, access_prot) == -1) {
+			access_end(tps, access);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// HELPER FUNCTION: copy @length bytes between @buffer and the current thread's @tps at @offset, in the direction given by @write
+// the pages are opened by the caller; an access may span several pages, whose mapped areas do not need to follow each other
+static void access_copy_helper(TPS* tps, size_t offset, size_t length, char* buffer, bool write)
+{
+	size_t done = 0;
+	while (done < length) {
+		size_t i = (offset + done) / TPS_SIZE;
+		size_t page_offset = (offset + done) % TPS_SIZE;
+		size_t chunk = TPS_SIZE - page_offset;
+		if (chunk > length - done) {
+			chunk = length - done;
+		}
+		// a write faulting to break copy-on-write keeps the same mapped area, so the address stays valid across the fault
+		char* area = (char*)(tps->pages[i]->mapped_area) + page_offset;
+		if (write) {
+			memcpy(area, buffer + done, chunk);
+		}
+		else {
+			memcpy(buffer + done, area, chunk);
+		}
+		done += chunk;
+	}
+}
+
+// HELPER FUNCTION: read (if @write is false) or write the @iovcnt segments of @iov from / to the current thread's TPS, with one lookup, one lock and one opening of each page touched
+// return -1 if no TPS of current thread, if a segment is invalid, or on failure
+// return 0 if successful
+static int access_helper(const struct tps_iovec* iov, int iovcnt, bool write)
+{
+	// find the TPS with the current tid to access
+	// return -1 if not found
+	TPS* tps = get_current_tps(&tps_index);
+	if ((!tps) || (iovcnt < 0) || ((!iov) && (iovcnt > 0))) {
+		return -1;
+	}
+
+	// every segment is checked before anything is accessed
+	TPS_access access;
+	if (access_init_helper(&access, tps, iov, iovcnt) == -1) {
+		return -1;
+	}
+	if (access.first > access.last) {
+		return 0;
+	}
+
+	// private pages are accessed under the lock of the TPS only; shared pages and copy-on-write need the global lock
+	bool global = access_lock_helper(tps, &access);
+
+	// temporarily disable the protection of the pages to access, after performing (or preparing) copy-on-write on the shared ones to write
+	if (access_begin(tps, &access, write ? (PROT_READ | PROT_WRITE) : PROT_READ) == -1) {
+		access_unlock_helper(tps, global);
+		return -1;
+	}
+
+	// copy between the buffers and the mapped areas
+	// the signal fences keep the compiler from moving accesses to pending_cow_fault across a write that may fault
+	atomic_signal_fence(memory_order_seq_cst);
+	size_t bytes = 0;
+	for (int j = 0; j < iovcnt; ++j) {
+		access_copy_helper(tps, iov[j].offset, iov[j].length, iov[j].buffer, write);
+		bytes += iov[j].length;
+	}
+	atomic_signal_fence(memory_order_seq_cst);
+	if (write) {
+		TPS_STAT_ADD(bytes_written, bytes);
+	}
+	else {
+		TPS_STAT_ADD(bytes_read, bytes);
+	}
+
+	// reenable protection
+	access_end(tps, &access);
+
+	access_unlock_helper(tps, global);
+	return 0;
+}
+
+// HELPER FUNCTION: perform @op on the word at @offset of the current thread's TPS, with @value as operand
+// the word is opened for writing like by tps_write(), so that a shared page goes through copy-on-write first
+// for TPS_ATOMIC_CAS, @old holds the expected word, and @value is only stored if the word matches it
+// @old receives the previous word, if not NULL
+// return -1 if no TPS of current thread, if @offset is not aligned to a word or out of bounds, or on failure
+// return 0 if successful, and 1 if the compare of TPS_ATOMIC_CAS failed
+static int atomic_helper(size_t offset, TPS_atomic_op op, uint64_t value, uint64_t* old)
+{
+	TPS* tps = get_current_tps(&tps_index);
+	uint64_t previous = 0;
+	struct tps_iovec segment = { offset, sizeof(uint64_t), (char*)&previous };
+	TPS_access access;
+	if ((!tps) || (offset % sizeof(uint64_t) != 0) || (access_init_helper(&access, tps, &segment, 1) == -1)) {
+		return -1;
+	}
+
+	bool global = access_lock_helper(tps, &access);
+	if (access_begin(tps, &access, PROT_READ | PROT_WRITE) == -1) {
+		access_unlock_helper(tps, global);
+		return -1;
+	}
+
+	// the word never spans pages, since it is aligned
+	// the signal fences keep the compiler from moving accesses to pending_cow_fault across a write that may fault
+	_Atomic uint64_t* word = (_Atomic uint64_t*)((char*)(tps->pages[offset / TPS_SIZE]->mapped_area) + offset % TPS_SIZE);
+	int ret = 0;
+	atomic_signal_fence(memory_order_seq_cst);
+	switch (op) {
+		case TPS_ATOMIC_FETCH_ADD:
+			previous = atomic_fetch_add(word, value);
+			break;
+		case TPS_ATOMIC_EXCHANGE:
+			previous = atomic_exchange(word, value);
+			break;
+		case TPS_ATOMIC_CAS:
+			previous = *old;
+			ret = atomic_compare_exchange_strong(word, &previous, value) ? 0 : 1;
+			break;
+	}
+	atomic_signal_fence(memory_order_seq_cst);
+
+	access_end(tps, &access);
+	access_unlock_helper(tps, global);
+
+	if (old) {
+		*old = previous;
+	}
+	return ret;
+}
+
+// HELPER FUNCTION: end one level of tps_map() session of the current thread's @tps; the pages are closed when the outermost session ends
+static void unmap_helper(TPS* tps)
+{
+	--(tps->map_depth);
+	if (tps->map_depth > 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < tps->page_count; ++i) {
+		TPS_page* page = tps->pages[i];
+		--(page->map_count);
+		if (tps->map_prot & PROT_WRITE) {
+			--(page->write_map_count);
+		}
+	}
+	tps->map_prot = 0;
+	disarm_cow_fault_helper();
+	for (size_t i = 0; i < tps->page_count; ++i) {
+		page_protect(tps->pages[i], page_rest_prot(tps->pages[i]));
+	}
+}
+
+// HELPER FUNCTION: drop the reference of a TPS to @page
+// the page and its mapped area are only freed when no other TPS refers to them anymore
+static void release_page_helper(TPS_page* page)
+{
+	assert(page->ref_counter > 0);
+	if (page->ref_counter == 1) {
+		page->ref_counter = 0;
+		free_page_helper(page);
+	}
+	else {
+		unshare_page_helper(page);
+	}
+}
+
+// HELPER FUNCTION: get the region mapping the file of @tps, if it is a persistent TPS
+// the owner of a persistent TPS never gives up the addresses of its pages, so its first page is enough to tell
+// return the pointer to the region, or return NULL if @tps is not persistent, or has no page yet
+static TPS_region* persistent_region_helper(TPS* tps)
+{
+	if (tps->page_count == 0) {
+		return NULL;
+	}
+	TPS_region* region = tps->pages[0] ? tps->pages[0]->region : NULL;
+	return (region && (region->owner == tps)) ? region : NULL;
+}
+
+// HELPER FUNCTION: replace the file mapped under @page by anonymous memory with the same content, at the same address
+// this is done for the pages a persistent TPS still shares when it is released, so that the other TPSes keep them without writing to the file
+// mremap() replaces the mapping at once, so that the threads mapping the page never see it missing
+// return -1 on failure
+// return 0 if successful
+static int detach_page_helper(TPS_page* page)
+{
+	void* copy_area = counted_mmap(TPS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+	if (copy_area == MAP_FAILED) {
+		return -1;
+	}
+
+	int prot = page->prot;
+	if (page_protect(page, prot | PROT_READ) == -1) {
+		counted_munmap(copy_area, TPS_SIZE);
+		return -1;
+	}
+	memcpy(copy_area, page->mapped_area, TPS_SIZE);
+	TPS_STAT_ADD(bytes_copied, TPS_SIZE);
+	page_protect(page, prot);
+
+	if ((counted_mprotect(copy_area, TPS_SIZE, prot) == -1)
+		|| (mremap(copy_area, TPS_SIZE, TPS_SIZE, MREMAP_MAYMOVE | MREMAP_FIXED, page->mapped_area) == MAP_FAILED)) {
+		counted_munmap(copy_area, TPS_SIZE);
+		return -1;
+	}
+	return 0;
+}
+
+// HELPER FUNCTION: release @tps, ending its tps_map() session if any, and drop its reference to each of its pages
+// the pages of a persistent TPS that other TPSes still share are detached from its file first
+static void release_tps_helper(TPS* tps)
+{
+	if (tps->map_depth > 0) {
+		tps->map_depth = 1;
+		unmap_helper(tps);
+	}
+
+	TPS_region* region = persistent_region_helper(tps);
+	if (region) {
+		for (size_t i = 0; i < tps->page_count; ++i) {
+			if (tps->pages[i]->ref_counter > 1) {
+				detach_page_helper(tps->pages[i]);
+			}
+		}
+		region->owner = NULL;
+	}
+
+	for (size_t i = 0; i < tps->page_count; ++i) {
+		if (tps->pages[i]) {
+			release_page_helper(tps->pages[i]);
+		}
+	}
+	if (tps->pages != &(tps->single_page)) {
+		free(tps->pages);
+	}
+	pthread_mutex_destroy(&(tps->lock));
+	slab_free(&tps_slab, tps);
+}
+
+// HELPER FUNCTION: move the pages of the current thread's @tps to a new region, so that their mapped areas follow each other again
+// copy-on-write may have moved some of them to pages of their own; the TPS ends up with private copies of all its pages
+// return -1 if failed to create the region, or to copy a page
+// return 0 if successful
+static int relocate_helper(TPS* tps)
+{
+	// a copy-on-write fault prepared for one of the pages is not needed anymore, since all the pages become private
+	disarm_cow_fault_helper();
+
+	TPS_page** new_pages = (TPS_page**)calloc(tps->page_count, sizeof(TPS_page*));
+	if (!new_pages) {
+		return -1;
+	}
+	if (init_new_region_helper(new_pages, tps->page_count) == -1) {
+		free(new_pages);
+		return -1;
+	}
+
+	int ret = 0;
+	for (size_t i = 0; (i < tps->page_count) && (ret == 0); ++i) {
+		ret = copy_page_helper(new_pages[i], tps->pages[i]);
+	}
+	for (size_t i = 0; i < tps->page_count; ++i) {
+		TPS_page* old_page = (ret == 0) ? tps->pages[i] : new_pages[i];
+		if (ret == 0) {
+			tps->pages[i] = new_pages[i];
+		}
+		release_page_helper(old_page);
+	}
+
+	free(new_pages);
+	return ret;
+}
+
+// HELPER FUNCTION: check if the mapped areas of the pages of @tps follow each other
+static bool contiguous_helper(TPS* tps)
+{
+	char* base = (char*)(tps->pages[0]->mapped_area);
+	for (size_t i = 1; i < tps->page_count; ++i) {
+		if (tps->pages[i]->mapped_area != (void*)(base + i * TPS_SIZE)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* deduplication */
+
+// HELPER FUNCTION: hash the content of the mapped @area of a page, which must be readable
+// the page is read 16 bytes at a time into two accumulators (with SSE2 when available), which are mixed at the end
+static uint64_t hash_page_helper(const void* area)
+{
+	const uint64_t key_lo = 0x9e3779b97f4a7c15ULL;
+	const uint64_t key_hi = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t acc[2];
+
+#ifdef __SSE2__
+	const __m128i* blocks = (const __m128i*)area;
+	__m128i key = _mm_set_epi64x((long long)key_hi, (long long)key_lo);
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	for (size_t j = 0; j < TPS_SIZE / sizeof(__m128i); j += 2) {
+		// each 64-bit lane adds the product of the low and high halves of the keyed data, plus the data itself
+		__m128i data0 = _mm_load_si128(blocks + j);
+		__m128i data1 = _mm_load_si128(blocks + j + 1);
+		__m128i keyed0 = _mm_xor_si128(data0, key);
+		__m128i keyed1 = _mm_xor_si128(data1, key);
+		acc0 = _mm_add_epi64(acc0, _mm_mul_epu32(keyed0, _mm_shuffle_epi32(keyed0, _MM_SHUFFLE(2, 3, 0, 1))));
+		acc1 = _mm_add_epi64(acc1, _mm_mul_epu32(keyed1, _mm_shuffle_epi32(keyed1, _MM_SHUFFLE(2, 3, 0, 1))));
+		acc0 = _mm_add_epi64(acc0, _mm_shuffle_epi32(data0, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc1 = _mm_add_epi64(acc1, _mm_shuffle_epi32(data1, _MM_SHUFFLE(1, 0, 3, 2)));
+		// keep the position of the blocks in the hash
+		acc0 = _mm_xor_si128(acc0, _mm_srli_epi64(acc0, 29));
+		acc1 = _mm_xor_si128(acc1, _mm_slli_epi64(acc1, 17));
+	}
+	uint64_t lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, acc0);
+	_mm_storeu_si128((__m128i*)(lanes + 2), acc1);
+	acc[0] = lanes[0] ^ lanes[2];
+	acc[1] = lanes[1] ^ lanes[3];
+#else
+	const uint64_t* words = (const uint64_t*)area;
+	acc[0] = 0;
+	acc[1] = 0;
+	for (size_t j = 0; j < TPS_SIZE / sizeof(uint64_t); j += 2) {
+		uint64_t keyed0 = words[j] ^ key_lo;
+		uint64_t keyed1 = words[j + 1] ^ key_hi;
+		acc[0] += (keyed0 & 0xffffffffULL) * (keyed0 >> 32) + words[j + 1];
+		acc[1] += (keyed1 & 0xffffffffULL) * (keyed1 >> 32) + words[j];
+		acc[0] ^= acc[0] >> 29;
+		acc[1] ^= acc[1] << 17;
+	}
+#endif
+
+	uint64_t x = acc[0] ^ (acc[1] * key_lo);
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// HELPER FUNCTION: check if @page of @tps may be folded into an identical page, or kept for its content
+// pages that are mapped with tps_map(), that expect a copy-on-write fault, or that map the file of a persistent TPS, are left alone
+static bool dedup_eligible_helper(TPS* tps, TPS_page* page)
+{
+	return (tps->map_depth == 0) && (page->map_count == 0) && !(page->pending_writer)
+		&& !(page->region && page->region->owner);
+}
+
+// HELPER FUNCTION: look up the content of @page, whose hash is @hash, in @table of @capacity entries (a power of 2)
+// @page is compared with the pages of the same hash; memcmp() is vectorized by the C library
+// return the entry of the identical page, or the free entry where @page should be kept if none is identical
+// the pages must be readable
+static TPS_dedup_entry* dedup_find_helper(TPS_dedup_entry* table, size_t capacity, TPS_page* page, uint64_t hash)
+{
+	for (size_t j = hash & (capacity - 1); ; j = (j + 1) & (capacity - 1)) {
+		TPS_dedup_entry* entry = &(table[j]);
+		if ((!(entry->page)) || (entry->page == page)) {
+			return entry;
+		}
+		if ((entry->hash == hash) && !memcmp(entry->page->mapped_area, page->mapped_area, TPS_SIZE)) {
+			return entry;
+		}
+	}
+}
+
+// HELPER FUNCTION: fold the page @i of @tps into the identical page found in @table, or keep it in @table for its content
+// the page is opened for reading; it stays open if it is kept in @table, since the next pages are compared with it
+// the caller holds the global lock and the locks of all the TPSes
+static void dedup_page_helper(TPS_dedup_entry* table, size_t capacity, TPS* tps, size_t i, struct tps_dedup_stats* stats)
+{
+	TPS_page* page = tps->pages[i];
+	if (!dedup_eligible_helper(tps, page) || (page_protect(page, page->prot | PROT_READ) == -1)) {
+		return;
+	}
+	uint64_t hash = hash_page_helper(page->mapped_area);
+	++(stats->pages_scanned);
+
+	TPS_dedup_entry* entry = dedup_find_helper(table, capacity, page, hash);
+	if (!(entry->page)) {
+		entry->hash = hash;
+		entry->page = page;
+		return;
+	}
+	if (entry->page == page) {
+		return;
+	}
+
+	// the page is closed when its reference is dropped
+
+	// the TPS shares the identical page from now on, and writing to it goes through copy-on-write
+	++(stats->pages_merged);
+	if (page->ref_counter == 1) {
+		stats->bytes_saved += TPS_SIZE;
+	}
+	// the identical page stays open until the end of the pass, which sets its protection for its new ref_counter
+	++(entry->page->ref_counter);
+	release_page_helper(page);
+	tps->pages[i] = entry->page;
+}
+
+/* API functions */
+
+// initialize TPS
+// @segv: activate segfault handler if @segv != 0; the handler will recognize TPS protection errors and display "TPS protection error" on stderr
+// return -1 if TPS API already initialized, or on failure in initialization
+// return 0 if successfully initialized
+int tps_init(int segv)
+{
+	struct tps_config config = {
+		.segv = segv,
+		.cow_mode = TPS_COW_COPY,
+	};
+	return tps_init_config(&config);
+}
+
+// initialize TPS with the options given in @config
+// with TPS_COW_FAULT, the segfault handler is always installed since it performs copy-on-write; @config->segv only enables the error message
+// return -1 if @config is NULL, if TPS API already initialized, or on failure in initialization
+// return 0 if successfully initialized
+int tps_init_config(const struct tps_config *config)
+{
+	if ((!config) || tps_initialized) {
+		return -1;
+	}
+
+	tps_initialized = true;
+	tps_config = *config;
+
+	page_pool.high = (config->pool_high > 0) ? config->pool_high : TPS_POOL_DEFAULT_HIGH;
+	page_pool.low = (config->pool_low < page_pool.high) ? config->pool_low : page_pool.high - 1;
+	page_pool.prefault = (config->pool_prefault != 0);
+	// without userfaultfd, the kernel fills the TPS memory as usual
+	if (config->uffd) {
+		uffd_start_helper();
+	}
+	if ((config->arena_slots > 0) && (arena_reserve(config->arena_slots, config->arena_huge != 0) == -1)) {
+		return -1;
+	}
+	if ((page_pool.low > 0) && (page_pool_refill(page_pool.high) == -1)) {
+		return -1;
+	}
+
+	// provided snippet from professor Porquet
+	if ((config->segv) || (config->cow_mode == TPS_COW_FAULT)) {
+		struct sigaction sa;
+
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_SIGINFO;
+		sa.sa_sigaction = segv_handler;
+		sigaction(SIGBUS, &sa, NULL);
+		sigaction(SIGSEGV, &sa, NULL);
+	}
+	// end of provided snippet
+
+	return 0;
+}
+
+// create a TPS of TPS_SIZE bytes, and associate it to the current thread; the TPS is initialized to all zeros
+// return -1 if current thread already has a TPS, or on failure in creation
+// return 0 if successful
+int tps_create(void)
+{
+	return tps_create_sized(TPS_SIZE);
+}
+
+// create a TPS of @size bytes, and associate it to the current thread; the TPS is initialized to all zeros
+// a TPS of a single page takes it from the page pool, a larger one gets a region of its own
+// return -1 if @size is 0, if @size does not fit in whole pages, if current thread already has a TPS, or on failure in creation
+// return 0 if successful
+int tps_create_sized(size_t size)
+{
+	// rounding @size up to whole pages must not wrap around, which would leave the TPS without pages
+	if ((size == 0) || (size > SIZE_MAX - TPS_SIZE + 1)) {
+		return -1;
+	}
+
+	lock_tps();
+
+	pthread_t current_tid = pthread_self();
+
+	// first check if current thread already has a TPS
+	TPS* current_thread_tps = get_tps_with_tid(&tps_index, current_tid);
+	if (current_thread_tps) {
+		unlock_tps();
+		return -1;
+	}
+
+	// create the new TPS, and initialize its tid and size
+	TPS* new_tps = init_new_tps_helper(current_tid, size);
+	if (!new_tps) {
+		unlock_tps();
+		return -1;
+	}
+
+	// take cleared pages, and then check if allocation is successful
+	int ret = 0;
+	if (new_tps->page_count == 1) {
+		new_tps->pages[0] = init_new_page_helper(/* zero = */true);
+		ret = new_tps->pages[0] ? 0 : -1;
+	}
+	else {
+		ret = init_new_region_helper(new_tps->pages, new_tps->page_count);
+	}
+	if (ret == -1) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+	for (size_t i = 0; i < new_tps->page_count; ++i) {
+		page_protect(new_tps->pages[i], page_rest_prot(new_tps->pages[i]));
+	}
+
+	// insert new_tps into tps_index, and cache it for the accesses of the current thread
+	if (index_insert(&tps_index, new_tps) == -1) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+	current_tps = new_tps;
+	TPS_STAT_ADD(creates, 1);
+
+	unlock_tps();
+	return 0;
+}
+
+// HELPER FUNCTION: open the file at @path for a persistent TPS, lock it, and make it at least @length bytes long; the new bytes are zeroed
+// return -1 if failed to open, lock or extend the file; in particular, if another persistent TPS uses it
+// return the file descriptor if successful
+static int persistent_open_helper(const char* path, size_t length)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat st;
+	if ((flock(fd, LOCK_EX | LOCK_NB) == -1) || (fstat(fd, &st) == -1)
+		|| (((size_t)st.st_size < length) && (ftruncate(fd, (off_t)length) == -1))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// create a TPS of @size bytes for the current thread, whose pages map the file at @path instead of anonymous memory
+// the file is created if needed; otherwise the TPS starts with its content, e.g. as left by a previous run
+// the pages are protected like the pages of any TPS, and clones share them with copy-on-write; only the writes of the owner reach the file
+// return -1 if current thread already has a TPS, if @path is NULL, if @size is 0 or does not fit in whole pages, if the file cannot be opened, or is used by another persistent TPS, or on failure
+// return 0 if successful
+int tps_create_persistent(const char *path, size_t size)
+{
+	if ((!path) || (size == 0) || (size > SIZE_MAX - TPS_SIZE + 1)) {
+		return -1;
+	}
+
+	lock_tps();
+
+	pthread_t current_tid = pthread_self();
+	if (get_tps_with_tid(&tps_index, current_tid)) {
+		unlock_tps();
+		return -1;
+	}
+
+	TPS* new_tps = init_new_tps_helper(current_tid, size);
+	if (!new_tps) {
+		unlock_tps();
+		return -1;
+	}
+	size_t length = new_tps->page_count * TPS_SIZE;
+	int fd = persistent_open_helper(path, length);
+	if (fd == -1) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+
+	// map the file over the pages of a new region, which are still inaccessible; the region then owns the file
+	if (init_new_region_helper(new_tps->pages, new_tps->page_count) == -1) {
+		close(fd);
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+	TPS_region* region = new_tps->pages[0]->region;
+	region->fd = fd;
+	if (counted_mmap_file(new_tps->pages[0]->mapped_area, length, fd) == MAP_FAILED) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+	region->owner = new_tps;
+	for (size_t i = 0; i < new_tps->page_count; ++i) {
+		new_tps->pages[i]->dirty = true;
+		page_protect(new_tps->pages[i], page_rest_prot(new_tps->pages[i]));
+	}
+
+	// insert new_tps into tps_index, and cache it for the accesses of the current thread
+	if (index_insert(&tps_index, new_tps) == -1) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+	current_tps = new_tps;
+	TPS_STAT_ADD(creates, 1);
+
+	unlock_tps();
+	return 0;
+}
+
+// write the pages of the current thread's persistent TPS that were modified back to its file, and wait for the writes to complete
+// only the owner of the TPS releases it, so its region stays mapped during the call, without the global lock
+// return -1 if no TPS of current thread, if it is not persistent, or if msync() failed
+// return 0 if successful
+int tps_sync(void)
+{
+	TPS* tps = get_current_tps(&tps_index);
+	TPS_region* region = tps ? persistent_region_helper(tps) : NULL;
+	if (!region) {
+		return -1;
+	}
+	return msync(tps->pages[0]->mapped_area, tps->page_count * TPS_SIZE, MS_SYNC);
+}
+
+// destroy the TPS associated to current thread, ending its tps_map() session if any
+// return -1 if no TPS of current thread
+// return 0 if successful
+int tps_destroy(void)
+{
+	lock_tps();
+
+	// find the TPS to be destroyed
+	// if not found, return -1
+	TPS* tps_to_destroy = get_current_tps(&tps_index);
+	if (!tps_to_destroy) {
+		unlock_tps();
+		return -1;
+	}
+
+	// remove the TPS from tps_index, and then drop its reference to each page
+	// a page itself is only freed if no other thread refers to its mapped_area (i.e. it is not borrowed by a clone)
+	index_remove(&tps_index, tps_to_destroy);
+	release_tps_helper(tps_to_destroy);
+	current_tps = NULL;
+	TPS_STAT_ADD(destroys, 1);
+
+	unlock_tps();
+	return 0;
+}
+
+// read from current thread's TPS, from an @offset by a given @length, and receive the data from @buffer
+// the read may span several pages
+// return -1 if no TPS of current thread, if reading out of bound, if @buffer is NULL, or on failure
+// return 0 if successful
+int tps_read(size_t offset, size_t length, char *buffer)
+{
+	struct tps_iovec segment = { offset, length, buffer };
+	return access_helper(&segment, 1, /* write = */false);
+}
+
+// write to current thread's TPS, at an @offset by a given @length from @buffer
+// if the write touches a memory page shared with another thread's TPS, trigger a copy-and-write operation on this page only before actually writing
+// with TPS_COW_FAULT, the copy-and-write operation is triggered by the write itself, from the fault handler
+// return -1 if no TPS of current thread, if writing out of bound, or if @buffer is NULL, or on failure
+// return 0 if successfully written to
+int tps_write(size_t offset, size_t length, char *buffer)
+{
+	struct tps_iovec segment = { offset, length, buffer };
+	return access_helper(&segment, 1, /* write = */true);
+}
+
+// read the @iovcnt segments of @iov from current thread's TPS, opening each page touched only once
+// return -1 if no TPS of current thread, if a segment is out of bound or has a NULL buffer (nothing is read then), or on failure
+// return 0 if successful
+int tps_readv(const struct tps_iovec *iov, int iovcnt)
+{
+	return access_helper(iov, iovcnt, /* write = */false);
+}
+
+// write the @iovcnt segments of @iov to current thread's TPS, in order, opening each page touched only once
+// a shared page touched by several segments goes through copy-on-write only once
+// return -1 if no TPS of current thread, if a segment is out of bound or has a NULL buffer (nothing is written then), or on failure
+// return 0 if successful
+int tps_writev(const struct tps_iovec *iov, int iovcnt)
+{
+	return access_helper(iov, iovcnt, /* write = */true);
+}
+
+// add @value to the word at @offset of current thread's TPS, atomically, and store the previous word in @old if not NULL
+// return -1 if no TPS of current thread, if @offset is not aligned to a word or out of bound, or on failure
+// return 0 if successful
+int tps_fetch_add(size_t offset, uint64_t value, uint64_t *old)
+{
+	return atomic_helper(offset, TPS_ATOMIC_FETCH_ADD, value, old);
+}
+
+// replace the word at @offset of current thread's TPS with @value, atomically, and store the previous word in @old if not NULL
+// return -1 if no TPS of current thread, if @offset is not aligned to a word or out of bound, or on failure
+// return 0 if successful
+int tps_exchange(size_t offset, uint64_t value, uint64_t *old)
+{
+	return atomic_helper(offset, TPS_ATOMIC_EXCHANGE, value, old);
+}
+
+// replace the word at @offset of current thread's TPS with @desired if it is *@expected, atomically; otherwise store the word in @expected
+// return -1 if no TPS of current thread, if @expected is NULL, if @offset is not aligned to a word or out of bound, or on failure
+// return 0 if the word was replaced, 1 if not
+int tps_cas(size_t offset, uint64_t *expected, uint64_t desired)
+{
+	if (!expected) {
+		return -1;
+	}
+	return atomic_helper(offset, TPS_ATOMIC_CAS, desired, expected);
+}
+
+// reserve a slot of @size bytes, aligned and padded to @align, after the slots of the previous keys
+// return -1 if @size is 0, if @align is not a power of 2, if the slot does not fit in TPS_SIZE bytes, or if there are already TPS_KEYS_MAX keys
+// return the new key if successful
+tps_key_t tps_key_create(size_t size, size_t align)
+{
+	if ((size == 0) || (size > TPS_SIZE) || (align == 0) || (align & (align - 1)) || (align > TPS_SIZE)) {
+		return -1;
+	}
+
+	lock_tps();
+
+	int key = atomic_load_explicit(&tps_key_count, memory_order_relaxed);
+	size_t offset = (tps_key_end + align - 1) & ~(align - 1);
+	size_t end = offset + ((size + align - 1) & ~(align - 1));
+	if ((key == TPS_KEYS_MAX) || (end > TPS_SIZE)) {
+		unlock_tps();
+		return -1;
+	}
+	tps_keys[key].offset = offset;
+	tps_keys[key].size = size;
+	tps_key_end = end;
+
+	// publish the slot
+	atomic_store_explicit(&tps_key_count, key + 1, memory_order_release);
+
+	unlock_tps();
+	return key;
+}
+
+// HELPER FUNCTION: copy the slot of @key between @buffer and the first page of the current thread's @tps, in the direction given by @write
+// the page is opened by the caller
+static void key_copy_helper(TPS* tps, const TPS_key* slot, void* buffer, bool write)
+{
+	char* slot_area = (char*)(tps->pages[0]->mapped_area) + slot->offset;
+	if (write) {
+		memcpy(slot_area, buffer, slot->size);
+		TPS_STAT_ADD(bytes_written, slot->size);
+	}
+	else {
+		memcpy(buffer, slot_area, slot->size);
+		TPS_STAT_ADD(bytes_read, slot->size);
+	}
+}
+
+// HELPER FUNCTION: read or write (if @write) the slot of @key of the current thread's TPS from/to @buffer
+// while the TPS is mapped with tps_map() with the protection needed, the slot is accessed directly, without opening and closing its pages
+// otherwise, if the first page, which holds every slot, is private, it is opened and closed around the copy under the lock of the TPS only, without going through access_helper()
+// return -1 if no TPS of current thread, if @key was not created, if the slot is out of bounds, if @buffer is NULL, or on failure
+// return 0 if successful
+static int key_access_helper(tps_key_t key, void* buffer, bool write)
+{
+	if ((key < 0) || (key >= atomic_load_explicit(&tps_key_count, memory_order_acquire)) || (!buffer)) {
+		return -1;
+	}
+	const TPS_key* slot = &(tps_keys[key]);
+	TPS* tps = get_current_tps(&tps_index);
+	if ((!tps) || (slot->offset + slot->size > tps->size)) {
+		return -1;
+	}
+
+	// only the current thread maps its TPS, and a mapped TPS is contiguous and keeps its addresses
+	int prot = write ? (PROT_READ | PROT_WRITE) : PROT_READ;
+	if ((tps->map_depth > 0) && ((tps->map_prot & prot) == prot)) {
+		key_copy_helper(tps, slot, buffer, write);
+		return 0;
+	}
+
+	// same check as access_lock_helper(): a private page with no copy-on-write fault pending cannot fault, nor be shared while the lock of the TPS is held
+	pthread_mutex_lock(&(tps->lock));
+	TPS_page* page = tps->pages[0];
+	if (!(pending_cow_fault.tps) && !(pending_cow_fault.spare_page)
+			&& (atomic_load_explicit(&(page->ref_counter), memory_order_acquire) == 1) && !(page->pending_writer)) {
+		if (page_protect(page, page_rest_prot(page) | prot) == -1) {
+			pthread_mutex_unlock(&(tps->lock));
+			return -1;
+		}
+		key_copy_helper(tps, slot, buffer, write);
+		page_protect(page, page_rest_prot(page));
+		pthread_mutex_unlock(&(tps->lock));
+		return 0;
+	}
+	pthread_mutex_unlock(&(tps->lock));
+
+	struct tps_iovec iov = { slot->offset, slot->size, (char*)buffer };
+	return access_helper(&iov, 1, write);
+}
+
+// read the slot of @key of the current thread's TPS into @buffer
+// return -1 if no TPS of current thread, if @key was not created, if the slot is out of bounds, if @buffer is NULL, or on failure
+// return 0 if successful
+int tps_get(tps_key_t key, void *buffer)
+{
+	return key_access_helper(key, buffer, /* write = */false);
+}
+
+// write @buffer to the slot of @key of the current thread's TPS
+// return -1 if no TPS of current thread, if @key was not created, if the slot is out of bounds, if @buffer is NULL, or on failure
+// return 0 if successful
+int tps_set(tps_key_t key, const void *buffer)
+{
+	return key_access_helper(key, (void*)buffer, /* write = */true);
+}
+
+// HELPER FUNCTION: grow the current thread's @tps to @size bytes, with new zeroed pages, which are protected like the others
+// the caller holds the global lock and the lock of @tps
+// return -1 if failed to create the pages; the TPS is left unchanged
+// return 0 if successful
+static int grow_helper(TPS* tps, size_t size)
+{
+	size_t page_count = (size + TPS_SIZE - 1) / TPS_SIZE;
+	if (page_count == tps->page_count) {
+		tps->size = size;
+		return 0;
+	}
+
+	TPS_page** pages = (TPS_page**)calloc(page_count, sizeof(TPS_page*));
+	if (!pages) {
+		return -1;
+	}
+	memcpy(pages, tps->pages, tps->page_count * sizeof(TPS_page*));
+	for (size_t i = tps->page_count; i < page_count; ++i) {
+		pages[i] = init_new_page_helper(/* zero = */true);
+		if (!pages[i]) {
+			for (size_t j = tps->page_count; j < i; ++j) {
+				free_page_helper(pages[j]);
+			}
+			free(pages);
+			return -1;
+		}
+		page_protect(pages[i], page_rest_prot(pages[i]));
+	}
+
+	if (tps->pages != &(tps->single_page)) {
+		free(tps->pages);
+	}
+	tps->pages = pages;
+	tps->page_count = page_count;
+	tps->size = size;
+	return 0;
+}
+
+// allocate @size bytes from the arena of the current thread's TPS, which follows the area requested at creation, and give their offset in @offset
+// the arena grows by new pages, at least doubling the number of pages, so that growing is amortized
+// a persistent TPS does not grow, since the new pages would not be in its file
+// return -1 if no TPS of current thread, if @size is 0, if @offset is NULL, or if the TPS has to grow while it is mapped with tps_map() or is persistent, or on failure
+// return 0 if successful
+int tps_alloc(size_t size, size_t *offset)
+{
+	if ((size == 0) || (!offset)) {
+		return -1;
+	}
+	TPS* tps = get_current_tps(&tps_index);
+	if (!tps) {
+		return -1;
+	}
+
+	// the object usually fits in the pages of the TPS, and only takes a bump of alloc_top
+	// only the owner changes the size of its TPS, and a concurrent clone reads alloc_top either before or after the bump
+	size_t start = atomic_load_explicit(&(tps->alloc_top), memory_order_relaxed);
+	if ((size <= tps->size) && (start <= tps->size - size)) {
+		atomic_store_explicit(&(tps->alloc_top), (start + size + TPS_ALLOC_ALIGN - 1) & ~((size_t)TPS_ALLOC_ALIGN - 1), memory_order_relaxed);
+		*offset = start;
+		return 0;
+	}
+
+	// otherwise, the TPS grows under the global lock, which comes first
+	lock_tps();
+	pthread_mutex_lock(&(tps->lock));
+	int ret = -1;
+	if ((tps->map_depth == 0) && !persistent_region_helper(tps) && (size <= SIZE_MAX / 2 - start)) {
+		size_t size_needed = start + size;
+		size_t size_doubled = 2 * tps->page_count * TPS_SIZE;
+		ret = grow_helper(tps, (size_needed > size_doubled) ? size_needed : size_doubled);
+	}
+	if (ret == 0) {
+		atomic_store_explicit(&(tps->alloc_top), (start + size + TPS_ALLOC_ALIGN - 1) & ~((size_t)TPS_ALLOC_ALIGN - 1), memory_order_relaxed);
+		*offset = start;
+	}
+	pthread_mutex_unlock(&(tps->lock));
+	unlock_tps();
+	return ret;
+}
+
+// free all the objects allocated with tps_alloc() in the current thread's TPS at once
+// the pages of the arena are kept for the next allocations, and are only freed by tps_destroy()
+// return -1 if no TPS of current thread
+// return 0 if successful
+int tps_reset(void)
+{
+	TPS* tps = get_current_tps(&tps_index);
+	if (!tps) {
+		return -1;
+	}
+
+	atomic_store_explicit(&(tps->alloc_top), tps->alloc_base, memory_order_relaxed);
+	return 0;
+}
+
+// clone the TPS of @tid, with the same size
+// first phase: copy the TPS's content directly
+// last phase: do NOT copy content, but refer to the same memory pages
+// pages mapped for writing with tps_map() are copied right away, since their owner may modify them at any time
+// return -1 if @tid does not have TPS, if current thread has TPS, or on failure
+// return 0 if successfully cloned
+int tps_clone(pthread_t tid)
+{
+	lock_tps();
+
+	pthread_t current_tid = pthread_self();
+
+	// check if the passed tid does not have a TPS, or if the current thread already has a TPS
+	// if it is either case, return -1
+	TPS* tps_with_passed_tid = get_tps_with_tid(&tps_index, tid);
+	TPS* tps_with_current_tid = get_tps_with_tid(&tps_index, current_tid);
+	if ((!tps_with_passed_tid) || tps_with_current_tid) {
+		unlock_tps();
+		return -1;
+	}
+
+	// create the new TPS for the current thread
+	// borrow the the passed TID's TPS pages to let the new TPS use them, until the new TPS wants to write to one of them (copy-on-writing)
+	// the lock of the cloned TPS keeps its owner from accessing its private pages while they become shared
+	TPS* tps_to_clone = tps_with_passed_tid;
+	TPS* new_tps = init_new_tps_helper(current_tid, tps_to_clone->size);
+	if (!new_tps) {
+		unlock_tps();
+		return -1;
+	}
+	pthread_mutex_lock(&(tps_to_clone->lock));
+	int ret = share_pages_helper(new_tps, tps_to_clone);
+	pthread_mutex_unlock(&(tps_to_clone->lock));
+	if (ret == -1) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+
+	// insert new_tps into tps_index, and cache it for the accesses of the current thread
+	if (index_insert(&tps_index, new_tps) == -1) {
+		release_tps_helper(new_tps);
+		unlock_tps();
+		return -1;
+	}
+	current_tps = new_tps;
+	TPS_STAT_ADD(clones, 1);
+
+	unlock_tps();
+	return 0;
+}
+
+// HELPER FUNCTION: compare two thread IDs, for qsort()
+static int compare_tid_helper(const void* a, const void* b)
+{
+	pthread_t tid_a = *(const pthread_t*)a;
+	pthread_t tid_b = *(const pthread_t*)b;
+	return (tid_a > tid_b) - (tid_a < tid_b);
+}
+
+// HELPER FUNCTION: check that the @count threads of @tids are all different, and do not have a TPS in @index yet
+// return -1 if a thread is given twice, if a thread already has a TPS, or if failed to allocate
+// return 0 if successful
+static int check_new_tids_helper(TPS_index* index, const pthread_t* tids, size_t count)
+{
+	pthread_t* sorted = (pthread_t*)malloc(count * sizeof(pthread_t));
+	if (!sorted) {
+		return -1;
+	}
+	memcpy(sorted, tids, count * sizeof(pthread_t));
+	qsort(sorted, count, sizeof(pthread_t), compare_tid_helper);
+
+	int ret = 0;
+	for (size_t j = 0; (ret == 0) && (j < count); ++j) {
+		if (((j > 0) && (sorted[j] == sorted[j - 1])) || get_tps_with_tid(index, sorted[j])) {
+			ret = -1;
+		}
+	}
+	free(sorted);
+	return ret;
+}
+
+// clone the TPS of @tid for each of the @count threads of @tids at once, before they even run
+// the pages are shared the same way as by tps_clone(), with a single update of the reference count of each page, and of tps_index
+// a page mapped for writing with tps_map() is copied once, and the copy is shared by all the clones
+// return -1 if @tid does not have TPS, if @tids is NULL, if one of @tids is given twice or already has a TPS, or on failure; no TPS is created then
+// return 0 if successfully cloned
+int tps_clone_many(pthread_t tid, const pthread_t *tids, size_t count)
+{
+	if ((!tids) && (count > 0)) {
+		return -1;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	lock_tps();
+
+	TPS* tps_to_clone = get_tps_with_tid(&tps_index, tid);
+	if ((!tps_to_clone) || (check_new_tids_helper(&tps_index, tids, count) == -1)
+		|| (index_reserve(&tps_index, count) == -1)) {
+		unlock_tps();
+		return -1;
+	}
+
+	// create all the TPSes first, so that nothing is shared if one of them cannot be created
+	TPS** new_tpses = (TPS**)calloc(count, sizeof(TPS*));
+	int ret = new_tpses ? 0 : -1;
+	for (size_t j = 0; (ret == 0) && (j < count); ++j) {
+		new_tpses[j] = init_new_tps_helper(tids[j], tps_to_clone->size);
+		ret = new_tpses[j] ? 0 : -1;
+		if (ret == 0) {
+			new_tpses[j]->alloc_base = tps_to_clone->alloc_base;
+			new_tpses[j]->alloc_top = tps_to_clone->alloc_top;
+		}
+	}
+
+	// then give each page its references from all the clones at once
+	pthread_mutex_lock(&(tps_to_clone->lock));
+	for (size_t i = 0; (ret == 0) && (i < tps_to_clone->page_count); ++i) {
+		TPS_page* page = tps_to_clone->pages[i];
+		if (page->write_map_count > 0) {
+			page = init_page_copy_helper(page);
+			if (!page) {
+				ret = -1;
+				break;
+			}
+			share_page_helper(page, count - 1);
+		}
+		else {
+			share_page_helper(page, count);
+		}
+		for (size_t j = 0; j < count; ++j) {
+			new_tpses[j]->pages[i] = page;
+		}
+	}
+	pthread_mutex_unlock(&(tps_to_clone->lock));
+
+	if (ret == -1) {
+		for (size_t j = 0; new_tpses && (j < count) && new_tpses[j]; ++j) {
+			release_tps_helper(new_tpses[j]);
+		}
+		free(new_tpses);
+		unlock_tps();
+		return -1;
+	}
+
+	// the index was grown beforehand, so inserting cannot fail
+	for (size_t j = 0; j < count; ++j) {
+		index_insert(&tps_index, new_tpses[j]);
+	}
+	free(new_tpses);
+	TPS_STAT_ADD(clones, count);
+
+	unlock_tps();
+	return 0;
+}
+
+// give the TPS of the current thread to thread @to, which must not have a TPS; the current thread is left without TPS
+// the pages are neither copied nor shared again: the TPS only moves to the entry of @to in tps_index
+// return -1 if no TPS of current thread, if @to already has a TPS, or if the TPS is mapped with tps_map()
+// return 0 if successful
+int tps_transfer(pthread_t to)
+{
+	lock_tps();
+
+	// the addresses of a mapped TPS are used by the current thread, which may also expect a copy-on-write fault on it
+	TPS* tps = get_current_tps(&tps_index);
+	if ((!tps) || (tps->map_depth > 0) || get_tps_with_tid(&tps_index, to)) {
+		unlock_tps();
+		return -1;
+	}
+
+	// the receiver may already look its TPS up, and then waits for the lock of the TPS
+	// the TPS was just removed from tps_index, so inserting it back cannot grow the table, and cannot fail
+	pthread_mutex_lock(&(tps->lock));
+	index_remove(&tps_index, tps);
+	tps->tid = to;
+	index_insert(&tps_index, tps);
+	pthread_mutex_unlock(&(tps->lock));
+	current_tps = NULL;
+
+	unlock_tps();
+	return 0;
+}
+
+// map the current thread's TPS for direct access with @prot, until the matching call to tps_unmap()
+// mapping shared pages for writing performs (or, with TPS_COW_FAULT, prepares) copy-on-write first, keeping the addresses if already mapped
+// if copy-on-write left the pages of a larger TPS apart, they are first moved to a new region, so that the TPS is contiguous
+// return NULL if no TPS of current thread, if @prot is invalid, or on failure
+// return the address of the TPS if successful
+void *tps_map(int prot)
+{
+	if ((!prot) || (prot & ~(TPS_MAP_READ | TPS_MAP_WRITE))) {
+		return NULL;
+	}
+
+	lock_tps();
+
+	TPS* tps_to_map = get_current_tps(&tps_index);
+	if (!tps_to_map) {
+		unlock_tps();
+		return NULL;
+	}
+
+	// mapping for writing for the first time: shared pages have to become private first
+	// the addresses of the pages of a larger TPS are kept when possible, so that it stays contiguous
+	int map_prot = (prot & TPS_MAP_WRITE) ? (PROT_READ | PROT_WRITE) : PROT_READ;
+	bool upgrade = (map_prot & PROT_WRITE)
+		&& !((tps_to_map->map_depth > 0) && (tps_to_map->map_prot & PROT_WRITE));
+	for (size_t i = 0; upgrade && (i < tps_to_map->page_count); ++i) {
+		TPS_page* page = tps_to_map->pages[i];
+		if ((page->ref_counter > 1) && (page->pending_writer != tps_to_map)) {
+			if (make_private_helper(tps_to_map, i, /* keep_address = */tps_to_map->page_count > 1) == -1) {
+				unlock_tps();
+				return NULL;
+			}
+		}
+	}
+
+	if ((tps_to_map->map_depth == 0) && !contiguous_helper(tps_to_map)) {
+		if (relocate_helper(tps_to_map) == -1) {
+			unlock_tps();
+			return NULL;
+		}
+	}
+
+	for (size_t i = 0; i < tps_to_map->page_count; ++i) {
+		TPS_page* page = tps_to_map->pages[i];
+		if (tps_to_map->map_depth == 0) {
+			++(page->map_count);
+		}
+		if (upgrade) {
+			++(page->write_map_count);
+		}
+	}
+	tps_to_map->map_prot |= map_prot;
+	++(tps_to_map->map_depth);
+
+	// open the pages once for the whole session
+	for (size_t i = 0; i < tps_to_map->page_count; ++i) {
+		TPS_page* page = tps_to_map->pages[i];
+		if (page_protect(page, page_rest_prot(page)) == -1) {
+			unmap_helper(tps_to_map);
+			unlock_tps();
+			return NULL;
+		}
+	}
+
+	void* mapped_area = tps_to_map->pages[0]->mapped_area;
+	unlock_tps();
+	return mapped_area;
+}
+
+// end a tps_map() session of the current thread; the protection is restored once every tps_map() call is matched
+// return -1 if no TPS of current thread, or if it is not mapped
+// return 0 if successful
+int tps_unmap(void)
+{
+	lock_tps();
+
+	TPS* tps_to_unmap = get_current_tps(&tps_index);
+	if ((!tps_to_unmap) || (tps_to_unmap->map_depth == 0)) {
+		unlock_tps();
+		return -1;
+	}
+
+	unmap_helper(tps_to_unmap);
+
+	unlock_tps();
+	return 0;
+}
+
+// take a snapshot of the current thread's TPS: its pages are shared with the snapshot, and only copied when the TPS writes to them
+// pages mapped for writing with tps_map() are copied right away
+// return NULL if no TPS of current thread, or on failure
+// return the snapshot if successful
+tps_snapshot_t tps_snapshot(void)
+{
+	lock_tps();
+
+	TPS* tps = get_current_tps(&tps_index);
+	if (!tps) {
+		unlock_tps();
+		return NULL;
+	}
+
+	// the version is a TPS in no index; the current thread is not accessing its own TPS, so the global lock is enough to share its pages
+	struct tps_snapshot* snapshot = (struct tps_snapshot*)slab_alloc(&snapshot_slab);
+	if (!snapshot) {
+		unlock_tps();
+		return NULL;
+	}
+	snapshot->restores = 0;
+	snapshot->version = init_new_tps_helper(tps->tid, tps->size);
+	if (!(snapshot->version)) {
+		slab_free(&snapshot_slab, snapshot);
+		unlock_tps();
+		return NULL;
+	}
+	if (share_pages_helper(snapshot->version, tps) == -1) {
+		release_tps_helper(snapshot->version);
+		slab_free(&snapshot_slab, snapshot);
+		unlock_tps();
+		return NULL;
+	}
+
+	unlock_tps();
+	return snapshot;
+}
+
+// roll the current thread's TPS back to @snapshot, which may have been taken from any TPS
+// the TPS shares the pages of the snapshot, which stays valid, and takes its size: a TPS grown by tps_alloc() since the snapshot shrinks back
+// a snapshot restored again is likely to be restored after every speculative write: a page the TPS made private since then gets the content of the snapshot's page copied back in place, so that the next write does not go through copy-on-write again
+// the first restore shares the pages, since a snapshot taken for a single write is often destroyed right after, which leaves the TPS with private pages without any copy
+// return -1 if no TPS of current thread, if @snapshot is NULL, if the TPS is mapped with tps_map(), if it is persistent, or on failure
+// return 0 if successful
+int tps_restore(tps_snapshot_t snapshot)
+{
+	if (!snapshot) {
+		return -1;
+	}
+
+	lock_tps();
+
+	// the addresses of a mapped TPS must not change, and the pages of a persistent TPS must keep mapping its file
+	TPS* tps = get_current_tps(&tps_index);
+	if ((!tps) || (tps->map_depth > 0) || persistent_region_helper(tps)) {
+		unlock_tps();
+		return -1;
+	}
+
+	TPS* version = snapshot->version;
+	bool in_place = (snapshot->restores > 0);
+	++(snapshot->restores);
+	if (version->page_count == tps->page_count) {
+		// take a reference to each page of the snapshot before dropping the one to the page it replaces
+		for (size_t i = 0; i < tps->page_count; ++i) {
+			TPS_page* page = version->pages[i];
+			TPS_page* own_page = tps->pages[i];
+			if (own_page == page) {
+				continue;
+			}
+			// only the owner uses a private page, and a clone in progress holds the global lock too; the pages of a persistent TPS keep mapping its file
+			bool persistent = (own_page->region && own_page->region->owner);
+			if (in_place && (own_page->ref_counter == 1) && !persistent && !(own_page->pending_writer)
+					&& (copy_page_helper(own_page, page) == 0)) {
+				continue;
+			}
+			share_page_helper(page, 1);
+			release_page_helper(own_page);
+			tps->pages[i] = page;
+		}
+	}
+	else {
+		// the TPS grew or shrank since the snapshot: it gets an array of pages of the snapshot's size, and drops all its pages
+		// a single page lives in single_page, which a TPS of several pages does not use
+		TPS_page** pages = (version->page_count == 1) ? &(tps->single_page)
+			: (TPS_page**)calloc(version->page_count, sizeof(TPS_page*));
+		if (!pages) {
+			unlock_tps();
+			return -1;
+		}
+		for (size_t i = 0; i < version->page_count; ++i) {
+			share_page_helper(version->pages[i], 1);
+			pages[i] = version->pages[i];
+		}
+		// only the owner accesses its pages without the global lock, and a clone in progress holds the global lock too
+		for (size_t i = 0; i < tps->page_count; ++i) {
+			release_page_helper(tps->pages[i]);
+		}
+		if (tps->pages != &(tps->single_page)) {
+			free(tps->pages);
+		}
+		tps->pages = pages;
+		tps->page_count = version->page_count;
+	}
+	tps->size = version->size;
+	tps->alloc_base = version->alloc_base;
+	tps->alloc_top = version->alloc_top;
+
+	unlock_tps();
+	return 0;
+}
+
+// destroy @snapshot, dropping its reference to each of its pages
+// return -1 if @snapshot is NULL
+// return 0 if successful
+int tps_snapshot_destroy(tps_snapshot_t snapshot)
+{
+	if (!snapshot) {
+		return -1;
+	}
+
+	lock_tps();
+	release_tps_helper(snapshot->version);
+	slab_free(&snapshot_slab, snapshot);
+	unlock_tps();
+	return 0;
+}
+
+// fold the pages of all the TPSes that have the same content into a single page, shared the same way as after tps_clone()
+// the pages are hashed, and the pages of the same hash are compared byte for byte; writing to a folded page later goes through copy-on-write
+// pages mapped with tps_map(), or expecting a copy-on-write fault, are left alone
+// fill @stats, if not NULL, with the totals of all the passes so far
+// return -1 on failure
+// return 0 if successful
+int tps_dedup(struct tps_dedup_stats *stats)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+	lock_tps();
+
+	// the owners of the TPSes must not access their private pages during the pass
+	TPS_index_table* table = atomic_load_explicit(&(tps_index.table), memory_order_relaxed);
+	size_t page_count = 0;
+	for (size_t j = 0; table && (j < table->capacity); ++j) {
+		for (TPS* tps = atomic_load_explicit(&(table->buckets[j]), memory_order_relaxed); tps;
+			tps = atomic_load_explicit(&(tps->index_next), memory_order_relaxed)) {
+			pthread_mutex_lock(&(tps->lock));
+			page_count += tps->page_count;
+		}
+	}
+
+	size_t capacity = TPS_INDEX_MIN_CAPACITY;
+	while (capacity < 2 * page_count) {
+		capacity *= 2;
+	}
+	TPS_dedup_entry* entries = (TPS_dedup_entry*)calloc(capacity, sizeof(TPS_dedup_entry));
+	int ret = entries ? 0 : -1;
+
+	struct tps_dedup_stats pass = { 0 };
+	for (size_t j = 0; entries && (j < table->capacity); ++j) {
+		for (TPS* tps = atomic_load_explicit(&(table->buckets[j]), memory_order_relaxed); tps;
+			tps = atomic_load_explicit(&(tps->index_next), memory_order_relaxed)) {
+			for (size_t i = 0; i < tps->page_count; ++i) {
+				dedup_page_helper(entries, capacity, tps, i, &pass);
+			}
+		}
+	}
+
+	// close the pages that were kept, then let the owners access their TPS again
+	for (size_t j = 0; entries && (j < capacity); ++j) {
+		if (entries[j].page) {
+			page_protect(entries[j].page, page_rest_prot(entries[j].page));
+		}
+	}
+	for (size_t j = 0; table && (j < table->capacity); ++j) {
+		for (TPS* tps = atomic_load_explicit(&(table->buckets[j]), memory_order_relaxed); tps;
+			tps = atomic_load_explicit(&(tps->index_next), memory_order_relaxed)) {
+			pthread_mutex_unlock(&(tps->lock));
+		}
+	}
+	free(entries);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	++(dedup_stats.passes);
+	dedup_stats.pages_scanned += pass.pages_scanned;
+	dedup_stats.pages_merged += pass.pages_merged;
+	dedup_stats.bytes_saved += pass.bytes_saved;
+	dedup_stats.cpu_ns += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+	if (stats) {
+		*stats = dedup_stats;
+	}
+
+	unlock_tps();
+	return ret;
+}
+
+// fill @stats with the sum of the counters of all the threads, including the ones that exited
+// return -1 if @stats is NULL, or if the counters are compiled out
+// return 0 if successful
+int tps_stats(struct tps_stats *stats)
+{
+#ifdef TPS_STATS
+	if (!stats) {
+		return -1;
+	}
+
+	uint64_t counters[TPS_STAT_COUNT];
+	pthread_mutex_lock(&stats_lock);
+	memcpy(counters, stats_exited, sizeof(counters));
+	for (TPS_thread_stats* thread = stats_threads; thread; thread = thread->next) {
+		for (int k = 0; k < TPS_STAT_COUNT; ++k) {
+			counters[k] += atomic_load_explicit(&(thread->counters[k]), memory_order_relaxed);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+	counters[TPS_STAT_faults] += atomic_load_explicit(&stats_unregistered_faults, memory_order_relaxed);
 
-	exit_critical_section();
+#define TPS_STAT_COPY(name) stats->name = counters[TPS_STAT_##name];
+	TPS_STATS_FIELDS(TPS_STAT_COPY)
+#undef TPS_STAT_COPY
 	return 0;
+#else
+	(void)stats;
+	return -1;
+#endif
 }
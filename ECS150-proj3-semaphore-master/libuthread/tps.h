@@ -6,10 +6,38 @@
 #include <sys/types.h>
 
 /*
- * Size of a TPS area in bytes
+ * Size of a TPS area in bytes, as created by tps_create(), and size of the
+ * pages backing larger TPS areas (see tps_create_sized())
  */
 #define TPS_SIZE 4096
 
+/*
+ * Protection policy
+ *
+ * By default, a TPS area is only accessible while the TPS API accesses it, or
+ * while it is mapped with tps_map(). Building the library with `PROTECT=guard`
+ * (i.e. defining TPS_GUARD_ONLY) relaxes this policy for trusted code: TPS areas
+ * stay accessible, and are only isolated from each other by inaccessible guard
+ * pages. Shared pages are kept read-only in both cases, so that writing to them
+ * goes through copy-on-write.
+ */
+
+/*
+ * Thread safety
+ *
+ * The TPS API can be called from any number of threads at the same time.
+ * Accesses of a thread to the private pages of its own TPS only lock this TPS,
+ * so that they do not wait for the accesses of other threads. Creating,
+ * destroying, cloning or mapping a TPS, and accessing pages shared with other
+ * TPSes, are serialized by a global lock.
+ */
+
+/*
+ * Protection flags for tps_map()
+ */
+#define TPS_MAP_READ	0x1
+#define TPS_MAP_WRITE	0x2
+
 /*
  * tps_init - Initialize TPS
  * @segv - Activate segfault handler
@@ -24,6 +52,91 @@
  */
 int tps_init(int segv);
 
+/*
+ * tps_cow_mode - Copy-on-write strategy
+ *
+ * TPS_COW_COPY: When a thread writes to a page it shares with other threads,
+ * tps_write() allocates a private page and copies the shared content into it
+ * before writing.
+ *
+ * TPS_COW_FAULT: A shared page is only opened read-only for writing. The first
+ * write faults, and the page fault handler makes the page private to the
+ * writer, in the same way the kernel breaks copy-on-write after fork(). The
+ * writer keeps the address of the page, and the other threads sharing the page
+ * are moved to the copy.
+ */
+enum tps_cow_mode {
+	TPS_COW_COPY = 0,
+	TPS_COW_FAULT,
+};
+
+/*
+ * struct tps_config - TPS configuration
+ * @segv: Activate segfault handler (see tps_init())
+ * @cow_mode: Copy-on-write strategy
+ * @pool_low: Low water mark of the page pool
+ * @pool_high: High water mark of the page pool (0 for the default of 256)
+ * @pool_prefault: Populate the pages of the page pool when they are mapped
+ * @arena_slots: Number of TPS pages in the arena (0 to disable arena mode)
+ * @arena_huge: Back the arena with transparent huge pages when possible
+ * @uffd: Fill TPS pages with userfaultfd when available
+ *
+ * TPS pages are taken from a pool of free pages, which are mapped many at a
+ * time and recycled when a TPS is destroyed. When an allocation leaves
+ * @pool_low free pages or fewer, the pool is refilled up to @pool_high pages
+ * with a single mapping. Free pages beyond @pool_high are unmapped. With
+ * @pool_prefault, the pages are populated when the pool is refilled, so that
+ * the first accesses to a new TPS do not fault.
+ *
+ * In arena mode, all the TPS pages are slots of a single reservation of
+ * @arena_slots pages made at initialization, and the page pool is refilled
+ * from it instead of mapping more memory. Slots are never unmapped; above
+ * @pool_high, the memory of free slots is released instead. Since closed slots
+ * next to each other merge into one mapping, the number of mappings no longer
+ * grows with the number of TPSes. Each slot keeps its own protection, so
+ * isolation is the same as in the default mode, and every TPS function behaves
+ * the same. Once all the slots are in use, tps_create() fails, and so do the
+ * writes that need a private copy of a shared page.
+ * @arena_huge only helps as long as the slots sharing a huge page have the same
+ * protection.
+ *
+ * With @uffd, the TPS memory is registered with userfaultfd, and a dedicated
+ * fault-service thread fills the pages the threads touch for the first time,
+ * so that pages never touched cost no memory. Copy-on-write fills the copy in
+ * place with UFFDIO_COPY, without opening it and filling it with zeros first.
+ * The memory of free pages is always released, so that they can be filled
+ * this way again. If userfaultfd is not available (e.g. not allowed for
+ * unprivileged users), the TPS memory is left to the kernel as without @uffd,
+ * and every TPS function behaves the same.
+ *
+ * A configuration initialized to all zeros behaves as tps_init(0).
+ */
+struct tps_config {
+	int segv;
+	enum tps_cow_mode cow_mode;
+	size_t pool_low;
+	size_t pool_high;
+	int pool_prefault;
+	size_t arena_slots;
+	int arena_huge;
+	int uffd;
+};
+
+/*
+ * tps_init_config - Initialize TPS with a configuration
+ * @config: TPS configuration
+ *
+ * Same as tps_init(), with the options given in @config. With
+ * %TPS_COW_FAULT, a page fault handler is always installed, since it is the one
+ * performing copy-on-write; @config->segv then only decides whether TPS
+ * protection errors are reported on stderr.
+ *
+ * Return: -1 if @config is NULL, if TPS API has already been initialized, or
+ * in case of failure during the initialization. 0 if the TPS API was
+ * successfully initialized.
+ */
+int tps_init_config(const struct tps_config *config);
+
 /*
  * tps_create - Create TPS
  *
@@ -36,6 +149,58 @@ int tps_init(int segv);
  */
 int tps_create(void);
 
+/*
+ * tps_create_sized - Create TPS of a given size
+ * @size: Size of the TPS area in bytes
+ *
+ * Same as tps_create(), with a TPS area of @size bytes instead of %TPS_SIZE.
+ * The area is backed by as many pages of %TPS_SIZE bytes as needed, and
+ * tps_read() and tps_write() accept any offset below @size. Each page is
+ * shared separately after tps_clone(), so that writing to a clone only copies
+ * the pages that are written to.
+ *
+ * Return: -1 if @size is 0, or too large to be rounded up to whole pages, if
+ * current thread already has a TPS, or in case of failure during the creation
+ * (e.g. memory allocation). 0 if the TPS area was successfully created.
+ */
+int tps_create_sized(size_t size);
+
+/*
+ * tps_create_persistent - Create TPS backed by a file
+ * @path: Path of the file holding the TPS area
+ * @size: Size of the TPS area in bytes
+ *
+ * Same as tps_create_sized(), but the TPS area maps the file at @path instead
+ * of anonymous memory. The file is created (and extended with zeros) if
+ * needed; otherwise the TPS starts with the content it holds, e.g. as left by
+ * the TPS of a previous run, so that a restarted thread skips rebuilding it.
+ * The area is protected like any TPS area. Clones of the TPS share its pages
+ * until they write to them, and their writes never reach the file; if the TPS
+ * is destroyed first, they keep a copy of the pages they still share.
+ *
+ * Modified pages are written back to the file by the system at its own pace,
+ * or right away with tps_sync(). A persistent TPS cannot be restored from a
+ * snapshot, and does not grow with tps_alloc(). Its owner cannot write to a
+ * page while a clone has it mapped with tps_map().
+ *
+ * Return: -1 if @path is NULL, if @size is 0 or too large, if current thread
+ * already has a TPS, if the file cannot be opened or extended, or is used by
+ * another persistent TPS, or in case of failure. 0 if the TPS was successfully
+ * created.
+ */
+int tps_create_persistent(const char *path, size_t size);
+
+/*
+ * tps_sync - Flush persistent TPS
+ *
+ * Write the modified pages of the current thread's persistent TPS back to its
+ * file with msync(), and wait for the writes to complete.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if it is not persistent,
+ * or in case of failure. 0 if the TPS was successfully written back.
+ */
+int tps_sync(void);
+
 /*
  * tps_destroy - Destroy TPS
  *
@@ -53,7 +218,7 @@ int tps_destroy(void);
  * @buffer: Data buffer receiving the read data
  *
  * Read @length bytes of data from the current thread's TPS at byte offset
- * @offset into data buffer @buffer.
+ * @offset into data buffer @buffer. The data may span several pages.
  *
  * Return: -1 if current thread doesn't have a TPS, or if the reading operation
  * is out of bound, or if @buffer is NULL, or in case of internal failure. 0 if
@@ -72,24 +237,439 @@ int tps_read(size_t offset, size_t length, char *buffer);
  *
  * If the current thread's TPS shares a memory page with another thread's TPS,
  * this should trigger a copy-on-write operation before the actual write occurs.
+ * Only the shared pages the data is written to are copied.
  *
  * Return: -1 if current thread doesn't have a TPS, or if the writing operation
- * is out of bound, or if @buffer is NULL, or in case of failure. 0 if the TPS
- * was successfully written to.
+ * is out of bound, or if @buffer is NULL, or if copy-on-write is needed while
+ * both the current thread and another thread map the same shared page with
+ * tps_map(), or in case of failure. 0 if the TPS was successfully written to.
  */
 int tps_write(size_t offset, size_t length, char *buffer);
 
+/*
+ * struct tps_iovec - Segment of a vectored TPS access
+ * @offset: Offset of the segment in the TPS
+ * @length: Length of the segment
+ * @buffer: Data buffer receiving (tps_readv()) or holding (tps_writev()) the
+ *          data of the segment
+ */
+struct tps_iovec {
+	size_t offset;
+	size_t length;
+	char *buffer;
+};
+
+/*
+ * tps_readv - Read several segments from TPS
+ * @iov: Array of segments to read
+ * @iovcnt: Number of segments in @iov
+ *
+ * Read each of the @iovcnt segments of @iov from the current thread's TPS, as
+ * tps_read() would, but with a single lookup of the TPS and a single opening
+ * of each page touched by the segments.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @iovcnt is negative,
+ * or if @iov is NULL while @iovcnt is positive, or if one of the segments
+ * would make tps_read() fail (in which case nothing is read), or in case of
+ * internal failure. 0 if all the segments were successfully read.
+ */
+int tps_readv(const struct tps_iovec *iov, int iovcnt);
+
+/*
+ * tps_writev - Write several segments to TPS
+ * @iov: Array of segments to write
+ * @iovcnt: Number of segments in @iov
+ *
+ * Write each of the @iovcnt segments of @iov, in order, to the current
+ * thread's TPS, as tps_write() would, but with a single lookup of the TPS and a
+ * single opening of each page touched by the segments. A shared page touched
+ * by several segments only goes through copy-on-write once.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @iovcnt is negative,
+ * or if @iov is NULL while @iovcnt is positive, or if one of the segments
+ * would make tps_write() fail (in which case nothing is written), or in case
+ * of internal failure. 0 if all the segments were successfully written.
+ */
+int tps_writev(const struct tps_iovec *iov, int iovcnt);
+
+/*
+ * tps_fetch_add - Add to a word of TPS
+ * @offset: Offset of the word in the TPS, a multiple of 8
+ * @value: Value to add to the word
+ * @old: Receives the previous value of the word, unless NULL
+ *
+ * Add @value to the 64-bit word at byte offset @offset of the current thread's
+ * TPS, atomically. Like tps_write(), this triggers a copy-on-write operation if
+ * the page of the word is shared with another thread's TPS. The word is only
+ * opened once, so this is cheaper than a tps_read() followed by a tps_write(),
+ * and a concurrent tps_clone() of the TPS sees the word either before or after
+ * the addition.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @offset is not a
+ * multiple of 8, or if the word is out of bound, or in case of failure. 0 if
+ * the word was successfully updated.
+ */
+int tps_fetch_add(size_t offset, uint64_t value, uint64_t *old);
+
+/*
+ * tps_exchange - Replace a word of TPS
+ * @offset: Offset of the word in the TPS, a multiple of 8
+ * @value: New value of the word
+ * @old: Receives the previous value of the word, unless NULL
+ *
+ * Replace the 64-bit word at byte offset @offset of the current thread's TPS
+ * with @value, atomically, in the same way as tps_fetch_add().
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @offset is not a
+ * multiple of 8, or if the word is out of bound, or in case of failure. 0 if
+ * the word was successfully replaced.
+ */
+int tps_exchange(size_t offset, uint64_t value, uint64_t *old);
+
+/*
+ * tps_cas - Compare and swap a word of TPS
+ * @offset: Offset of the word in the TPS, a multiple of 8
+ * @expected: Expected value of the word; receives its actual value if it
+ *            differs
+ * @desired: New value of the word
+ *
+ * Replace the 64-bit word at byte offset @offset of the current thread's TPS
+ * with @desired if it holds *@expected, atomically, in the same way as
+ * tps_fetch_add(). Since the word may be written, a shared page is copied
+ * even if the comparison fails.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @expected is NULL, or
+ * if @offset is not a multiple of 8, or if the word is out of bound, or in case
+ * of failure. 0 if the word was replaced, 1 if it did not hold *@expected.
+ */
+int tps_cas(size_t offset, uint64_t *expected, uint64_t desired);
+
+/*
+ * TPS keys
+ *
+ * A key names a slot at a fixed offset of every TPS, like a pthread_key_t
+ * names a thread-specific value. The library lays the slots out from offset 0,
+ * in the order the keys are created, so that independent modules can share the
+ * TPS of a thread without agreeing on offsets. Code that also accesses raw
+ * offsets with tps_read() / tps_write() must keep them apart from the slots.
+ * Keys are never deleted.
+ */
+typedef int tps_key_t;
+
+/*
+ * Maximum number of keys
+ */
+#define TPS_KEYS_MAX	128
+
+/*
+ * tps_key_create - Create a TPS key
+ * @size: Size of the slot in bytes
+ * @align: Alignment of the slot, a power of 2
+ *
+ * Reserve a slot of @size bytes at an offset that is a multiple of @align, in
+ * the first TPS_SIZE bytes of every TPS. The slot is also padded to a multiple
+ * of @align, so that aligning a slot to the size of a cache line keeps the next
+ * slots out of its cache lines.
+ *
+ * Return: -1 if @size is 0, if @align is not a power of 2, if the slot does not
+ * fit in TPS_SIZE bytes after the previous slots, or if TPS_KEYS_MAX keys were
+ * already created. The new key otherwise.
+ */
+tps_key_t tps_key_create(size_t size, size_t align);
+
+/*
+ * tps_get - Read the slot of a key
+ * @key: Key of the slot
+ * @buffer: Data buffer receiving the slot
+ *
+ * Read the slot named by @key from the current thread's TPS, in the same way as
+ * tps_read(). While the TPS is mapped with tps_map(), the slot is read directly
+ * from the mapping. Otherwise, if the first page of the TPS is not shared, it
+ * is opened and closed around the copy without the checks of tps_read().
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @key was not created,
+ * or if the slot is out of bound, or if @buffer is NULL. 0 if the slot was
+ * successfully read.
+ */
+int tps_get(tps_key_t key, void *buffer);
+
+/*
+ * tps_set - Write the slot of a key
+ * @key: Key of the slot
+ * @buffer: Data buffer holding the new content of the slot
+ *
+ * Write the slot named by @key of the current thread's TPS, in the same way as
+ * tps_write(). While the TPS is mapped for writing with tps_map(), the slot is
+ * written directly to the mapping. Otherwise, if the first page of the TPS is
+ * not shared, it is opened and closed around the copy without the checks of
+ * tps_write().
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @key was not created,
+ * or if the slot is out of bound, or if @buffer is NULL. 0 if the slot was
+ * successfully written.
+ */
+int tps_set(tps_key_t key, const void *buffer);
+
+/*
+ * tps_alloc - Allocate from TPS arena
+ * @size: Size of the object in bytes
+ * @offset: Receives the offset of the object in the TPS
+ *
+ * Allocate an object of @size bytes in the current thread's TPS, from an arena
+ * that follows the area requested at creation. Objects are aligned to 16
+ * bytes, and are accessed at their offset with tps_read(), tps_write(), or
+ * through tps_map(). When the arena is full, the TPS grows by new protected
+ * pages, at least doubling its size; a TPS cannot grow while it is mapped with
+ * tps_map(). A clone, or a snapshot, of the TPS keeps the objects allocated so
+ * far, whose pages are shared until they are written to, and both arenas go on
+ * independently.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if @size is 0, or if
+ * @offset is NULL, or if the TPS has to grow while it is mapped, or in case of
+ * failure. 0 if the object was successfully allocated.
+ */
+int tps_alloc(size_t size, size_t *offset);
+
+/*
+ * tps_reset - Free TPS arena
+ *
+ * Free all the objects allocated with tps_alloc() in the current thread's TPS
+ * at once, e.g. when the request using them completes. The pages of the arena
+ * are kept for the next objects, whose content is not cleared; tps_destroy()
+ * frees them.
+ *
+ * Return: -1 if current thread doesn't have a TPS. 0 if the objects were
+ * successfully freed.
+ */
+int tps_reset(void);
+
 /*
  * tps_clone - Clone TPS
  * @tid: TID of the thread to clone
  *
  * Clone thread @tid's TPS. In the first phase, the cloned TPS's content should
  * copied directly. In the last phase, the new TPS should not copy the cloned
- * TPS's content but should refer to the same memory page.
+ * TPS's content but should refer to the same memory pages. The new TPS has the
+ * same size as the cloned one.
  *
  * Return: -1 if thread @tid doesn't have a TPS, or if current thread already
  * has a TPS, or in case of failure. 0 is TPS was successfully cloned.
  */
 int tps_clone(pthread_t tid);
 
+/*
+ * tps_clone_many - Clone TPS for several threads
+ * @tid: TID of the thread to clone
+ * @tids: Array of the TIDs of the threads receiving a clone
+ * @count: Number of threads in @tids
+ *
+ * Clone thread @tid's TPS for each of the @count threads of @tids, as if each
+ * of them had called tps_clone(@tid), but at once, so that a thread spawning
+ * many workers can seed their TPS before they run. The clones share the pages
+ * of thread @tid's TPS until they write to them.
+ *
+ * Return: -1 if thread @tid doesn't have a TPS, or if @tids is NULL while
+ * @count is positive, or if a thread appears twice in @tids or already has a
+ * TPS, or in case of failure; no TPS is created then. 0 if the TPS was
+ * successfully cloned for all the threads.
+ */
+int tps_clone_many(pthread_t tid, const pthread_t *tids, size_t count);
+
+/*
+ * tps_transfer - Give TPS to another thread
+ * @to: TID of the thread receiving the TPS
+ *
+ * Hand the current thread's TPS over to thread @to, e.g. to the next stage of
+ * a pipeline, which then owns it as if it had created it, while the current
+ * thread is left without a TPS. Nothing is copied, and pages shared with other
+ * TPSes stay shared the same way. If @to already has a TPS, nothing happens:
+ * the receiver must destroy or transfer its own TPS first.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if thread @to already has
+ * a TPS (in particular, if @to is the current thread), or if the TPS is mapped
+ * with tps_map(). 0 if the TPS was successfully transferred.
+ */
+int tps_transfer(pthread_t to);
+
+/*
+ * tps_map - Map TPS for direct access
+ * @prot: TPS_MAP_READ, or TPS_MAP_READ | TPS_MAP_WRITE
+ *
+ * Open the current thread's TPS with protection @prot, and return its address.
+ * The TPS can then be accessed directly through this address, for the cost of a
+ * single protection change, until the matching call to tps_unmap(). Calls can
+ * be nested: a nested call can add TPS_MAP_WRITE, and returns the same address.
+ * tps_read() and tps_write() can still be used while the TPS is mapped.
+ *
+ * Mapping a shared page for writing performs copy-on-write first (or, with
+ * %TPS_COW_FAULT, on the first write through the returned address). Cloning a
+ * TPS while it is mapped for writing copies its content right away.
+ *
+ * A TPS of several pages is mapped at a single address. If copy-on-write left
+ * its pages apart, they are first copied to a new contiguous area. With
+ * %TPS_COW_FAULT, only one shared page at a time waits for the first write;
+ * the others are copied right away.
+ *
+ * Return: NULL if current thread doesn't have a TPS, if @prot is invalid, if
+ * writing requires copy-on-write while both the current thread and another
+ * thread map the same shared page, or in case of failure. Address of the TPS
+ * area otherwise.
+ */
+void *tps_map(int prot);
+
+/*
+ * tps_unmap - Unmap TPS
+ *
+ * End a direct access session opened with tps_map(). Once every call to
+ * tps_map() is matched, the protection of the TPS is restored, and the address
+ * returned by tps_map() must not be used anymore.
+ *
+ * Return: -1 if current thread doesn't have a TPS, or if its TPS is not mapped.
+ * 0 if the TPS was successfully unmapped.
+ */
+int tps_unmap(void);
+
+/*
+ * tps_snapshot_t - TPS snapshot type
+ *
+ * A snapshot is an immutable point-in-time version of a TPS. It shares the
+ * memory pages of the TPS it was taken from, in the same way as a clone, so
+ * taking a snapshot copies nothing: a page is only copied when the TPS (or
+ * another TPS sharing it) writes to it.
+ */
+typedef struct tps_snapshot *tps_snapshot_t;
+
+/*
+ * tps_snapshot - Take a snapshot of TPS
+ *
+ * Take a snapshot of the current thread's TPS. Pages mapped for writing with
+ * tps_map() are copied right away.
+ *
+ * Return: Snapshot of the current thread's TPS. NULL if current thread doesn't
+ * have a TPS, or in case of failure.
+ */
+tps_snapshot_t tps_snapshot(void);
+
+/*
+ * tps_restore - Restore TPS from a snapshot
+ * @snapshot: Snapshot to roll back to
+ *
+ * Roll the current thread's TPS back to the content of @snapshot, which may
+ * have been taken from any TPS (not necessarily the current thread's). The TPS
+ * shares the pages of @snapshot again, which stays valid, so it can be restored
+ * several times. From the second restore of @snapshot on, a page the TPS made
+ * private since then gets the content of @snapshot copied back into it instead,
+ * so that writing to it again does not copy it once more. The TPS also takes
+ * the size of @snapshot: a TPS that grew with tps_alloc() since the snapshot
+ * shrinks back to its former size, along with its tps_alloc() objects.
+ *
+ * Return: -1 if current thread doesn't have a TPS, if @snapshot is NULL, if
+ * the TPS is mapped with tps_map() or is persistent, or in case of failure. 0
+ * if the TPS was successfully restored.
+ */
+int tps_restore(tps_snapshot_t snapshot);
+
+/*
+ * tps_snapshot_destroy - Deallocate a snapshot
+ * @snapshot: Snapshot to deallocate
+ *
+ * Deallocate @snapshot. The pages it shared with TPSes are kept until they are
+ * not used anymore. Any thread may destroy a snapshot.
+ *
+ * Return: -1 if @snapshot is NULL. 0 if @snapshot was successfully destroyed.
+ */
+int tps_snapshot_destroy(tps_snapshot_t snapshot);
+
+/*
+ * struct tps_dedup_stats - Deduplication counters
+ * @passes: Number of calls to tps_dedup()
+ * @pages_scanned: Number of TPS pages hashed
+ * @pages_merged: Number of TPS pages folded into an identical page
+ * @bytes_saved: Memory given back to the page pool by folding pages
+ * @cpu_ns: CPU time spent in tps_dedup(), in nanoseconds
+ *
+ * The counters are totals over all the passes. A folded page only stays saved
+ * until a TPS sharing it writes to it again.
+ */
+struct tps_dedup_stats {
+	size_t passes;
+	size_t pages_scanned;
+	size_t pages_merged;
+	size_t bytes_saved;
+	uint64_t cpu_ns;
+};
+
+/*
+ * tps_dedup - Deduplicate TPS pages
+ * @stats: Counters to fill, or NULL
+ *
+ * Fold the pages of all the TPSes that hold the same content into a single
+ * page, shared by these TPSes in the same way as after tps_clone(), so that the
+ * next write to it goes through copy-on-write. The pages are hashed, and pages
+ * with the same hash are compared byte for byte. Pages mapped with tps_map()
+ * are left alone. The TPSes cannot be accessed during the pass.
+ *
+ * This is never done automatically: an application may call this function
+ * periodically, e.g. from a background thread, and use @stats to judge whether
+ * the memory saved is worth the CPU time spent.
+ *
+ * Return: -1 in case of failure. 0 if the pass was successful.
+ */
+int tps_dedup(struct tps_dedup_stats *stats);
+
+/*
+ * struct tps_stats - TPS library counters
+ * @creates: Number of TPSes created with tps_create() / tps_create_sized()
+ * @destroys: Number of TPSes destroyed
+ * @clones: Number of TPSes created by cloning
+ * @cow_copies: Number of shared pages copied on write
+ * @bytes_copied: Bytes copied between TPS pages
+ * @bytes_read: Bytes read with tps_read() / tps_readv()
+ * @bytes_written: Bytes written with tps_write() / tps_writev()
+ * @mprotect_calls: Number of mprotect() system calls
+ * @mmap_calls: Number of mmap() system calls
+ * @munmap_calls: Number of munmap() system calls
+ * @madvise_calls: Number of madvise() system calls
+ * @lookups: Number of lookups of a TPS by thread
+ * @lookup_steps: Number of TPSes visited by these lookups
+ * @faults: Number of page faults caught by the library
+ * @uffd_copies: Number of pages filled with a copy by the userfaultfd backend
+ * @uffd_fills: Number of first touches served by the fault-service thread
+ *
+ * The counters are totals over all the threads since the program started,
+ * including threads that exited.
+ */
+struct tps_stats {
+	uint64_t creates;
+	uint64_t destroys;
+	uint64_t clones;
+	uint64_t cow_copies;
+	uint64_t bytes_copied;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t mprotect_calls;
+	uint64_t mmap_calls;
+	uint64_t munmap_calls;
+	uint64_t madvise_calls;
+	uint64_t lookups;
+	uint64_t lookup_steps;
+	uint64_t faults;
+	uint64_t uffd_copies;
+	uint64_t uffd_fills;
+};
+
+/*
+ * tps_stats - Read TPS library counters
+ * @stats: Counters to fill
+ *
+ * Fill @stats with the current counters. Each thread updates its own counters
+ * without synchronization, so reading them is cheap but not an atomic snapshot
+ * of all the threads. The counters are only maintained if the library was
+ * built with them ("STATS=1"; they are compiled out by default).
+ *
+ * Return: -1 if @stats is NULL, or if the library was built without counters.
+ * 0 if @stats was successfully filled.
+ */
+int tps_stats(struct tps_stats *stats);
+
 #endif /* _TPS_H */
@@ -0,0 +1,521 @@
+/*
+ * Semaphore benchmark
+ *
+ * Compare the semaphores of the library with the previous implementation,
+ * kept here as a reference: a count and a queue of blocked threads protected
+ * by the global critical section of the thread library, where blocked threads
+ * sleep in thread_block().
+ *
+ * First measure a sem_down() / sem_up() pair on an available semaphore, which
+ * nobody else uses, and a sem_trydown() or sem_timeddown() call that fails on
+ * a semaphore of count 0.
+ *
+ * Then measure a ping-pong between two threads, as in sem_count.c: each round
+ * trip blocks each thread once, until the other one releases it.
+ *
+ * Then measure a producer and a consumer exchanging values through a
+ * bounded buffer, as in sem_buffer.c.
+ *
+ * Then measure a pipeline of threads handing values over to the next
+ * stage, as in sem_prime.c.
+ *
+ * Then let a producer hand slots over to a consumer by batches of 64, with one
+ * sem_up() / sem_down() call per slot, and with sem_up_n() / sem_down_n().
+ *
+ * Finally, let several threads compete for a semaphore of count 1, each
+ * holding it for a short while, and measure the throughput along with the
+ * distribution of the time each thread waits for the semaphore.
+ *
+ * The semaphores of the library are measured with spinning turned off and on,
+ * and with SEM_HANDOFF. The number of waits that ended while spinning, and
+ * that went on to sleep, is reported.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <queue.h>
+#include <sem.h>
+#include <thread.h>
+
+#define ITERATIONS	1000000
+#define ROUND_TRIPS	50000
+#define ITEMS		200000
+#define BUFFER_SIZE	16
+#define STAGES		4
+#define BATCH		64
+#define BATCHES		20000
+#define CONTENDERS	4
+#define ACQUIRES	20000
+#define HOLD_NS		200
+
+/* Previous implementation, for reference */
+struct legacy_sem {
+	queue_t blocked_queue;
+	size_t count;
+};
+
+static void *legacy_create(size_t count)
+{
+	struct legacy_sem *sem = malloc(sizeof(*sem));
+
+	sem->blocked_queue = queue_create();
+	sem->count = count;
+	return sem;
+}
+
+static void legacy_destroy(void *arg)
+{
+	struct legacy_sem *sem = arg;
+
+	queue_destroy(sem->blocked_queue);
+	free(sem);
+}
+
+static void legacy_down(void *arg)
+{
+	struct legacy_sem *sem = arg;
+
+	enter_critical_section();
+	if (sem->count == 0) {
+		queue_enqueue(sem->blocked_queue, (void*)pthread_self());
+		thread_block();
+	}
+	sem->count--;
+	exit_critical_section();
+}
+
+static void legacy_up(void *arg)
+{
+	struct legacy_sem *sem = arg;
+	void *tid;
+
+	enter_critical_section();
+	sem->count++;
+	if (queue_dequeue(sem->blocked_queue, &tid) == 0)
+		thread_unblock((pthread_t)tid);
+	exit_critical_section();
+}
+
+static struct sem_stats spin_stats;
+
+static void *futex_create(size_t count)
+{
+	return sem_create(count);
+}
+
+static void futex_destroy(void *sem)
+{
+	struct sem_stats stats;
+
+	sem_getstats(sem, &stats);
+	spin_stats.spin_hits += stats.spin_hits;
+	spin_stats.parks += stats.parks;
+	sem_destroy(sem);
+}
+
+static void *handoff_create(size_t count)
+{
+	return sem_create_ex(count, SEM_HANDOFF);
+}
+
+static void futex_down(void *sem)
+{
+	sem_down(sem);
+}
+
+static void futex_up(void *sem)
+{
+	sem_up(sem);
+}
+
+struct sem_ops {
+	const char *name;
+	int spin;
+	void *(*create)(size_t count);
+	void (*destroy)(void *sem);
+	void (*down)(void *sem);
+	void (*up)(void *sem);
+};
+
+static const struct sem_ops implementations[] = {
+	{ "critical section", 0, legacy_create, legacy_destroy, legacy_down, legacy_up },
+	{ "futex",            0, futex_create,  futex_destroy,  futex_down,  futex_up },
+	{ "futex + spinning", 1, futex_create,  futex_destroy,  futex_down,  futex_up },
+	{ "futex, handoff",   0, handoff_create, futex_destroy, futex_down,  futex_up },
+};
+
+struct pair {
+	const struct sem_ops *ops;
+	void *ping, *pong;
+	void *empty, *full;
+	size_t head, tail;
+	unsigned int buffer[BUFFER_SIZE];
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double uncontended(const struct sem_ops *ops)
+{
+	void *sem = ops->create(1);
+	double start;
+	size_t i;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		ops->down(sem);
+		ops->up(sem);
+	}
+	start = (now_ns() - start) / ITERATIONS;
+
+	ops->destroy(sem);
+	return start;
+}
+
+static double failed_down(int timed, int flags)
+{
+	sem_t sem = sem_create_ex(0, flags);
+	struct timespec deadline = { 0, 0 };
+	double start;
+	size_t i;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		if (timed)
+			sem_timeddown(sem, &deadline);
+		else
+			sem_trydown(sem);
+	}
+	start = (now_ns() - start) / ITERATIONS;
+
+	sem_destroy(sem);
+	return start;
+}
+
+static void *pong_thread(void *arg)
+{
+	struct pair *p = arg;
+	size_t i;
+
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		p->ops->down(p->ping);
+		p->ops->up(p->pong);
+	}
+	return NULL;
+}
+
+static double ping_pong(const struct sem_ops *ops)
+{
+	struct pair p = { .ops = ops };
+	pthread_t tid;
+	double start;
+	size_t i;
+
+	p.ping = ops->create(0);
+	p.pong = ops->create(0);
+	pthread_create(&tid, NULL, pong_thread, &p);
+
+	start = now_ns();
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		ops->up(p.ping);
+		ops->down(p.pong);
+	}
+	start = (now_ns() - start) / ROUND_TRIPS;
+
+	pthread_join(tid, NULL);
+	ops->destroy(p.ping);
+	ops->destroy(p.pong);
+	return start;
+}
+
+static void *consumer(void *arg)
+{
+	struct pair *p = arg;
+	unsigned int expected;
+
+	for (expected = 0; expected < ITEMS; expected++) {
+		p->ops->down(p->empty);
+		if (p->buffer[p->tail] != expected) {
+			fprintf(stderr, "consumer got %u instead of %u\n",
+				p->buffer[p->tail], expected);
+			exit(1);
+		}
+		p->tail = (p->tail + 1) % BUFFER_SIZE;
+		p->ops->up(p->full);
+	}
+	return NULL;
+}
+
+static double producer_consumer(const struct sem_ops *ops)
+{
+	struct pair p = { .ops = ops };
+	pthread_t tid;
+	unsigned int count;
+	double start;
+
+	p.empty = ops->create(0);
+	p.full = ops->create(BUFFER_SIZE);
+	pthread_create(&tid, NULL, consumer, &p);
+
+	start = now_ns();
+	for (count = 0; count < ITEMS; count++) {
+		ops->down(p.full);
+		p.buffer[p.head] = count;
+		p.head = (p.head + 1) % BUFFER_SIZE;
+		ops->up(p.empty);
+	}
+	pthread_join(tid, NULL);
+	start = (now_ns() - start) / ITEMS;
+
+	ops->destroy(p.empty);
+	ops->destroy(p.full);
+	return start;
+}
+
+struct stage {
+	const struct sem_ops *ops;
+	void *in, *out;
+	unsigned int *value;
+};
+
+static void *stage_thread(void *arg)
+{
+	struct stage *s = arg;
+	size_t i;
+
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		s->ops->down(s->in);
+		(*s->value)++;
+		s->ops->up(s->out);
+	}
+	return NULL;
+}
+
+static double pipeline(const struct sem_ops *ops)
+{
+	struct stage stages[STAGES];
+	pthread_t tids[STAGES];
+	void *sems[STAGES + 1];
+	unsigned int value = 0;
+	double start;
+	size_t i;
+
+	for (i = 0; i <= STAGES; i++)
+		sems[i] = ops->create(0);
+	for (i = 0; i < STAGES; i++) {
+		stages[i] = (struct stage){ ops, sems[i], sems[i + 1], &value };
+		pthread_create(&tids[i], NULL, stage_thread, &stages[i]);
+	}
+
+	start = now_ns();
+	for (i = 0; i < ROUND_TRIPS; i++) {
+		ops->up(sems[0]);
+		ops->down(sems[STAGES]);
+	}
+	start = (now_ns() - start) / ROUND_TRIPS;
+
+	for (i = 0; i < STAGES; i++)
+		pthread_join(tids[i], NULL);
+	for (i = 0; i <= STAGES; i++)
+		ops->destroy(sems[i]);
+	if (value != STAGES * ROUND_TRIPS) {
+		fprintf(stderr, "pipeline passed %u values instead of %u\n",
+			value, STAGES * ROUND_TRIPS);
+		exit(1);
+	}
+	return start;
+}
+
+struct batcher {
+	sem_t empty, full;
+	int counted;
+};
+
+static void take_batch(sem_t sem, int counted)
+{
+	size_t i;
+
+	if (counted) {
+		sem_down_n(sem, BATCH);
+		return;
+	}
+	for (i = 0; i < BATCH; i++)
+		sem_down(sem);
+}
+
+static void release_batch(sem_t sem, int counted)
+{
+	size_t i;
+
+	if (counted) {
+		sem_up_n(sem, BATCH);
+		return;
+	}
+	for (i = 0; i < BATCH; i++)
+		sem_up(sem);
+}
+
+static void *batch_consumer(void *arg)
+{
+	struct batcher *b = arg;
+	size_t i;
+
+	for (i = 0; i < BATCHES; i++) {
+		take_batch(b->full, b->counted);
+		release_batch(b->empty, b->counted);
+	}
+	return NULL;
+}
+
+static double batches(int counted, int flags)
+{
+	struct batcher b = { sem_create_ex(0, flags), sem_create_ex(0, flags), counted };
+	pthread_t tid;
+	double start;
+	size_t i;
+
+	release_batch(b.empty, 1);
+	release_batch(b.empty, 1);
+	pthread_create(&tid, NULL, batch_consumer, &b);
+
+	start = now_ns();
+	for (i = 0; i < BATCHES; i++) {
+		take_batch(b.empty, counted);
+		release_batch(b.full, counted);
+	}
+	pthread_join(tid, NULL);
+	start = (now_ns() - start) / (BATCHES * BATCH);
+
+	sem_destroy(b.empty);
+	sem_destroy(b.full);
+	return start;
+}
+
+struct contender {
+	const struct sem_ops *ops;
+	void *sem;
+	double *waits;
+};
+
+static void *contender_thread(void *arg)
+{
+	struct contender *c = arg;
+	double start;
+	size_t i;
+
+	for (i = 0; i < ACQUIRES; i++) {
+		start = now_ns();
+		c->ops->down(c->sem);
+		c->waits[i] = now_ns() - start;
+		while (now_ns() - start - c->waits[i] < HOLD_NS)
+			;
+		c->ops->up(c->sem);
+	}
+	return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static double contention(const struct sem_ops *ops)
+{
+	struct contender contenders[CONTENDERS];
+	pthread_t tids[CONTENDERS];
+	double *waits = malloc(CONTENDERS * ACQUIRES * sizeof(double));
+	void *sem = ops->create(1);
+	double start;
+	size_t i, n = CONTENDERS * ACQUIRES;
+
+	start = now_ns();
+	for (i = 0; i < CONTENDERS; i++) {
+		contenders[i] = (struct contender){ ops, sem, waits + i * ACQUIRES };
+		pthread_create(&tids[i], NULL, contender_thread, &contenders[i]);
+	}
+	for (i = 0; i < CONTENDERS; i++)
+		pthread_join(tids[i], NULL);
+	start = now_ns() - start;
+	ops->destroy(sem);
+
+	qsort(waits, n, sizeof(double), compare_doubles);
+	printf("%-16s: %8.0f acquires/ms, wait p50 %8.0f ns, p99 %8.0f ns, "
+	       "max %10.0f ns\n", ops->name, n / start * 1e6,
+	       waits[n / 2], waits[n * 99 / 100], waits[n - 1]);
+	free(waits);
+	return start;
+}
+
+static void report(const char *unit, double (*measure)(const struct sem_ops*))
+{
+	size_t i, n = sizeof(implementations) / sizeof(implementations[0]);
+	double result;
+
+	for (i = 0; i < n; i++) {
+		sem_set_spin(implementations[i].spin);
+		spin_stats = (struct sem_stats){ 0 };
+		result = measure(&implementations[i]);
+		printf("%-16s: %8.1f %s", implementations[i].name, result, unit);
+		if (implementations[i].create != legacy_create)
+			printf(" (%llu spin hits, %llu parks)",
+			       (unsigned long long)spin_stats.spin_hits,
+			       (unsigned long long)spin_stats.parks);
+		printf("\n");
+	}
+}
+
+int main(void)
+{
+	size_t i, n = sizeof(implementations) / sizeof(implementations[0]);
+
+	printf("Uncontended sem_down + sem_up\n");
+	report("ns/pair", uncontended);
+
+	printf("\nFailed take, semaphore of count 0\n");
+	printf("sem_trydown:            %8.1f ns/call\n", failed_down(0, 0));
+	printf("sem_trydown, handoff:   %8.1f ns/call\n",
+	       failed_down(0, SEM_HANDOFF));
+	printf("sem_timeddown:          %8.1f ns/call\n", failed_down(1, 0));
+	printf("sem_timeddown, handoff: %8.1f ns/call\n",
+	       failed_down(1, SEM_HANDOFF));
+
+	printf("\nPing-pong between two threads\n");
+	report("ns/round trip", ping_pong);
+
+	printf("\nProducer / consumer, %d-slot buffer\n", BUFFER_SIZE);
+	report("ns/item", producer_consumer);
+
+	printf("\nPipeline of %d stages\n", STAGES);
+	report("ns/value", pipeline);
+
+	printf("\nBatches of %d slots, %d-slot buffer\n", BATCH, 2 * BATCH);
+	sem_set_spin(0);
+	printf("%d x sem_up / sem_down:          %8.1f ns/slot\n", BATCH,
+	       batches(0, 0));
+	printf("sem_up_n / sem_down_n:          %8.1f ns/slot\n",
+	       batches(1, 0));
+	printf("%d x sem_up / sem_down, handoff: %8.1f ns/slot\n", BATCH,
+	       batches(0, SEM_HANDOFF));
+	printf("sem_up_n / sem_down_n, handoff: %8.1f ns/slot\n",
+	       batches(1, SEM_HANDOFF));
+
+	printf("\n%d threads competing for a semaphore of count 1, "
+	       "held for %d ns\n", CONTENDERS, HOLD_NS);
+	for (i = 0; i < n; i++) {
+		sem_set_spin(implementations[i].spin);
+		contention(&implementations[i]);
+	}
+
+	return 0;
+}
@@ -4,12 +4,20 @@
  * A producer produces x values in a shared buffer, while a consume consumes y
  * of these values. x and y are always less than the size of the buffer but can
  * be different. The synchronization is managed through two semaphores.
+ *
+ * Run with "batch" as fourth argument to take and release the slots of a whole
+ * batch at once, with sem_down_n() and sem_up_n(). Batches are then at most
+ * half of the buffer, so that the producer and the consumer can always get
+ * their batch once the other one is done. The time taken is printed on
+ * stderr, to compare the two variants with the output redirected.
  */
 
 #include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <sem.h>
 
@@ -22,6 +30,7 @@ struct test4 {
 	sem_t mutex;
 	size_t size, head, tail, maxcount;
 	unsigned int prod_seed, cons_seed;
+	int batch;
 	unsigned int buffer[BUFFER_SIZE];
 };
 
@@ -35,8 +44,23 @@ static void *consumer(void* arg)
 	while (out < t->maxcount - 1) {
 		size_t i, n = rand_r(&t->cons_seed) % BUFFER_SIZE + 1;
 
+		if (t->batch)
+			n = (n - 1) % (BUFFER_SIZE / 2) + 1;
 		n = clamp(n, t->maxcount - out - 1);
 		printf("Consumer wants to get %zu items out of buffer...\n", n);
+		if (t->batch) {
+			sem_down_n(t->empty, n);
+			for (i = 0; i < n; i++) {
+				out = t->buffer[t->tail];
+				printf("Consumer is taking %zu out of buffer\n", out);
+				t->tail = (t->tail + 1) % BUFFER_SIZE;
+			}
+			sem_down(t->mutex);
+			t->size -= n;
+			sem_up(t->mutex);
+			sem_up_n(t->full, n);
+			continue;
+		}
 		for (i = 0; i < n; i++) {
 			sem_down(t->empty);
 			out = t->buffer[t->tail];
@@ -59,9 +83,24 @@ static void *producer(void* arg)
 
 	while (count < t->maxcount) {
 		size_t i, n = rand_r(&t->prod_seed) % BUFFER_SIZE + 1;
+		if (t->batch)
+			n = (n - 1) % (BUFFER_SIZE / 2) + 1;
 		n = clamp(n, t->maxcount - count);
 
 		printf("Producer wants to put %zu items into buffer...\n", n);
+		if (t->batch) {
+			sem_down_n(t->full, n);
+			for (i = 0; i < n; i++) {
+				printf("Producer is putting %zu into buffer\n", count);
+				t->buffer[t->head] = count++;
+				t->head = (t->head + 1) % BUFFER_SIZE;
+			}
+			sem_down(t->mutex);
+			t->size += n;
+			sem_up(t->mutex);
+			sem_up_n(t->empty, n);
+			continue;
+		}
 		for (i = 0; i < n; i++) {
 			sem_down(t->full);
 			printf("Producer is putting %zu into buffer\n", count);
@@ -92,6 +131,7 @@ int main(int argc, char **argv)
 	struct test4 t;
 	unsigned int maxcount = MAXCOUNT;
 	pthread_t tid[2];
+	struct timespec start, end;
 
 	t.cons_seed = 1;
 	t.prod_seed = 2;
@@ -102,6 +142,7 @@ int main(int argc, char **argv)
 		t.cons_seed = get_argv(argv[2]);
 	if (argc > 3)
 		t.prod_seed = get_argv(argv[3]);
+	t.batch = (argc > 4 && !strcmp(argv[4], "batch"));
 
 	t.size = t.head = t.tail = 0;
 	t.maxcount = maxcount;
@@ -110,11 +151,17 @@ int main(int argc, char **argv)
 	t.empty = sem_create(0);
 	t.full = sem_create(BUFFER_SIZE);
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	pthread_create(&tid[0], NULL, producer, &t);
 	pthread_create(&tid[1], NULL, consumer, &t);
 
 	pthread_join(tid[0], NULL);
 	pthread_join(tid[1], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(stderr, "%u items exchanged in %.3f ms\n", maxcount,
+		(end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6);
 
 	sem_destroy(t.empty);
 	sem_destroy(t.full);
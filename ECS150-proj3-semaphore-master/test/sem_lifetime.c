@@ -0,0 +1,108 @@
+/*
+ * Semaphore lifetime test
+ *
+ * Check that a thread which took a semaphore can destroy it right away, on
+ * semaphores created without flags and with SEM_HANDOFF.
+ *
+ * A releaser thread posts a semaphore the main thread is blocked on, and the
+ * main thread destroys the semaphore as soon as it gets the resource, while
+ * the releaser may still be inside sem_up(). This is repeated a given number
+ * of times (2000 by default), for a single resource and for batches taken
+ * with sem_down_n(); run under a memory checker, any access to the semaphore
+ * after it was freed is reported.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sem.h>
+
+#define MAXCOUNT	2000
+#define BATCH		4
+
+struct test_lifetime {
+	sem_t sem;
+	size_t n;
+};
+
+static void *releaser(void *arg)
+{
+	struct test_lifetime *t = (struct test_lifetime*)arg;
+
+	if (t->n == 1)
+		sem_up(t->sem);
+	else
+		sem_up_n(t->sem, t->n);
+
+	return NULL;
+}
+
+static void check_limits(int flags)
+{
+	sem_t sem;
+
+	assert(sem_create_ex((size_t)SEM_COUNT_MAX + 1, flags) == NULL);
+	sem = sem_create_ex(SEM_COUNT_MAX, flags);
+	assert(sem);
+	assert(sem_up_n(sem, (size_t)SEM_COUNT_MAX + 1) == -1);
+	assert(sem_down_n(sem, (size_t)SEM_COUNT_MAX + 1) == -1);
+	assert(sem_down_n(sem, SEM_COUNT_MAX) == 0);
+	assert(sem_trydown(sem) == -1);
+	assert(sem_destroy(sem) == 0);
+}
+
+static void check_destroy_after_down(int flags, size_t n, size_t maxcount)
+{
+	struct test_lifetime t = { NULL, n };
+	pthread_t tid;
+	size_t i, retries = 0;
+
+	for (i = 0; i < maxcount; i++) {
+		t.sem = sem_create_ex(0, flags);
+		assert(t.sem);
+		pthread_create(&tid, NULL, releaser, &t);
+		if (n == 1)
+			assert(sem_down(t.sem) == 0);
+		else
+			assert(sem_down_n(t.sem, n) == 0);
+
+		/* Only fails while another thread is still blocked on it */
+		while (sem_destroy(t.sem) == -1)
+			retries++;
+		pthread_join(tid, NULL);
+	}
+
+	printf("%s: destroyed %zu semaphores after taking %zu, %zu retries\n",
+	       (flags & SEM_HANDOFF) ? "handoff" : "default", maxcount, n,
+	       retries);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t maxcount = MAXCOUNT;
+
+	if (argc > 1)
+		maxcount = get_argv(argv[1]);
+
+	check_limits(0);
+	check_limits(SEM_HANDOFF);
+	check_destroy_after_down(0, 1, maxcount);
+	check_destroy_after_down(SEM_HANDOFF, 1, maxcount);
+	check_destroy_after_down(0, BATCH, maxcount);
+	check_destroy_after_down(SEM_HANDOFF, BATCH, maxcount);
+
+	return 0;
+}
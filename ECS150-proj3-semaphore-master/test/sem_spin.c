@@ -0,0 +1,151 @@
+/*
+ * Semaphore spinning test
+ *
+ * Test the spinning of sem_down() with sem_set_spin(SEM_SPIN_FORCE), which
+ * spins even when a single CPU is online.
+ *
+ * Two threads play ping-pong with two semaphores a given number of rounds (1000
+ * by default): with spinning forced, some of the waits must end while
+ * spinning, and none with spinning off. When the partner sleeps before each
+ * release, longer than any spin budget, the waits must go on to sleep.
+ *
+ * Then check that a semaphore cannot be destroyed while a thread spins on it,
+ * and that the spinning thread counts as blocked in sem_getvalue().
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sem.h>
+
+#define MAXCOUNT	1000
+#define SLEEP_ROUNDS	20
+#define SLEEP_NS	1000000
+
+struct test_spin {
+	sem_t ping;
+	sem_t pong;
+	size_t rounds;
+	long sleep_ns;
+};
+
+static void *partner(void *arg)
+{
+	struct test_spin *t = (struct test_spin*)arg;
+	struct timespec ts = { 0, t->sleep_ns };
+	size_t i;
+
+	for (i = 0; i < t->rounds; i++) {
+		sem_down(t->ping);
+		if (t->sleep_ns)
+			nanosleep(&ts, NULL);
+		sem_up(t->pong);
+	}
+
+	return NULL;
+}
+
+static void ping_pong(int spin, size_t rounds, long sleep_ns,
+		      struct sem_stats *stats)
+{
+	struct test_spin t = { sem_create(0), sem_create(0), rounds, sleep_ns };
+	pthread_t tid;
+	size_t i;
+
+	sem_set_spin(spin);
+	pthread_create(&tid, NULL, partner, &t);
+	for (i = 0; i < rounds; i++) {
+		sem_up(t.ping);
+		sem_down(t.pong);
+	}
+	pthread_join(tid, NULL);
+
+	assert(sem_getstats(t.pong, stats) == 0);
+	assert(sem_destroy(t.ping) == 0);
+	assert(sem_destroy(t.pong) == 0);
+}
+
+static void check_stats(size_t rounds)
+{
+	struct sem_stats stats;
+
+	ping_pong(SEM_SPIN_FORCE, rounds, 0, &stats);
+	printf("forced: %llu spin hits, %llu parks, %u ns budget\n",
+	       (unsigned long long)stats.spin_hits,
+	       (unsigned long long)stats.parks, stats.spin_ns);
+	assert(stats.spin_hits > 0);
+
+	ping_pong(0, rounds, 0, &stats);
+	printf("off: %llu spin hits, %llu parks\n",
+	       (unsigned long long)stats.spin_hits,
+	       (unsigned long long)stats.parks);
+	assert(stats.spin_hits == 0);
+
+	ping_pong(SEM_SPIN_FORCE, SLEEP_ROUNDS, SLEEP_NS, &stats);
+	printf("forced, sleeping partner: %llu spin hits, %llu parks\n",
+	       (unsigned long long)stats.spin_hits,
+	       (unsigned long long)stats.parks);
+	assert(stats.parks > 0);
+}
+
+static void *spinner(void *arg)
+{
+	sem_t sem = (sem_t)arg;
+
+	sem_down(sem);
+
+	return NULL;
+}
+
+static void check_destroy_while_spinning(void)
+{
+	sem_t sem = sem_create(0);
+	pthread_t tid;
+	int sval;
+
+	sem_set_spin(SEM_SPIN_FORCE);
+	pthread_create(&tid, NULL, spinner, sem);
+
+	/* Wait until the spinner is blocked, spinning or sleeping */
+	do {
+		sched_yield();
+		assert(sem_getvalue(sem, &sval) == 0);
+	} while (sval == 0);
+	assert(sval == -1);
+	assert(sem_destroy(sem) == -1);
+
+	sem_up(sem);
+	pthread_join(tid, NULL);
+	assert(sem_destroy(sem) == 0);
+	printf("destroy refused while a thread was blocked\n");
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t rounds = MAXCOUNT;
+
+	if (argc > 1)
+		rounds = get_argv(argv[1]);
+
+	assert(sem_set_spin(SEM_SPIN_FORCE) == 1);
+	assert(sem_set_spin(1) == SEM_SPIN_FORCE);
+	check_stats(rounds);
+	check_destroy_while_spinning();
+
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Semaphore timeout test
+ *
+ * Test sem_trydown() and sem_timeddown(), on semaphores created without flags
+ * and with SEM_HANDOFF.
+ *
+ * First check that taking an unavailable semaphore fails right away with
+ * sem_trydown(), and after the deadline with sem_timeddown(), leaving no
+ * blocked thread behind.
+ *
+ * A deadline too far away to count in nanoseconds must still block until a
+ * resource is released.
+ *
+ * Then let several threads take a semaphore with short deadlines, while a
+ * producer releases a given number of resources (2000 by default) over time.
+ * Every released resource must be either taken by a thread or still in the
+ * semaphore at the end: none can be lost by a thread timing out while it is
+ * released.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sem.h>
+
+#define MAXCOUNT	2000
+#define TAKERS		4
+#define TIMEOUT_NS	20000
+#define SLEEP_NS	200000000
+
+struct test_timeout {
+	sem_t sem;
+	size_t maxcount;
+	int done;
+};
+
+struct taker_count {
+	struct test_timeout *t;
+	size_t taken;
+	size_t timeouts;
+};
+
+static struct timespec deadline_in(long ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_nsec += ns;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+	return ts;
+}
+
+static double elapsed_ms(struct timespec *from)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - from->tv_sec) * 1e3 + (ts.tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static void *taker(void *arg)
+{
+	struct taker_count *c = (struct taker_count*)arg;
+	struct timespec deadline;
+
+	while (!__atomic_load_n(&c->t->done, __ATOMIC_ACQUIRE)) {
+		deadline = deadline_in(TIMEOUT_NS);
+		if (sem_timeddown(c->t->sem, &deadline) == 0)
+			c->taken++;
+		else
+			c->timeouts++;
+	}
+
+	return NULL;
+}
+
+static void check_unavailable(int flags)
+{
+	sem_t sem = sem_create_ex(0, flags);
+	struct timespec deadline, start;
+	double ms;
+	int sval;
+
+	assert(sem_trydown(NULL) == -1);
+	assert(sem_timeddown(NULL, &deadline) == -1);
+	assert(sem_timeddown(sem, NULL) == -1);
+	deadline.tv_sec = 0;
+	deadline.tv_nsec = 1000000000;
+	assert(sem_timeddown(sem, &deadline) == -1);
+
+	/* Nothing to take */
+	assert(sem_trydown(sem) == -1);
+	deadline.tv_nsec = 0;
+	assert(sem_timeddown(sem, &deadline) == -1);
+
+	/* Give up after the deadline, and leave no blocked thread */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = deadline_in(SLEEP_NS);
+	assert(sem_timeddown(sem, &deadline) == -1);
+	ms = elapsed_ms(&start);
+	assert(ms >= SLEEP_NS / 1e6);
+	assert(sem_getvalue(sem, &sval) == 0 && sval == 0);
+
+	/* Available resources are taken */
+	sem_up(sem);
+	sem_up(sem);
+	assert(sem_trydown(sem) == 0);
+	deadline.tv_sec = 0;
+	assert(sem_timeddown(sem, &deadline) == 0);
+	assert(sem_trydown(sem) == -1);
+
+	assert(sem_destroy(sem) == 0);
+	printf("%s: gave up after %.1f ms\n",
+	       (flags & SEM_HANDOFF) ? "handoff" : "default", ms);
+}
+
+static void *late_releaser(void *arg)
+{
+	struct timespec ts = { 0, SLEEP_NS / 4 };
+
+	nanosleep(&ts, NULL);
+	sem_up((sem_t)arg);
+
+	return NULL;
+}
+
+static void check_far_deadline(int flags)
+{
+	sem_t sem = sem_create_ex(0, flags);
+	/* The first second whose nanoseconds overflow 64 bits, and wrap around */
+	struct timespec deadline = { UINT64_MAX / 1000000000 + 1, 0 }, start;
+	pthread_t tid;
+	double ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&tid, NULL, late_releaser, sem);
+	assert(sem_timeddown(sem, &deadline) == 0);
+	ms = elapsed_ms(&start);
+	pthread_join(tid, NULL);
+	assert(ms >= SLEEP_NS / 4 / 1e6);
+
+	assert(sem_destroy(sem) == 0);
+	printf("%s: far deadline blocked for %.1f ms\n",
+	       (flags & SEM_HANDOFF) ? "handoff" : "default", ms);
+}
+
+static void check_race(int flags, size_t maxcount)
+{
+	struct test_timeout t = { 0 };
+	struct taker_count c[TAKERS] = { { 0 } };
+	pthread_t tid[TAKERS];
+	size_t i, taken = 0, timeouts = 0;
+	int sval;
+
+	t.sem = sem_create_ex(0, flags);
+	t.maxcount = maxcount;
+	for (i = 0; i < TAKERS; i++) {
+		c[i].t = &t;
+		pthread_create(&tid[i], NULL, taker, &c[i]);
+	}
+
+	/* Release the resources one by one, at about the pace of the deadlines */
+	for (i = 0; i < t.maxcount; i++) {
+		sem_up(t.sem);
+		if (i % 4 == 0)
+			sched_yield();
+	}
+	__atomic_store_n(&t.done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < TAKERS; i++)
+		pthread_join(tid[i], NULL);
+
+	for (i = 0; i < TAKERS; i++) {
+		taken += c[i].taken;
+		timeouts += c[i].timeouts;
+	}
+	assert(sem_getvalue(t.sem, &sval) == 0 && sval >= 0);
+	assert(taken + sval == t.maxcount);
+	assert(sem_destroy(t.sem) == 0);
+	printf("%s: %zu resources taken, %d left, %zu timeouts\n",
+	       (flags & SEM_HANDOFF) ? "handoff" : "default", taken, sval,
+	       timeouts);
+}
+
+static unsigned int get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX) {
+		perror("strtol");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	size_t maxcount = MAXCOUNT;
+
+	if (argc > 1)
+		maxcount = get_argv(argv[1]);
+
+	check_unavailable(0);
+	check_unavailable(SEM_HANDOFF);
+	check_far_deadline(0);
+	check_far_deadline(SEM_HANDOFF);
+	check_race(0, maxcount);
+	check_race(SEM_HANDOFF, maxcount);
+
+	return 0;
+}
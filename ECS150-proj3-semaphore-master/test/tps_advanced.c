@@ -1,10 +1,13 @@
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <tps.h>
 #include <sem.h>
@@ -13,18 +16,15 @@
 static char msg1[TPS_SIZE] = "Hello world!\n";
 static char msg2[TPS_SIZE] = "hello world!\n";
 
-static sem_t sem1, sem2;
-static pthread_t tid[4];
-void *latest_mmap_addr;
-
-// global variable to make address returned by mmap accessible
-void *__real_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off);
+#define FANOUT 8
+#define SIZED_SIZE (4 * TPS_SIZE + 100)
 
-void *__wrap_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
-{
-	latest_mmap_addr = __real_mmap(addr, len, prot, flags, fildes, off);
-	return latest_mmap_addr;
-}
+static sem_t sem1, sem2;
+static sem_t template_ready, clones_done;
+static pthread_t tid[18];
+static tps_snapshot_t shared_snapshot;
+static char persistent_path[64];
+static pthread_t template_tid;
 
 // tester for phase 2.2: attempting protected memory
 // if it works properly, the program wil print "TPS protection error!" and raise a segmentation fault
@@ -33,13 +33,22 @@ void *thread5(void* arg)
 	/* Create TPS */
 	tps_create();
 
-	/* Get TPS page address as allocated via mmap() */
-	char *tps_addr = latest_mmap_addr;
+	/* Get TPS page address; the page comes from the page pool, which carves
+	 * many pages out of each mmap(), so the address the latest mmap() returned
+	 * is not the page anymore: take it from tps_map(), and close the page
+	 * again right away */
+	char *tps_addr = tps_map(TPS_MAP_READ);
+	tps_unmap();
 
-	/* Cause an intentional TPS protection error */
+	/* Cause an intentional TPS protection error: a wild access to the mapped
+	 * area of the closed TPS page */
 	printf("Prepare to have seg fault\n");
 	tps_addr[0] = '\0';
 
+	/* Only reached with PROTECT=guard, which leaves the TPS area accessible:
+	 * overflowing it hits the guard page that follows instead */
+	tps_addr[TPS_SIZE] = '\0';
+
 	/* If no seg fault, we free the current tps */
 	tps_destroy();
 
@@ -122,6 +131,275 @@ void *thread3(void* arg)
 	return NULL;
 }
 
+// tester for copy-on-write fan-out: several threads clone the same template
+// each clone writes its own data, and must neither see the other clones' writes nor modify the template
+void *clone_worker(void* arg)
+{
+	size_t id = (size_t)arg;
+	char *buffer = malloc(TPS_SIZE);
+	char *expected = malloc(TPS_SIZE);
+
+	assert(tps_clone(template_tid) == 0);
+
+	/* Before writing, the clone shares the template's content */
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(msg1, buffer, TPS_SIZE));
+
+	/* Write in the middle of the page to break copy-on-write */
+	memcpy(expected, msg1, TPS_SIZE);
+	memset(expected + 100 + id, 'a' + id, 10);
+	assert(tps_write(100 + id, 10, expected + 100 + id) == 0);
+
+	/* Our page now holds the original content plus our own write */
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, TPS_SIZE));
+
+	/* Writing again goes to our private page */
+	expected[0] = 'A' + id;
+	assert(tps_write(0, 1, expected) == 0);
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, TPS_SIZE));
+
+	/* Half of the clones keep their TPS until the template is gone */
+	sem_up(clones_done);
+	if (id % 2) {
+		sem_down(template_ready);
+		memset(buffer, 0, TPS_SIZE);
+		assert(tps_read(0, TPS_SIZE, buffer) == 0);
+		assert(!memcmp(expected, buffer, TPS_SIZE));
+	}
+
+	assert(tps_destroy() == 0);
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
+void *thread6(void* arg)
+{
+	pthread_t workers[FANOUT];
+	char *buffer = malloc(TPS_SIZE);
+	size_t i;
+
+	/* Create the template TPS */
+	tps_create();
+	tps_write(0, TPS_SIZE, msg1);
+	template_tid = pthread_self();
+
+	/* Let all the workers clone and write, then make sure the template is untouched */
+	for (i = 0; i < FANOUT; i++)
+		pthread_create(&workers[i], NULL, clone_worker, (void*)i);
+	for (i = 0; i < FANOUT; i++)
+		sem_down(clones_done);
+
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(msg1, buffer, TPS_SIZE));
+	printf("Template unchanged after %d copy-on-write clones\n", FANOUT);
+
+	/* Destroy the template while some clones are still alive */
+	tps_destroy();
+	for (i = 0; i < FANOUT / 2; i++)
+		sem_up(template_ready);
+	for (i = 0; i < FANOUT; i++)
+		pthread_join(workers[i], NULL);
+	printf("Copy-on-write fan-out passed\n");
+
+	free(buffer);
+	return NULL;
+}
+
+// tester for direct access: the clone of a TPS mapped with tps_map()
+void *map_clone(void* arg)
+{
+	pthread_t owner = *(pthread_t*)arg;
+	char *buffer = malloc(TPS_SIZE);
+	char *tps_addr;
+
+	/* The owner is mapped for writing, so we get a copy right away */
+	assert(tps_clone(owner) == 0);
+	sem_up(sem1);
+	sem_down(sem2);
+
+	/* The owner wrote through its mapping after we cloned: we must not see it */
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(buffer[0] == 'X' && buffer[1] == msg1[1]);
+	tps_destroy();
+
+	/* Clone the unmapped owner, which shares its page, and write through a mapping */
+	assert(tps_clone(owner) == 0);
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	assert(tps_addr[1] == 'Y');
+	tps_addr[2] = 'Z';
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(buffer[2] == 'Z');
+	assert(tps_unmap() == 0);
+	printf("map clone: OK!\n");
+
+	sem_up(sem1);
+	sem_down(sem2);
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+void *thread7(void* arg)
+{
+	pthread_t self = pthread_self(), clone_tid;
+	char *buffer = malloc(TPS_SIZE);
+	char *tps_addr;
+
+	/* Mapping requires a TPS */
+	assert(tps_map(TPS_MAP_READ) == NULL);
+	assert(tps_unmap() == -1);
+
+	tps_create();
+
+	/* Write through the mapping, and read with tps_read() while mapped */
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	memcpy(tps_addr, msg1, TPS_SIZE);
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(msg1, buffer, TPS_SIZE));
+
+	/* tps_write() goes to the same place, and nested calls return the same address */
+	buffer[0] = 'X';
+	assert(tps_write(0, 1, buffer) == 0);
+	assert(tps_addr[0] == 'X');
+	assert(tps_map(TPS_MAP_READ) == tps_addr);
+	assert(tps_unmap() == 0);
+	assert(tps_addr[0] == 'X');
+	printf("thread7: map OK!\n");
+
+	/* Let a thread clone us while mapped for writing, then keep writing */
+	pthread_create(&clone_tid, NULL, map_clone, &self);
+	sem_down(sem1);
+	tps_addr[1] = 'Y';
+	assert(tps_unmap() == 0);
+	assert(tps_unmap() == -1);
+	sem_up(sem2);
+
+	/* Once the clone wrote to its copy, our TPS must be unchanged */
+	sem_down(sem1);
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(buffer[0] == 'X' && buffer[1] == 'Y' && buffer[2] == msg1[2]);
+	printf("thread7: read OK!\n");
+	sem_up(sem2);
+
+	pthread_join(clone_tid, NULL);
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+static void fill_pattern(char *buffer, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		buffer[i] = (char)(i % 251);
+}
+
+void *sized_clone(void* arg)
+{
+	pthread_t owner = *(pthread_t*)arg;
+	char *expected = malloc(SIZED_SIZE);
+	char *buffer = malloc(SIZED_SIZE);
+	char *tps_addr;
+
+	/* The clone has the same size, and the same content */
+	assert(tps_clone(owner) == 0);
+	fill_pattern(expected, SIZED_SIZE);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	assert(tps_read(SIZED_SIZE, 1, buffer) == -1);
+
+	/* Write across the boundary between pages 1 and 2, which copies them only */
+	memcpy(expected + 2 * TPS_SIZE - 2, "clone", 5);
+	assert(tps_write(2 * TPS_SIZE - 2, 5, "clone") == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* Map the clone, whose pages are no longer next to each other */
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	assert(!memcmp(expected, tps_addr, SIZED_SIZE));
+	tps_addr[3 * TPS_SIZE + 1] = 'M';
+	expected[3 * TPS_SIZE + 1] = 'M';
+	assert(tps_unmap() == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	printf("sized clone: OK!\n");
+
+	sem_up(sem1);
+	sem_down(sem2);
+	tps_destroy();
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
+void *thread8(void* arg)
+{
+	pthread_t self = pthread_self(), clone_tid;
+	char *expected = malloc(SIZED_SIZE);
+	char *buffer = malloc(SIZED_SIZE);
+	char *tps_addr;
+
+	assert(tps_create_sized(0) == -1);
+	assert(tps_create_sized(SIZE_MAX) == -1);
+	assert(tps_create_sized(SIZE_MAX - TPS_SIZE + 2) == -1);
+	assert(tps_create_sized(SIZED_SIZE) == 0);
+	assert(tps_create_sized(SIZED_SIZE) == -1);
+
+	/* The whole TPS starts zeroed */
+	memset(expected, 0, SIZED_SIZE);
+	memset(buffer, 1, SIZED_SIZE);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* Accesses span pages, and stop at the requested size */
+	assert(tps_write(TPS_SIZE - 3, 9, "boundary") == 0);
+	assert(tps_read(TPS_SIZE - 3, 9, buffer) == 0);
+	assert(!strcmp(buffer, "boundary"));
+	assert(tps_read(SIZED_SIZE - 1, 1, buffer) == 0);
+	assert(tps_read(SIZED_SIZE - 1, 2, buffer) == -1);
+	assert(tps_write(SIZED_SIZE, 0, buffer) == -1);
+
+	fill_pattern(expected, SIZED_SIZE);
+	assert(tps_write(0, SIZED_SIZE, expected) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* The whole TPS is mapped at a single address */
+	tps_addr = tps_map(TPS_MAP_READ);
+	assert(tps_addr);
+	assert(!memcmp(expected, tps_addr, SIZED_SIZE));
+	assert(tps_unmap() == 0);
+	printf("thread8: sized OK!\n");
+
+	/* Our TPS must not see what the clone writes */
+	pthread_create(&clone_tid, NULL, sized_clone, &self);
+	sem_down(sem1);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	printf("thread8: read OK!\n");
+	sem_up(sem2);
+
+	pthread_join(clone_tid, NULL);
+	tps_destroy();
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
 void *thread2(void* arg)
 {
 	/* Test case to check all exception cases */
@@ -182,6 +460,18 @@ void *thread2(void* arg)
 	printf("Test clone if current tid have a TPS\n");
 	assert(tps_clone(tid[0]) == -1);
 	printf("Good! Test clone exception case successfully\n");
+
+	/* Test accesses after the TPS is destroyed, then created again */
+	printf("Test read and write after destroy\n");
+	assert(tps_write(0, 4, "gone") == 0);
+	tps_destroy();
+	assert(tps_read(0, TPS_SIZE, buffer) == -1);
+	assert(tps_write(0, TPS_SIZE, buffer) == -1);
+	assert(tps_destroy() == -1);
+	assert(tps_create() == 0);
+	assert(tps_read(0, 4, buffer) == 0);
+	assert(!memcmp(buffer, "\0\0\0\0", 4));
+	printf("Good! Test access after destroy successfully\n");
 	printf("Done! Passed all exception cases\n");
 
 	tps_destroy();
@@ -218,14 +508,911 @@ void *thread1(void* arg)
 	return NULL;
 }
 
+void *vector_clone(void* arg)
+{
+	pthread_t owner = *(pthread_t*)arg;
+	char *expected = malloc(SIZED_SIZE);
+	char *buffer = malloc(SIZED_SIZE);
+	char head[4], tail[4];
+	struct tps_iovec iov[3] = {
+		{ 10, 4, "AAAA" },
+		{ 3 * TPS_SIZE - 2, 4, "BBBB" },
+		{ 12, 4, "CCCC" },
+	};
+
+	/* Segments write in order, and the shared pages they touch are copied once */
+	assert(tps_clone(owner) == 0);
+	fill_pattern(expected, SIZED_SIZE);
+	memcpy(expected, "first", 5);
+	memcpy(expected + TPS_SIZE - 2, "second", 6);
+	memcpy(expected + 10, "AACCCC", 6);
+	memcpy(expected + 3 * TPS_SIZE - 2, "BBBB", 4);
+	assert(tps_writev(iov, 3) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* Segments read in place, on private and still shared pages */
+	iov[0] = (struct tps_iovec){ 10, 4, head };
+	iov[1] = (struct tps_iovec){ SIZED_SIZE - 4, 4, tail };
+	assert(tps_readv(iov, 2) == 0);
+	assert(!memcmp(head, "AACC", 4));
+	assert(!memcmp(tail, expected + SIZED_SIZE - 4, 4));
+	printf("vector clone: OK!\n");
+
+	sem_up(sem1);
+	sem_down(sem2);
+	tps_destroy();
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
+void *thread9(void* arg)
+{
+	pthread_t self = pthread_self(), clone_tid;
+	char *expected = malloc(SIZED_SIZE);
+	char *buffer = malloc(SIZED_SIZE);
+	char first[8], second[8];
+	struct tps_iovec iov[2];
+
+	/* Without a TPS, or with invalid arguments, nothing is accessed */
+	iov[0] = (struct tps_iovec){ 0, 5, "first" };
+	iov[1] = (struct tps_iovec){ TPS_SIZE - 2, 6, "second" };
+	assert(tps_writev(iov, 2) == -1);
+	assert(tps_create_sized(SIZED_SIZE) == 0);
+	assert(tps_writev(NULL, 1) == -1);
+	assert(tps_writev(iov, -1) == -1);
+	assert(tps_writev(NULL, 0) == 0);
+
+	fill_pattern(expected, SIZED_SIZE);
+	assert(tps_write(0, SIZED_SIZE, expected) == 0);
+	iov[1].offset = SIZED_SIZE - 2;
+	assert(tps_writev(iov, 2) == -1);
+	iov[1].offset = TPS_SIZE - 2;
+	iov[1].buffer = NULL;
+	assert(tps_writev(iov, 2) == -1);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* Segments may span pages */
+	iov[1].buffer = "second";
+	assert(tps_writev(iov, 2) == 0);
+	memcpy(expected, "first", 5);
+	memcpy(expected + TPS_SIZE - 2, "second", 6);
+	iov[0].buffer = first;
+	iov[1].buffer = second;
+	assert(tps_readv(iov, 2) == 0);
+	assert(!memcmp(first, "first", 5));
+	assert(!memcmp(second, "second", 6));
+	printf("thread9: vector OK!\n");
+
+	/* Our TPS must not see what the clone writes */
+	pthread_create(&clone_tid, NULL, vector_clone, &self);
+	sem_down(sem1);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	printf("thread9: read OK!\n");
+	sem_up(sem2);
+
+	pthread_join(clone_tid, NULL);
+	tps_destroy();
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
+void *snapshot_thread(void* arg)
+{
+	/* A snapshot of a TPS of another size, which is empty */
+	tps_create();
+	shared_snapshot = tps_snapshot();
+	assert(shared_snapshot);
+	tps_destroy();
+	return NULL;
+}
+
+void *thread10(void* arg)
+{
+	pthread_t other;
+	char *expected = malloc(SIZED_SIZE);
+	char *buffer = malloc(SIZED_SIZE);
+	char *tps_addr;
+	size_t offset;
+	tps_snapshot_t snapshot;
+	struct tps_stats before, after;
+	int stats, i;
+
+	assert(tps_snapshot() == NULL);
+	assert(tps_restore(NULL) == -1);
+	assert(tps_snapshot_destroy(NULL) == -1);
+
+	tps_create_sized(SIZED_SIZE);
+	fill_pattern(expected, SIZED_SIZE);
+	assert(tps_write(0, SIZED_SIZE, expected) == 0);
+	snapshot = tps_snapshot();
+	assert(snapshot);
+
+	/* Speculative writes are rolled back, as many times as needed */
+	assert(tps_write(TPS_SIZE - 2, 4, "spec") == 0);
+	assert(tps_restore(snapshot) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	assert(tps_write(SIZED_SIZE - 4, 4, "more") == 0);
+	assert(tps_restore(snapshot) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* Restored again, the written page was copied back in place: writing to
+	 * it again needs no copy-on-write, and leaves the snapshot alone */
+	stats = (tps_stats(&before) == 0);
+	for (i = 0; i < 3; i++) {
+		assert(tps_write(SIZED_SIZE - 4, 4, "loop") == 0);
+		assert(tps_restore(snapshot) == 0);
+		assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+		assert(!memcmp(expected, buffer, SIZED_SIZE));
+	}
+	if (stats) {
+		assert(tps_stats(&after) == 0);
+		assert(after.cow_copies == before.cow_copies);
+	}
+
+	/* A mapped TPS cannot be restored, but can be snapshotted */
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	assert(tps_restore(snapshot) == -1);
+	assert(tps_snapshot_destroy(snapshot) == 0);
+	snapshot = tps_snapshot();
+	assert(snapshot);
+	tps_addr[0] = 'M';
+	assert(tps_unmap() == 0);
+	assert(tps_restore(snapshot) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* The TPS takes the size of the snapshot it is restored from */
+	pthread_create(&other, NULL, snapshot_thread, NULL);
+	pthread_join(other, NULL);
+	assert(tps_restore(shared_snapshot) == 0);
+	assert(tps_snapshot_destroy(shared_snapshot) == 0);
+	assert(tps_read(TPS_SIZE - 4, 4, buffer) == 0);
+	assert(!memcmp(buffer, "\0\0\0\0", 4));
+	assert(tps_read(TPS_SIZE, 1, buffer) == -1);
+	assert(tps_restore(snapshot) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+
+	/* A TPS grown by tps_alloc() since the snapshot shrinks back */
+	assert(tps_alloc(4 * SIZED_SIZE, &offset) == 0);
+	assert(tps_write(offset, 4, "grow") == 0);
+	assert(tps_restore(snapshot) == 0);
+	assert(tps_read(offset, 4, buffer) == -1);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	assert(tps_alloc(16, &offset) == 0);
+	assert(offset < SIZED_SIZE + TPS_SIZE);
+
+	/* The snapshot outlives the TPS it was taken from */
+	tps_destroy();
+	tps_create_sized(SIZED_SIZE);
+	assert(tps_restore(snapshot) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	assert(tps_snapshot_destroy(snapshot) == 0);
+	assert(tps_read(0, SIZED_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, SIZED_SIZE));
+	printf("thread10: snapshot OK!\n");
+
+	tps_destroy();
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
+// tester for bulk clones: a template seeds the TPS of workers that are not running yet
+void *bulk_worker(void* arg)
+{
+	size_t id = (size_t)arg;
+	char *buffer = malloc(TPS_SIZE);
+	char *expected = malloc(TPS_SIZE);
+
+	sem_down(template_ready);
+
+	/* The TPS is already there, with the template's content */
+	assert(tps_create() == -1);
+	memcpy(expected, msg1, TPS_SIZE);
+	expected[0] = 'W';
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, TPS_SIZE));
+
+	/* Writes stay private to the worker */
+	expected[1 + id] = 'a' + id;
+	assert(tps_write(1 + id, 1, expected + 1 + id) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(expected, buffer, TPS_SIZE));
+
+	sem_up(clones_done);
+	assert(tps_destroy() == 0);
+	free(expected);
+	free(buffer);
+	return NULL;
+}
+
+void *thread11(void* arg)
+{
+	pthread_t workers[FANOUT + 1];
+	char *buffer = malloc(TPS_SIZE);
+	char *tps_addr;
+	size_t i;
+
+	for (i = 0; i < FANOUT; i++)
+		pthread_create(&workers[i], NULL, bulk_worker, (void*)i);
+
+	/* The template must have a TPS, and the workers must be all different */
+	assert(tps_clone_many(pthread_self(), workers, FANOUT) == -1);
+	tps_create();
+	assert(tps_clone_many(pthread_self(), NULL, FANOUT) == -1);
+	assert(tps_clone_many(pthread_self(), workers, 0) == 0);
+	workers[FANOUT] = workers[0];
+	assert(tps_clone_many(pthread_self(), workers, FANOUT + 1) == -1);
+	workers[FANOUT] = pthread_self();
+	assert(tps_clone_many(pthread_self(), workers + 1, FANOUT) == -1);
+
+	/* The page mapped for writing is copied once for all the workers */
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	memcpy(tps_addr, msg1, TPS_SIZE);
+	tps_addr[0] = 'W';
+	assert(tps_clone_many(pthread_self(), workers, FANOUT) == 0);
+	assert(tps_clone_many(pthread_self(), workers, 1) == -1);
+	tps_addr[0] = 'V';
+	assert(tps_unmap() == 0);
+
+	for (i = 0; i < FANOUT; i++)
+		sem_up(template_ready);
+	for (i = 0; i < FANOUT; i++)
+		sem_down(clones_done);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(buffer[0] == 'V' && !memcmp(msg1 + 1, buffer + 1, TPS_SIZE - 1));
+
+	for (i = 0; i < FANOUT; i++)
+		pthread_join(workers[i], NULL);
+	printf("thread11: bulk clone OK!\n");
+
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+// tester for deduplication: clones that wrote back the template's content are folded into a single page again
+void *dedup_worker(void* arg)
+{
+	size_t id = (size_t)arg;
+	char *buffer = malloc(TPS_SIZE);
+
+	assert(tps_clone(template_tid) == 0);
+
+	/* Get a private copy, which ends up identical to the template, except for
+	 * the last worker */
+	assert(tps_write(0, 1, "x") == 0);
+	if (id < FANOUT - 1)
+		assert(tps_write(0, 1, msg1) == 0);
+	sem_up(clones_done);
+	sem_down(template_ready);
+
+	/* The content is unchanged, and writing again copies the page */
+	memset(buffer, 0, TPS_SIZE);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(buffer[0] == ((id < FANOUT - 1) ? msg1[0] : 'x'));
+	assert(!memcmp(msg1 + 1, buffer + 1, TPS_SIZE - 1));
+	assert(tps_write(1, 1, "y") == 0);
+	assert(tps_read(0, 2, buffer) == 0);
+	assert(buffer[1] == 'y');
+
+	/* Wait on another semaphore, so that a worker done early cannot take
+	 * the resource meant for a worker still waiting on template_ready */
+	sem_up(clones_done);
+	sem_down(sem2);
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+void *thread12(void* arg)
+{
+	pthread_t workers[FANOUT];
+	struct tps_dedup_stats stats;
+	char *buffer = malloc(TPS_SIZE);
+	size_t i;
+
+	assert(tps_dedup(NULL) == 0);
+
+	tps_create();
+	tps_write(0, TPS_SIZE, msg1);
+	template_tid = pthread_self();
+
+	for (i = 0; i < FANOUT; i++)
+		pthread_create(&workers[i], NULL, dedup_worker, (void*)i);
+	for (i = 0; i < FANOUT; i++)
+		sem_down(clones_done);
+
+	/* All the private copies but one are folded into the template's page */
+	assert(tps_dedup(&stats) == 0);
+	assert(stats.passes == 2);
+	assert(stats.pages_merged >= FANOUT - 1);
+	assert(stats.bytes_saved >= (FANOUT - 1) * TPS_SIZE);
+	assert(tps_dedup(&stats) == 0);
+	assert(stats.passes == 3);
+	assert(stats.pages_scanned > 0);
+	printf("thread12: dedup folded %zu pages, saved %zu bytes, %llu ns\n",
+	       stats.pages_merged, stats.bytes_saved,
+	       (unsigned long long)stats.cpu_ns);
+
+	for (i = 0; i < FANOUT; i++)
+		sem_up(template_ready);
+	for (i = 0; i < FANOUT; i++)
+		sem_down(clones_done);
+
+	/* The workers' writes did not reach the template */
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(msg1, buffer, TPS_SIZE));
+	printf("thread12: dedup OK!\n");
+
+	for (i = 0; i < FANOUT; i++)
+		sem_up(sem2);
+	for (i = 0; i < FANOUT; i++)
+		pthread_join(workers[i], NULL);
+
+	tps_destroy();
+	free(buffer);
+	return NULL;
+}
+
+// tester for atomic operations: counters of a clone are independent from the owner's
+void *atomic_clone(void* arg)
+{
+	pthread_t owner = *(pthread_t*)arg;
+	uint64_t old;
+
+	assert(tps_clone(owner) == 0);
+	sem_up(sem1);
+	sem_down(sem2);
+
+	/* The owner's later updates did not reach our copy */
+	assert(tps_fetch_add(8, 0, &old) == 0);
+	assert(old == 42);
+	assert(tps_fetch_add(TPS_SIZE - 8, 1, &old) == 0);
+	assert(old == 0);
+	printf("atomic clone: OK!\n");
+
+	sem_up(sem1);
+	sem_down(sem2);
+	tps_destroy();
+	return NULL;
+}
+
+void *thread13(void* arg)
+{
+	pthread_t self = pthread_self(), clone_tid;
+	uint64_t old, expected;
+	size_t i;
+
+	assert(tps_fetch_add(0, 1, &old) == -1);
+	tps_create();
+
+	/* Words must be aligned and in bound */
+	assert(tps_fetch_add(4, 1, &old) == -1);
+	assert(tps_exchange(TPS_SIZE, 1, &old) == -1);
+	assert(tps_cas(0, NULL, 1) == -1);
+
+	for (i = 0; i < 40; i++)
+		assert(tps_fetch_add(8, 1, NULL) == 0);
+	assert(tps_fetch_add(8, 2, &old) == 0);
+	assert(old == 40);
+	assert(tps_exchange(16, 7, &old) == 0);
+	assert(old == 0);
+	expected = 6;
+	assert(tps_cas(16, &expected, 9) == 1);
+	assert(expected == 7);
+	assert(tps_cas(16, &expected, 9) == 0);
+	assert(tps_read(16, sizeof(old), (char*)&old) == 0);
+	assert(old == 9);
+
+	/* Updating a shared word copies the page first */
+	pthread_create(&clone_tid, NULL, atomic_clone, &self);
+	sem_down(sem1);
+	assert(tps_fetch_add(8, 100, &old) == 0);
+	assert(old == 42);
+	sem_up(sem2);
+	sem_down(sem1);
+	assert(tps_read(TPS_SIZE - 8, sizeof(old), (char*)&old) == 0);
+	assert(old == 0);
+	assert(tps_fetch_add(8, 0, &old) == 0);
+	assert(old == 142);
+	printf("thread13: atomic OK!\n");
+	sem_up(sem2);
+
+	pthread_join(clone_tid, NULL);
+	tps_destroy();
+	return NULL;
+}
+
+// tester for statistics: writes to a clone, and exits before the counters are read
+void *stats_clone(void* arg)
+{
+	pthread_t owner = *(pthread_t*)arg;
+
+	assert(tps_clone(owner) == 0);
+	assert(tps_write(0, 5, msg2) == 0);
+	tps_destroy();
+	return NULL;
+}
+
+void *thread14(void* arg)
+{
+	pthread_t self = pthread_self(), clone_tid;
+	struct tps_stats before, after;
+	char buffer[TPS_SIZE];
+
+	assert(tps_stats(NULL) == -1);
+	if (tps_stats(&before) == -1) {
+		printf("thread14: statistics compiled out\n");
+		return NULL;
+	}
+
+	tps_create();
+	assert(tps_write(0, 10, msg1) == 0);
+	assert(tps_read(0, 20, buffer) == 0);
+
+	/* The counters of the clone are kept after it exits */
+	pthread_create(&clone_tid, NULL, stats_clone, &self);
+	pthread_join(clone_tid, NULL);
+
+	assert(tps_stats(&after) == 0);
+	assert(after.creates == before.creates + 1);
+	assert(after.clones == before.clones + 1);
+	assert(after.destroys == before.destroys + 1);
+	assert(after.cow_copies == before.cow_copies + 1);
+	assert(after.bytes_copied >= before.bytes_copied + TPS_SIZE);
+	assert(after.bytes_written == before.bytes_written + 15);
+	assert(after.bytes_read == before.bytes_read + 20);
+	assert(after.mprotect_calls > before.mprotect_calls);
+	assert(after.lookups > before.lookups);
+	assert(after.lookup_steps >= after.lookups - before.lookups + before.lookup_steps);
+
+	tps_destroy();
+	printf("thread14: stats OK!\n");
+	return NULL;
+}
+
+// tester for keys: a clone sees the slots of the TPS it cloned
+void *key_clone(void* arg)
+{
+	tps_key_t *keys = (tps_key_t*)arg;
+	uint64_t word;
+	char name[8];
+
+	assert(tps_clone(template_tid) == 0);
+	assert(tps_get(keys[0], &word) == 0);
+	assert(word == 42);
+	assert(tps_get(keys[1], name) == 0);
+	assert(!memcmp(name, "counter", 8));
+
+	word = 7;
+	assert(tps_set(keys[0], &word) == 0);
+	tps_destroy();
+	return NULL;
+}
+
+void *thread15(void* arg)
+{
+	tps_key_t keys[3];
+	pthread_t clone_tid;
+	uint64_t word = 42;
+	char buffer[TPS_SIZE], *tps_addr;
+	size_t i, found = TPS_SIZE;
+
+	/* Invalid layouts */
+	assert(tps_key_create(0, 8) == -1);
+	assert(tps_key_create(8, 3) == -1);
+	assert(tps_key_create(TPS_SIZE + 1, 1) == -1);
+
+	/* A word, a name padded to its cache line, and a word after it */
+	keys[0] = tps_key_create(sizeof(word), sizeof(word));
+	keys[1] = tps_key_create(8, 64);
+	keys[2] = tps_key_create(sizeof(word), sizeof(word));
+	assert(keys[0] >= 0 && keys[1] >= 0 && keys[2] >= 0);
+	assert(tps_key_create(TPS_SIZE, 1) == -1);
+
+	assert(tps_set(keys[0], &word) == -1);
+	tps_create();
+	assert(tps_set(-1, &word) == -1);
+	assert(tps_set(TPS_KEYS_MAX, &word) == -1);
+	assert(tps_set(keys[0], NULL) == -1);
+
+	assert(tps_set(keys[0], &word) == 0);
+	assert(tps_set(keys[1], "counter") == 0);
+	word = 0xffffffffffffffffULL;
+	assert(tps_set(keys[2], &word) == 0);
+
+	/* The name is alone in its cache line */
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	for (i = 0; i < TPS_SIZE; i++) {
+		if (!memcmp(buffer + i, "counter", 8)) {
+			found = i;
+			break;
+		}
+	}
+	assert(found < TPS_SIZE && found % 64 == 0);
+	for (i = found + 8; i < found + 64; i++)
+		assert(buffer[i] == 0);
+
+	/* Direct access while mapped */
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	word = 0;
+	assert(tps_get(keys[0], &word) == 0);
+	assert(word == 42);
+	word = 43;
+	assert(tps_set(keys[2], &word) == 0);
+	assert(!memcmp(tps_addr + found, "counter", 8));
+	assert(tps_unmap() == 0);
+	assert(tps_get(keys[2], &word) == 0);
+	assert(word == 43);
+
+	/* Written through the library while mapped read-only, read directly */
+	tps_addr = tps_map(TPS_MAP_READ);
+	assert(tps_addr);
+	word = 44;
+	assert(tps_set(keys[2], &word) == 0);
+	word = 0;
+	assert(tps_get(keys[2], &word) == 0);
+	assert(word == 44);
+	assert(tps_unmap() == 0);
+
+	/* Writing to the slot of a clone copies the page */
+	template_tid = pthread_self();
+	pthread_create(&clone_tid, NULL, key_clone, keys);
+	pthread_join(clone_tid, NULL);
+	assert(tps_get(keys[0], &word) == 0);
+	assert(word == 42);
+
+	tps_destroy();
+	printf("thread15: keys OK!\n");
+	return NULL;
+}
+
+// tester for arenas: a clone keeps the objects of the TPS it cloned, and allocates after them
+void *arena_clone(void* arg)
+{
+	size_t *offsets = (size_t*)arg;
+	size_t offset;
+	char buffer[TPS_SIZE];
+
+	assert(tps_clone(template_tid) == 0);
+	assert(tps_read(offsets[1], TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg2, TPS_SIZE));
+
+	assert(tps_alloc(16, &offset) == 0);
+	assert(offset > offsets[1]);
+	assert(tps_write(offset, 13, msg1) == 0);
+	assert(tps_write(offsets[0], 5, msg1) == 0);
+	tps_destroy();
+	return NULL;
+}
+
+void *thread16(void* arg)
+{
+	size_t offsets[3], offset;
+	pthread_t clone_tid;
+	char buffer[TPS_SIZE], *tps_addr;
+
+	assert(tps_alloc(16, &offset) == -1);
+	assert(tps_reset() == -1);
+	tps_create_sized(100);
+	assert(tps_alloc(0, &offset) == -1);
+	assert(tps_alloc(16, NULL) == -1);
+
+	/* Objects start after the area requested at creation, aligned */
+	assert(tps_alloc(5, &offsets[0]) == 0);
+	assert(offsets[0] == 112);
+	assert(tps_write(offsets[0], 5, msg2) == 0);
+
+	/* A page-sized object grows the TPS */
+	assert(tps_alloc(TPS_SIZE, &offsets[1]) == 0);
+	assert(offsets[1] == 128);
+	assert(tps_write(offsets[1], TPS_SIZE, msg2) == 0);
+
+	/* The clone's writes do not reach our objects */
+	template_tid = pthread_self();
+	pthread_create(&clone_tid, NULL, arena_clone, offsets);
+	pthread_join(clone_tid, NULL);
+	assert(tps_read(offsets[0], 5, buffer) == 0);
+	assert(!memcmp(buffer, msg2, 5));
+
+	/* Growing is refused while mapped, but objects that fit are fine */
+	tps_addr = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	assert(tps_addr);
+	assert(!memcmp(tps_addr + offsets[1], msg2, TPS_SIZE));
+	assert(tps_alloc(16, &offsets[2]) == 0);
+	assert(tps_alloc(4 * TPS_SIZE, &offset) == -1);
+	assert(tps_unmap() == 0);
+	assert(tps_alloc(4 * TPS_SIZE, &offset) == 0);
+	assert(offset > offsets[2]);
+	assert(tps_write(offset + 4 * TPS_SIZE - 1, 1, msg1) == 0);
+
+	/* Freeing everything at once */
+	assert(tps_reset() == 0);
+	assert(tps_alloc(5, &offset) == 0);
+	assert(offset == offsets[0]);
+
+	tps_destroy();
+	printf("thread16: arena OK!\n");
+	return NULL;
+}
+
+// tester for transfers: receives the TPS of thread17, and passes it back
+void *transfer_receiver(void* arg)
+{
+	pthread_t sender = *(pthread_t*)arg;
+	char buffer[TPS_SIZE];
+
+	sem_down(sem1);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg1, TPS_SIZE));
+	assert(tps_write(0, 5, msg2) == 0);
+	printf("transfer receiver: OK!\n");
+	sem_up(sem2);
+
+	/* The sender has a TPS again */
+	sem_down(sem1);
+	assert(tps_transfer(sender) == -1);
+	sem_up(sem2);
+	sem_down(sem1);
+	assert(tps_transfer(sender) == 0);
+	assert(tps_read(0, 5, buffer) == -1);
+	sem_up(sem2);
+	return NULL;
+}
+
+void *thread17(void* arg)
+{
+	pthread_t self = pthread_self(), receiver_tid;
+	char buffer[TPS_SIZE];
+
+	assert(tps_transfer(self) == -1);
+	tps_create();
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_transfer(self) == -1);
+
+	/* A mapped TPS cannot be given away */
+	pthread_create(&receiver_tid, NULL, transfer_receiver, &self);
+	assert(tps_map(TPS_MAP_READ));
+	assert(tps_transfer(receiver_tid) == -1);
+	assert(tps_unmap() == 0);
+
+	/* Once given away, the TPS is the receiver's */
+	assert(tps_transfer(receiver_tid) == 0);
+	assert(tps_read(0, 5, buffer) == -1);
+	sem_up(sem1);
+	sem_down(sem2);
+
+	/* Get the TPS back once we destroyed our new one */
+	tps_create();
+	sem_up(sem1);
+	sem_down(sem2);
+	assert(tps_destroy() == 0);
+	sem_up(sem1);
+	sem_down(sem2);
+	assert(tps_read(0, 5, buffer) == 0);
+	assert(!memcmp(buffer, msg2, 5));
+
+	pthread_join(receiver_tid, NULL);
+	tps_destroy();
+	printf("thread17: transfer OK!\n");
+	return NULL;
+}
+
+// tester for persistent TPSes: a clone writes to its copies only, and outlives the TPS it cloned
+void *persistent_clone(void* arg)
+{
+	char buffer[TPS_SIZE];
+
+	assert(tps_clone(template_tid) == 0);
+	assert(tps_create_persistent(persistent_path, TPS_SIZE) == -1);
+	assert(tps_write(0, 5, msg2) == 0);
+	sem_up(sem1);
+	sem_down(sem2);
+
+	/* The second page was detached from the file when its owner left */
+	assert(tps_read(TPS_SIZE, 5, buffer) == 0);
+	assert(!memcmp(buffer, msg2, 5));
+	assert(tps_write(TPS_SIZE, 5, msg2) == 0);
+	assert(tps_sync() == -1);
+	tps_destroy();
+	return NULL;
+}
+
+// tester for persistent TPSes: attaches to the file left by thread18, as after a restart
+void *persistent_restart(void* arg)
+{
+	char buffer[TPS_SIZE];
+
+	assert(tps_create_persistent(persistent_path, 2 * TPS_SIZE) == 0);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg1, TPS_SIZE));
+	assert(tps_read(TPS_SIZE, 5, buffer) == 0);
+	assert(!memcmp(buffer, msg1, 5));
+	tps_destroy();
+	printf("persistent restart: OK!\n");
+	return NULL;
+}
+
+void *thread18(void* arg)
+{
+	pthread_t clone_tid, restart_tid;
+	tps_snapshot_t snapshot;
+	char buffer[TPS_SIZE];
+	size_t offset;
+	int fd;
+
+	snprintf(persistent_path, sizeof(persistent_path), "/tmp/tps_advanced_%d.tps", (int)getpid());
+	unlink(persistent_path);
+	assert(tps_create_persistent(NULL, TPS_SIZE) == -1);
+	assert(tps_create_persistent(persistent_path, 0) == -1);
+	assert(tps_create_persistent(persistent_path, SIZE_MAX) == -1);
+	assert(tps_sync() == -1);
+
+	/* A new file starts zeroed */
+	assert(tps_create_persistent(persistent_path, 2 * TPS_SIZE) == 0);
+	assert(tps_read(0, 5, buffer) == 0);
+	assert(!memcmp(buffer, "\0\0\0\0\0", 5));
+	assert(tps_write(0, TPS_SIZE, msg1) == 0);
+	assert(tps_write(TPS_SIZE, 5, msg2) == 0);
+	assert(tps_sync() == 0);
+	fd = open(persistent_path, O_RDONLY);
+	assert(fd != -1);
+	assert(pread(fd, buffer, TPS_SIZE, 0) == TPS_SIZE);
+	assert(!memcmp(buffer, msg1, TPS_SIZE));
+
+	assert(tps_alloc(16, &offset) == -1);
+	snapshot = tps_snapshot();
+	assert(snapshot);
+	assert(tps_restore(snapshot) == -1);
+	tps_snapshot_destroy(snapshot);
+
+	/* Only our writes reach the file */
+	template_tid = pthread_self();
+	pthread_create(&clone_tid, NULL, persistent_clone, NULL);
+	sem_down(sem1);
+	assert(tps_read(0, TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, msg1, TPS_SIZE));
+	assert(tps_write(TPS_SIZE, 5, msg1) == 0);
+	tps_destroy();
+	sem_up(sem2);
+	pthread_join(clone_tid, NULL);
+
+	assert(pread(fd, buffer, TPS_SIZE, 0) == TPS_SIZE);
+	assert(!memcmp(buffer, msg1, TPS_SIZE));
+	assert(pread(fd, buffer, 5, TPS_SIZE) == 5);
+	assert(!memcmp(buffer, msg1, 5));
+	close(fd);
+
+	pthread_create(&restart_tid, NULL, persistent_restart, NULL);
+	pthread_join(restart_tid, NULL);
+
+	unlink(persistent_path);
+	printf("thread18: persistent OK!\n");
+	return NULL;
+}
+
+// tester for the userfaultfd backend: a clone fills its copies from the pages of thread19
+void *uffd_clone(void* arg)
+{
+	pthread_t *owner = (pthread_t*)arg;
+	char buffer[2 * TPS_SIZE];
+
+	assert(tps_clone(*owner) == 0);
+	assert(tps_write(TPS_SIZE, 4, "copy") == 0);
+	assert(tps_write(0, 4, "COPY") == 0);
+	assert(tps_read(0, 2 * TPS_SIZE, buffer) == 0);
+	assert(!memcmp(buffer, "COPY", 4) && !memcmp(buffer + 4, msg1 + 4, 9));
+	assert(!memcmp(buffer + TPS_SIZE, "copy", 4) && !memcmp(buffer + TPS_SIZE + 4, msg2 + 4, 9));
+	tps_destroy();
+	return NULL;
+}
+
+void *thread19(void* arg)
+{
+	pthread_t self = pthread_self(), clone_tid;
+	struct tps_stats before, after;
+	char buffer[2 * TPS_SIZE], zeros[2 * TPS_SIZE] = { 0 };
+	char *area;
+	int i;
+
+	int stats = (tps_stats(&before) == 0);
+
+	/* Pages released by a destroyed TPS come back filled with zeros */
+	for (i = 0; i < 2; i++) {
+		assert(tps_create_sized(2 * TPS_SIZE) == 0);
+		assert(tps_read(0, 2 * TPS_SIZE, buffer) == 0);
+		assert(!memcmp(buffer, zeros, 2 * TPS_SIZE));
+		assert(tps_write(0, 13, msg1) == 0);
+		assert(tps_write(TPS_SIZE, 13, msg2) == 0);
+		if (i == 0)
+			assert(tps_destroy() == 0);
+	}
+
+	/* Copies made on write hold the content of the shared pages */
+	pthread_create(&clone_tid, NULL, uffd_clone, &self);
+	pthread_join(clone_tid, NULL);
+	assert(tps_read(0, 13, buffer) == 0);
+	assert(!memcmp(buffer, msg1, 13));
+
+	/* Pages first touched through a mapping are filled as well */
+	assert(tps_destroy() == 0);
+	assert(tps_create_sized(2 * TPS_SIZE) == 0);
+	area = tps_map(PROT_READ | PROT_WRITE);
+	assert(area);
+	assert(!memcmp(area, zeros, 2 * TPS_SIZE));
+	area[TPS_SIZE + 1] = 'x';
+	assert(tps_unmap() == 0);
+	assert(tps_read(TPS_SIZE, 2, buffer) == 0);
+	assert(buffer[0] == 0 && buffer[1] == 'x');
+	tps_destroy();
+
+	if (stats) {
+		assert(tps_stats(&after) == 0);
+		printf("thread19: %llu pages copied and %llu pages filled by userfaultfd\n",
+		       (unsigned long long)(after.uffd_copies - before.uffd_copies),
+		       (unsigned long long)(after.uffd_fills - before.uffd_fills));
+	}
+	printf("thread19: userfaultfd OK!\n");
+	return NULL;
+}
+
 int main(int argc, char **argv)
 {
-	/* Create two semaphores for thread synchro */
+	struct tps_config config = {
+		.segv = 1,
+		.cow_mode = TPS_COW_COPY,
+	};
+
+	/* Run with "fault" as argument to break copy-on-write in the fault handler */
+	if (argc > 1 && !strcmp(argv[1], "fault"))
+		config.cow_mode = TPS_COW_FAULT;
+
+	/* Run with "pool" as argument to use a small prefaulted page pool, which
+	 * the fan-out test keeps refilling and trimming */
+	if (argc > 1 && !strcmp(argv[1], "pool")) {
+		config.pool_low = 1;
+		config.pool_high = 4;
+		config.pool_prefault = 1;
+	}
+
+	/* Run with "arena" as argument to carve all the TPS pages from a single
+	 * reservation */
+	if (argc > 1 && !strcmp(argv[1], "arena")) {
+		config.pool_high = 4;
+		config.arena_slots = 64;
+	}
+
+	/* Run with "uffd" as argument to fill the TPS pages with userfaultfd,
+	 * including the copies made in the fault handler; this falls back to the
+	 * default if userfaultfd is not available */
+	if (argc > 1 && !strcmp(argv[1], "uffd")) {
+		config.pool_high = 4;
+		config.uffd = 1;
+		config.cow_mode = TPS_COW_FAULT;
+	}
+
+	/* Create semaphores for thread synchro */
 	sem1 = sem_create(0);
 	sem2 = sem_create(0);
+	template_ready = sem_create(0);
+	clones_done = sem_create(0);
 
 	/* Init TPS API */
-	tps_init(1);
+	tps_init_config(&config);
 
 	/* Create thread 1 (simple test case) and join */
 	pthread_create(&tid[0], NULL, thread1, NULL);
@@ -239,6 +1426,62 @@ int main(int argc, char **argv)
 	pthread_create(&tid[2], NULL, thread3, NULL);
 	pthread_join(tid[2], NULL);
 
+	/* Create thread 6 (copy-on-write fan-out) and join */
+	pthread_create(&tid[4], NULL, thread6, NULL);
+	pthread_join(tid[4], NULL);
+
+	/* Create thread 7 (direct access) and join */
+	pthread_create(&tid[5], NULL, thread7, NULL);
+	pthread_join(tid[5], NULL);
+
+	/* Create thread 8 (TPS of several pages) and join */
+	pthread_create(&tid[6], NULL, thread8, NULL);
+	pthread_join(tid[6], NULL);
+
+	/* Create thread 9 (vectored accesses) and join */
+	pthread_create(&tid[7], NULL, thread9, NULL);
+	pthread_join(tid[7], NULL);
+
+	/* Create thread 10 (snapshots) and join */
+	pthread_create(&tid[8], NULL, thread10, NULL);
+	pthread_join(tid[8], NULL);
+
+	/* Create thread 11 (bulk clones) and join */
+	pthread_create(&tid[9], NULL, thread11, NULL);
+	pthread_join(tid[9], NULL);
+
+	/* Create thread 12 (deduplication) and join */
+	pthread_create(&tid[10], NULL, thread12, NULL);
+	pthread_join(tid[10], NULL);
+
+	/* Create thread 13 (atomic operations) and join */
+	pthread_create(&tid[11], NULL, thread13, NULL);
+	pthread_join(tid[11], NULL);
+
+	/* Create thread 14 (statistics) and join */
+	pthread_create(&tid[12], NULL, thread14, NULL);
+	pthread_join(tid[12], NULL);
+
+	/* Create thread 15 (keys) and join */
+	pthread_create(&tid[13], NULL, thread15, NULL);
+	pthread_join(tid[13], NULL);
+
+	/* Create thread 16 (arena allocator) and join */
+	pthread_create(&tid[14], NULL, thread16, NULL);
+	pthread_join(tid[14], NULL);
+
+	/* Create thread 17 (transfers) and join */
+	pthread_create(&tid[15], NULL, thread17, NULL);
+	pthread_join(tid[15], NULL);
+
+	/* Create thread 18 (persistent TPS) and join */
+	pthread_create(&tid[16], NULL, thread18, NULL);
+	pthread_join(tid[16], NULL);
+
+	/* Create thread 19 (userfaultfd backend) and join */
+	pthread_create(&tid[17], NULL, thread19, NULL);
+	pthread_join(tid[17], NULL);
+
 	/* Create thread 5 (protection test case) and join */
 	pthread_create(&tid[3], NULL, thread5, NULL);
 	pthread_join(tid[3], NULL);
@@ -246,5 +1489,7 @@ int main(int argc, char **argv)
 	/* Destroy resources and quit */
 	sem_destroy(sem1);
 	sem_destroy(sem2);
+	sem_destroy(template_ready);
+	sem_destroy(clones_done);
 	return 0;
 }
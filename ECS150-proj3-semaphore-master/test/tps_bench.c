@@ -0,0 +1,722 @@
+/*
+ * TPS benchmark
+ *
+ * Measure the cost of the TPS operations while many other threads also hold a
+ * TPS. For each population size, N - 1 parked threads create a TPS and block,
+ * then the measuring thread times its own TPS accesses. Since every access
+ * looks up the caller's TPS by thread ID, the time per access should stay flat
+ * as the population grows.
+ *
+ * Then compare the time per increment of a counter through tps_read() /
+ * tps_write(), which open and close the TPS twice, with tps_fetch_add(), which
+ * opens it once, with tps_get() / tps_set(), and with direct accesses through
+ * tps_map().
+ *
+ * Then compare updating several small fields of a TPS with one tps_write()
+ * call per field, and with a single tps_writev() call (same for reads).
+ *
+ * Then compare checkpointing a TPS before a speculative write by copying it
+ * out with tps_read(), and by taking a snapshot, then rolling the write back,
+ * with a snapshot per write and with a single snapshot restored after each
+ * write.
+ *
+ * Then compare the scratch objects of a request allocated with malloc() and
+ * freed one by one, and allocated with tps_alloc() and freed by tps_reset().
+ *
+ * Then compare seeding the TPS of many workers from a template, with one
+ * tps_clone() call per worker and with a single tps_clone_many() call.
+ *
+ * Then compare handing the TPS of a pipeline stage over to the next stage
+ * with tps_clone(), a first write by the receiver and a tps_destroy() by the
+ * sender, and with tps_transfer().
+ *
+ * Then let many clones of a template get a private copy of its page, with the
+ * same content again, and measure a deduplication pass folding them back.
+ *
+ * Then measure the TPS churn of short-lived threads: a create, a first write
+ * and a destroy, which are served by the page pool.
+ *
+ * Then measure cloning a large TPS and writing a few bytes to the clone, which
+ * only copies the page written to.
+ *
+ * Finally, compare warming up a large TPS after a restart by filling it again,
+ * and by attaching to the persistent TPS left by the previous run.
+ *
+ * Run with "arena" as argument to carve the TPS pages from a single arena.
+ * The number of mappings of the process is reported for each population, and
+ * among them, the number of mappings holding the TPS pages of the parked
+ * threads, which the thread stacks would otherwise drown out.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tps.h>
+#include <sem.h>
+
+#define ITERATIONS	20000
+#define STACK_SIZE	(64 * 1024)
+
+static const size_t populations[] = { 10, 100, 1000, 10000 };
+
+#define ARENA_SLOTS	(16 * 1024)
+#define LARGE_SIZE	(1024 * 1024)
+#define CLONES		2000
+#define FIELDS		8
+#define DEDUP_CLONES	1000
+#define REQUEST_OBJECTS	16
+
+static const size_t worker_counts[] = { 100, 1000, 10000 };
+
+static sem_t ready, release;
+static sem_t handed, handled;
+static pthread_t template_tid, stage_tid;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_addresses(const void *a, const void *b)
+{
+	uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Count the mappings holding at least one of the @n sorted @pages */
+static size_t count_tps_mappings(const uintptr_t *pages, size_t n)
+{
+	FILE *maps = fopen("/proc/self/maps", "r");
+	char line[512];
+	uintptr_t start, end;
+	size_t count = 0, i = 0;
+
+	if (!maps)
+		return 0;
+	while (fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &start, &end) != 2)
+			continue;
+		while (i < n && pages[i] < start)
+			i++;
+		if (i < n && pages[i] < end)
+			count++;
+	}
+	fclose(maps);
+	return count;
+}
+
+static size_t count_mappings(void)
+{
+	FILE *maps = fopen("/proc/self/maps", "r");
+	size_t count = 0;
+	int c;
+
+	if (!maps)
+		return 0;
+	while ((c = fgetc(maps)) != EOF)
+		if (c == '\n')
+			count++;
+	fclose(maps);
+	return count;
+}
+
+static void *parked_thread(void *arg)
+{
+	uintptr_t *page = (uintptr_t*)arg;
+
+	tps_create();
+	*page = (uintptr_t)tps_map(TPS_MAP_READ);
+	tps_unmap();
+
+	/* Tell main we hold a TPS, then wait until the measurement is over */
+	sem_up(ready);
+	sem_down(release);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *measure_thread(void *arg)
+{
+	double *ns_per_op = (double*)arg;
+	char buffer[8] = "bench";
+	size_t i;
+	double start;
+
+	tps_create();
+	tps_write(0, sizeof(buffer), buffer);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		tps_read(0, sizeof(buffer), buffer);
+	ns_per_op[0] = (now_ns() - start) / ITERATIONS;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		tps_write(0, sizeof(buffer), buffer);
+	ns_per_op[1] = (now_ns() - start) / ITERATIONS;
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *access_thread(void *arg)
+{
+	volatile unsigned int *counter;
+	unsigned int value = 0;
+	tps_key_t key = tps_key_create(sizeof(value), sizeof(value));
+	size_t i;
+	double start;
+
+	tps_create();
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_read(0, sizeof(value), (char*)&value);
+		value++;
+		tps_write(0, sizeof(value), (char*)&value);
+	}
+	printf("tps_read + tps_write: %8.1f ns/increment\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		tps_fetch_add(8, 1, NULL);
+	printf("tps_fetch_add:        %8.1f ns/increment\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_get(key, &value);
+		value++;
+		tps_set(key, &value);
+	}
+	printf("tps_get + tps_set:    %8.1f ns/increment\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	counter = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_get(key, &value);
+		value++;
+		tps_set(key, &value);
+	}
+	printf("mapped tps_get + set: %8.1f ns/increment\n",
+	       (now_ns() - start) / ITERATIONS);
+	tps_unmap();
+
+	start = now_ns();
+	counter = tps_map(TPS_MAP_READ | TPS_MAP_WRITE);
+	for (i = 0; i < ITERATIONS; i++)
+		(*counter)++;
+	tps_unmap();
+	printf("tps_map + direct:     %8.1f ns/increment\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *vector_thread(void *arg)
+{
+	unsigned int fields[FIELDS] = { 0 };
+	struct tps_iovec iov[FIELDS];
+	size_t i, j;
+	double start;
+
+	tps_create();
+
+	/* Fields of a per-thread struct, 64 bytes apart */
+	for (j = 0; j < FIELDS; j++) {
+		iov[j].offset = 64 * j;
+		iov[j].length = sizeof(fields[j]);
+		iov[j].buffer = (char*)&fields[j];
+	}
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		for (j = 0; j < FIELDS; j++)
+			tps_write(iov[j].offset, iov[j].length, iov[j].buffer);
+	printf("%d x tps_write: %8.1f ns/update\n", FIELDS,
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		tps_writev(iov, FIELDS);
+	printf("1 x tps_writev: %8.1f ns/update\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		for (j = 0; j < FIELDS; j++)
+			tps_read(iov[j].offset, iov[j].length, iov[j].buffer);
+	printf("%d x tps_read:  %8.1f ns/update\n", FIELDS,
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++)
+		tps_readv(iov, FIELDS);
+	printf("1 x tps_readv:  %8.1f ns/update\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *checkpoint_thread(void *arg)
+{
+	char *checkpoint = malloc(TPS_SIZE);
+	char buffer[8] = "specul";
+	tps_snapshot_t snapshot;
+	size_t i;
+	double start;
+
+	tps_create();
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_read(0, TPS_SIZE, checkpoint);
+		tps_write(0, sizeof(buffer), buffer);
+		tps_write(0, TPS_SIZE, checkpoint);
+	}
+	printf("tps_read copy + write + tps_write back: %8.1f ns/checkpoint\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		snapshot = tps_snapshot();
+		tps_write(0, sizeof(buffer), buffer);
+		tps_restore(snapshot);
+		tps_snapshot_destroy(snapshot);
+	}
+	printf("tps_snapshot + write + tps_restore:     %8.1f ns/checkpoint\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	/* The same snapshot is restored after every write */
+	snapshot = tps_snapshot();
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_write(0, sizeof(buffer), buffer);
+		tps_restore(snapshot);
+	}
+	printf("write + tps_restore, one snapshot:      %8.1f ns/checkpoint\n",
+	       (now_ns() - start) / ITERATIONS);
+	tps_snapshot_destroy(snapshot);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		snapshot = tps_snapshot();
+		tps_restore(snapshot);
+		tps_snapshot_destroy(snapshot);
+	}
+	printf("tps_snapshot + tps_restore, no write:   %8.1f ns/checkpoint\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	tps_destroy();
+	free(checkpoint);
+	return NULL;
+}
+
+static void *scratch_thread(void *arg)
+{
+	void *objects[REQUEST_OBJECTS];
+	size_t offset;
+	size_t i, j;
+	double start;
+
+	tps_create();
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		for (j = 0; j < REQUEST_OBJECTS; j++)
+			objects[j] = malloc(16 << (j % 5));
+		for (j = 0; j < REQUEST_OBJECTS; j++)
+			free(objects[j]);
+	}
+	printf("malloc + free:       %8.1f ns/request\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		for (j = 0; j < REQUEST_OBJECTS; j++)
+			tps_alloc(16 << (j % 5), &offset);
+		tps_reset();
+	}
+	printf("tps_alloc + reset:   %8.1f ns/request\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *clone_worker_thread(void *arg)
+{
+	double *clone_ns = (double*)arg;
+	double start;
+
+	/* Without a time slot, the TPS was seeded by the template */
+	sem_down(release);
+	if (clone_ns) {
+		start = now_ns();
+		tps_clone(template_tid);
+		*clone_ns = now_ns() - start;
+	}
+	tps_destroy();
+	return NULL;
+}
+
+static void run_seeding(size_t n)
+{
+	pthread_attr_t attr;
+	pthread_t *tids = malloc(n * sizeof(pthread_t));
+	double *clone_ns = malloc(n * sizeof(double));
+	double one_by_one = 0, bulk, start;
+	size_t i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+
+	/* Each worker clones the template itself */
+	for (i = 0; i < n; i++)
+		pthread_create(&tids[i], &attr, clone_worker_thread, &clone_ns[i]);
+	for (i = 0; i < n; i++)
+		sem_up(release);
+	for (i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+		one_by_one += clone_ns[i];
+	}
+
+	/* The template seeds all the workers before they run */
+	for (i = 0; i < n; i++)
+		pthread_create(&tids[i], &attr, clone_worker_thread, NULL);
+	start = now_ns();
+	tps_clone_many(template_tid, tids, n);
+	bulk = now_ns() - start;
+	for (i = 0; i < n; i++)
+		sem_up(release);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+
+	printf("%8zu workers: tps_clone %10.1f us total, "
+	       "tps_clone_many %10.1f us total\n", n, one_by_one / 1e3,
+	       bulk / 1e3);
+
+	pthread_attr_destroy(&attr);
+	free(clone_ns);
+	free(tids);
+}
+
+static void *template_thread(void *arg)
+{
+	size_t i;
+
+	tps_create();
+	template_tid = pthread_self();
+	for (i = 0; i < sizeof(worker_counts) / sizeof(worker_counts[0]); i++)
+		run_seeding(worker_counts[i]);
+	tps_destroy();
+	return NULL;
+}
+
+static void *dedup_worker_thread(void *arg)
+{
+	char zero = 0;
+
+	/* Get a private copy of the template's page, with the same content */
+	tps_clone(template_tid);
+	tps_write(0, 1, "x");
+	tps_write(0, 1, &zero);
+
+	sem_up(ready);
+	sem_down(release);
+	tps_destroy();
+	return NULL;
+}
+
+static void *stage_thread(void *arg)
+{
+	int transfer = *(int*)arg;
+	char buffer[8] = "stage 2";
+	size_t i;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		sem_down(handed);
+		if (!transfer)
+			tps_clone(template_tid);
+		tps_write(0, sizeof(buffer), buffer);
+		sem_up(handled);
+		tps_destroy();
+	}
+	return NULL;
+}
+
+static double run_handoff(int transfer)
+{
+	char buffer[8] = "stage 1";
+	size_t i;
+	double start;
+
+	template_tid = pthread_self();
+	pthread_create(&stage_tid, NULL, stage_thread, &transfer);
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_create();
+		tps_write(0, sizeof(buffer), buffer);
+		if (transfer) {
+			tps_transfer(stage_tid);
+			sem_up(handed);
+			sem_down(handled);
+		} else {
+			sem_up(handed);
+			sem_down(handled);
+			tps_destroy();
+		}
+	}
+	pthread_join(stage_tid, NULL);
+	return (now_ns() - start) / ITERATIONS;
+}
+
+static void *handoff_thread(void *arg)
+{
+	handed = sem_create(0);
+	handled = sem_create(0);
+
+	printf("tps_clone + write + tps_destroy: %8.1f ns/handoff\n",
+	       run_handoff(0));
+	printf("tps_transfer + write:            %8.1f ns/handoff\n",
+	       run_handoff(1));
+
+	sem_destroy(handed);
+	sem_destroy(handled);
+	return NULL;
+}
+
+static void *dedup_thread(void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t *tids = malloc(DEDUP_CLONES * sizeof(pthread_t));
+	struct tps_dedup_stats stats;
+	size_t i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+
+	tps_create();
+	template_tid = pthread_self();
+	for (i = 0; i < DEDUP_CLONES; i++)
+		pthread_create(&tids[i], &attr, dedup_worker_thread, NULL);
+	for (i = 0; i < DEDUP_CLONES; i++)
+		sem_down(ready);
+
+	tps_dedup(&stats);
+	printf("%8d clones: %zu pages scanned, %zu folded, %zu KiB saved, "
+	       "%.1f us of CPU\n", DEDUP_CLONES, stats.pages_scanned,
+	       stats.pages_merged, stats.bytes_saved / 1024, stats.cpu_ns / 1e3);
+
+	for (i = 0; i < DEDUP_CLONES; i++)
+		sem_up(release);
+	for (i = 0; i < DEDUP_CLONES; i++)
+		pthread_join(tids[i], NULL);
+	tps_destroy();
+
+	pthread_attr_destroy(&attr);
+	free(tids);
+	return NULL;
+}
+
+static void *churn_thread(void *arg)
+{
+	char buffer[8] = "churn";
+	size_t i;
+	double start;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_create();
+		tps_write(0, sizeof(buffer), buffer);
+		tps_destroy();
+	}
+	printf("create + write + destroy: %8.1f ns/TPS\n",
+	       (now_ns() - start) / ITERATIONS);
+
+	return NULL;
+}
+
+static void *large_clone_thread(void *arg)
+{
+	pthread_t owner = *(pthread_t*)arg;
+	char buffer[8] = "clone";
+	size_t i;
+	double start;
+
+	start = now_ns();
+	for (i = 0; i < CLONES; i++) {
+		tps_clone(owner);
+		tps_write(LARGE_SIZE / 2, sizeof(buffer), buffer);
+		tps_destroy();
+	}
+	printf("1 MiB TPS clone + write + destroy: %8.1f ns/clone\n",
+	       (now_ns() - start) / CLONES);
+
+	return NULL;
+}
+
+static void *large_thread(void *arg)
+{
+	pthread_t self = pthread_self(), tid;
+	char buffer[8] = "large";
+
+	tps_create_sized(LARGE_SIZE);
+	tps_write(LARGE_SIZE / 2, sizeof(buffer), buffer);
+
+	pthread_create(&tid, NULL, large_clone_thread, &self);
+	pthread_join(tid, NULL);
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *warm_thread(void *arg)
+{
+	char *cache = malloc(LARGE_SIZE);
+	char path[64];
+	double start;
+
+	snprintf(path, sizeof(path), "/tmp/tps_bench_%d.tps", (int)getpid());
+	memset(cache, 'c', LARGE_SIZE);
+
+	start = now_ns();
+	tps_create_sized(LARGE_SIZE);
+	tps_write(0, LARGE_SIZE, cache);
+	printf("create + fill:      %10.1f us\n", (now_ns() - start) / 1e3);
+	tps_destroy();
+
+	/* Previous run */
+	tps_create_persistent(path, LARGE_SIZE);
+	tps_write(0, LARGE_SIZE, cache);
+	start = now_ns();
+	tps_sync();
+	printf("tps_sync:           %10.1f us\n", (now_ns() - start) / 1e3);
+	tps_destroy();
+
+	start = now_ns();
+	tps_create_persistent(path, LARGE_SIZE);
+	tps_read(0, LARGE_SIZE, cache);
+	printf("attach + read back: %10.1f us\n", (now_ns() - start) / 1e3);
+	tps_destroy();
+
+	unlink(path);
+	free(cache);
+	return NULL;
+}
+
+static void run_population(size_t n)
+{
+	pthread_attr_t attr;
+	pthread_t *tids = malloc(n * sizeof(pthread_t));
+	uintptr_t *pages = malloc(n * sizeof(uintptr_t));
+	pthread_t measurer;
+	double ns_per_op[2];
+	size_t i, mappings, tps_mappings;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+
+	for (i = 0; i < n - 1; i++)
+		pthread_create(&tids[i], &attr, parked_thread, &pages[i]);
+	for (i = 0; i < n - 1; i++)
+		sem_down(ready);
+	mappings = count_mappings();
+	qsort(pages, n - 1, sizeof(uintptr_t), compare_addresses);
+	tps_mappings = count_tps_mappings(pages, n - 1);
+
+	pthread_create(&measurer, &attr, measure_thread, ns_per_op);
+	pthread_join(measurer, NULL);
+
+	for (i = 0; i < n - 1; i++)
+		sem_up(release);
+	for (i = 0; i < n - 1; i++)
+		pthread_join(tids[i], NULL);
+
+	printf("%8zu threads: tps_read %8.1f ns/op, tps_write %8.1f ns/op, "
+	       "%8zu mappings, %6zu with TPS pages\n", n, ns_per_op[0],
+	       ns_per_op[1], mappings, tps_mappings);
+
+	pthread_attr_destroy(&attr);
+	free(pages);
+	free(tids);
+}
+
+int main(int argc, char **argv)
+{
+	struct tps_config config = { 0 };
+	pthread_t tid;
+	size_t i;
+
+	if (argc > 1 && !strcmp(argv[1], "arena"))
+		config.arena_slots = ARENA_SLOTS;
+
+	ready = sem_create(0);
+	release = sem_create(0);
+
+	tps_init_config(&config);
+
+	printf("TPS lookup cost vs. number of threads holding a TPS\n");
+	for (i = 0; i < sizeof(populations) / sizeof(populations[0]); i++)
+		run_population(populations[i]);
+
+	printf("\nTPS access cost, 4-byte counter increments\n");
+	pthread_create(&tid, NULL, access_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nTPS access to %d fields\n", FIELDS);
+	pthread_create(&tid, NULL, vector_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nTPS checkpoints\n");
+	pthread_create(&tid, NULL, checkpoint_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nScratch objects of a request (%d objects)\n", REQUEST_OBJECTS);
+	pthread_create(&tid, NULL, scratch_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nSeeding the TPS of workers from a template\n");
+	pthread_create(&tid, NULL, template_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nHanding a TPS over to the next pipeline stage\n");
+	pthread_create(&tid, NULL, handoff_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nTPS deduplication\n");
+	pthread_create(&tid, NULL, dedup_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nTPS churn\n");
+	pthread_create(&tid, NULL, churn_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nCopy-on-write of a large TPS\n");
+	pthread_create(&tid, NULL, large_thread, NULL);
+	pthread_join(tid, NULL);
+
+	printf("\nWarm restart of a large TPS\n");
+	pthread_create(&tid, NULL, warm_thread, NULL);
+	pthread_join(tid, NULL);
+
+	sem_destroy(ready);
+	sem_destroy(release);
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * TPS scaling benchmark
+ *
+ * Measure the aggregate throughput of tps_read() / tps_write() when several
+ * threads access their TPS at the same time. For each thread count, every
+ * thread creates its own TPS, waits for the others, then loops over small
+ * reads and writes. Since accesses to private pages only take the lock of the
+ * caller's TPS, the aggregate throughput should grow with the number of CPUs.
+ *
+ * Then run the same loop with threads that read a TPS cloned from a common
+ * template, whose pages are shared and therefore go through the global lock.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tps.h>
+#include <sem.h>
+
+#define ITERATIONS	50000
+
+static const size_t thread_counts[] = { 1, 2, 4, 8, 16, 32 };
+
+static sem_t ready, start, done;
+static pthread_t template_tid;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *private_thread(void *arg)
+{
+	unsigned int value = 0;
+	size_t i;
+
+	tps_create();
+
+	sem_up(ready);
+	sem_down(start);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_read(0, sizeof(value), (char*)&value);
+		value++;
+		tps_write(0, sizeof(value), (char*)&value);
+	}
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *shared_thread(void *arg)
+{
+	unsigned int value = 0;
+	size_t i;
+
+	tps_clone(template_tid);
+
+	sem_up(ready);
+	sem_down(start);
+
+	for (i = 0; i < ITERATIONS; i++) {
+		tps_read(0, sizeof(value), (char*)&value);
+		tps_read(sizeof(value), sizeof(value), (char*)&value);
+	}
+
+	tps_destroy();
+	return NULL;
+}
+
+static void *template_thread(void *arg)
+{
+	char buffer[8] = "template";
+
+	tps_create();
+	tps_write(0, sizeof(buffer), buffer);
+
+	/* Keep the template alive until every clone is done */
+	sem_up(ready);
+	sem_down(done);
+
+	tps_destroy();
+	return NULL;
+}
+
+static double run(size_t n, void *(*func)(void*))
+{
+	pthread_t *tids = malloc(n * sizeof(pthread_t));
+	double begin, elapsed;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		pthread_create(&tids[i], NULL, func, NULL);
+	for (i = 0; i < n; i++)
+		sem_down(ready);
+
+	begin = now_ns();
+	for (i = 0; i < n; i++)
+		sem_up(start);
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	elapsed = now_ns() - begin;
+
+	free(tids);
+
+	/* Million accesses per second, over all threads */
+	return 2.0 * n * ITERATIONS / elapsed * 1e3;
+}
+
+int main(void)
+{
+	double private_rate, shared_rate;
+	size_t i;
+
+	ready = sem_create(0);
+	start = sem_create(0);
+	done = sem_create(0);
+
+	tps_init(1);
+
+	pthread_create(&template_tid, NULL, template_thread, NULL);
+	sem_down(ready);
+
+	printf("Aggregate TPS access throughput vs. number of threads\n");
+	for (i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+		private_rate = run(thread_counts[i], private_thread);
+		shared_rate = run(thread_counts[i], shared_thread);
+		printf("%4zu threads: private %8.2f Maccess/s, "
+		       "shared %8.2f Maccess/s\n",
+		       thread_counts[i], private_rate, shared_rate);
+	}
+
+	sem_up(done);
+	pthread_join(template_tid, NULL);
+
+	sem_destroy(ready);
+	sem_destroy(start);
+	sem_destroy(done);
+	return 0;
+}